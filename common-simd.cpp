@@ -0,0 +1,850 @@
+/*! \file common-simd.cpp
+ *  \brief Runtime-dispatched SIMD kernels for the i16 cross-correlation loops and the filter bank
+ */
+
+#include "common-simd.h"
+
+#include <algorithm>
+#include <climits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) && !defined(__EMSCRIPTEN__)
+#define KBD_AUDIO_SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define KBD_AUDIO_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// The register blocks are small arrays indexed by loops with a fixed trip count. They are kept in registers only
+// if these loops are fully unrolled, which GCC does not do on its own at -O2.
+#if defined(__clang__)
+#define KBD_AUDIO_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#define KBD_AUDIO_UNROLL _Pragma("GCC unroll 16")
+#else
+#define KBD_AUDIO_UNROLL
+#endif
+
+namespace {
+
+// number of vector iterations after which the i32 partial sums are flushed to i64
+constexpr int64_t kBlockIters = 16384;
+
+void calcCCSumsI16_scalar(const int16_t * a0, const int16_t * a1, int64_t n, int64_t & sum1, int64_t & sum12, int64_t & sum01) {
+    for (int64_t is = 0; is < n; ++is) {
+        int32_t v0 = a0[is];
+        int32_t v1 = a1[is];
+
+        sum1 += v1;
+        sum12 += v1*v1;
+        sum01 += v0*v1;
+    }
+}
+
+int64_t calcDotI16_scalar(const int16_t * a0, const int16_t * a1, int64_t n) {
+    int64_t sum01 = 0;
+    for (int64_t is = 0; is < n; ++is) {
+        sum01 += int32_t(a0[is])*int32_t(a1[is]);
+    }
+
+    return sum01;
+}
+
+// below this many i32 iterations per flush, the blocked kernels are slower than one dot product at a time
+constexpr int64_t kDotsMinIters = 4;
+
+// bound of the parts the split kernels multiply : a >> 8 is in [-128, 127] and a & 0xff in [0, 255]
+constexpr int32_t kSplitMaxAbs = 255;
+
+// number of loop iterations with 2 products per i32 lane that cannot overflow
+int64_t getDotsIters(int32_t maxAbsA, int32_t maxAbsB) {
+    const int64_t maxPair = 2*int64_t(std::max(1, maxAbsA))*int64_t(std::max(1, maxAbsB));
+    return std::min<int64_t>(kBlockIters, INT32_MAX/maxPair);
+}
+
+template<SIMD::TKernelDotI16 dot>
+void calcDotsI16_dot(const int16_t * const * a, const int16_t * const * b, int64_t n, int64_t * res) {
+    for (int ia = 0; ia < SIMD::kDotsRowsA; ++ia) {
+        for (int ib = 0; ib < SIMD::kDotsRowsB; ++ib) {
+            res[ia*SIMD::kDotsRowsB + ib] = dot(a[ia], b[ib], n);
+        }
+    }
+}
+
+void calcDotsI16_scalar(const int16_t * const * a, const int16_t * const * b, int64_t n, int32_t , int32_t , int64_t * res) {
+    calcDotsI16_dot<calcDotI16_scalar>(a, b, n, res);
+}
+
+// the vector kernels use separate multiplies and adds in the same order, so no variant can fuse them differently
+void filterBiquadsF_scalar(const float * coefficients, float * state, const float * x, int64_t n, float * y) {
+    constexpr int kL = SIMD::kBiquadLanes;
+
+    for (int l = 0; l < kL; ++l) {
+        const float a0 = coefficients[0*kL + l];
+        const float a1 = coefficients[1*kL + l];
+        const float a2 = coefficients[2*kL + l];
+        const float b1 = coefficients[3*kL + l];
+        const float b2 = coefficients[4*kL + l];
+
+        float x1 = state[0*kL + l];
+        float x2 = state[1*kL + l];
+        float y1 = state[2*kL + l];
+        float y2 = state[3*kL + l];
+
+        for (int64_t i = 0; i < n; ++i) {
+            const float yn = a0*x[i] + a1*x1 + a2*x2 - b1*y1 - b2*y2;
+
+            x2 = x1;
+            x1 = x[i];
+            y2 = y1;
+            y1 = yn;
+
+            y[i*kL + l] = yn;
+        }
+
+        state[0*kL + l] = x1;
+        state[1*kL + l] = x2;
+        state[2*kL + l] = y1;
+        state[3*kL + l] = y2;
+    }
+}
+
+#if defined(KBD_AUDIO_SIMD_X86)
+
+// _mm*_madd_epi16 adds two i16 products into an i32 lane. The only sum that does not fit is
+// (-32768)*(-32768)*2 = 2^31, which wraps to INT32_MIN - it is counted and corrected at the end.
+
+__attribute__((target("avx2")))
+int64_t hsum_epi64_avx2(__m256i v) {
+    alignas(32) int64_t tmp[4];
+    _mm256_store_si256((__m256i *) tmp, v);
+    return tmp[0] + tmp[1] + tmp[2] + tmp[3];
+}
+
+__attribute__((target("avx2")))
+void calcCCSumsI16_avx2(const int16_t * a0, const int16_t * a1, int64_t n, int64_t & sum1, int64_t & sum12, int64_t & sum01) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i imin = _mm256_set1_epi32(INT32_MIN);
+
+    __m256i acc1  = _mm256_setzero_si256();
+    __m256i acc12 = _mm256_setzero_si256();
+    __m256i acc01 = _mm256_setzero_si256();
+    __m256i accw  = _mm256_setzero_si256();
+
+    const int64_t n16 = n - n%16;
+
+    int64_t is = 0;
+    while (is < n16) {
+        const int64_t iend = std::min(n16, is + 16*kBlockIters);
+
+        __m256i s1 = _mm256_setzero_si256();
+        __m256i sw = _mm256_setzero_si256();
+
+        for (; is < iend; is += 16) {
+            const __m256i x0 = _mm256_loadu_si256((const __m256i *)(a0 + is));
+            const __m256i x1 = _mm256_loadu_si256((const __m256i *)(a1 + is));
+
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(x1, ones));
+
+            const __m256i p12 = _mm256_madd_epi16(x1, x1);
+            acc12 = _mm256_add_epi64(acc12, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(p12)));
+            acc12 = _mm256_add_epi64(acc12, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(p12, 1)));
+
+            const __m256i p01 = _mm256_madd_epi16(x0, x1);
+            acc01 = _mm256_add_epi64(acc01, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(p01)));
+            acc01 = _mm256_add_epi64(acc01, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(p01, 1)));
+            sw = _mm256_sub_epi32(sw, _mm256_cmpeq_epi32(p01, imin));
+        }
+
+        acc1 = _mm256_add_epi64(acc1, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(s1)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(s1, 1)));
+        accw = _mm256_add_epi64(accw, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(sw)));
+        accw = _mm256_add_epi64(accw, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(sw, 1)));
+    }
+
+    sum1  += hsum_epi64_avx2(acc1);
+    sum12 += hsum_epi64_avx2(acc12);
+    sum01 += hsum_epi64_avx2(acc01) + (hsum_epi64_avx2(accw) << 32);
+
+    calcCCSumsI16_scalar(a0 + n16, a1 + n16, n - n16, sum1, sum12, sum01);
+}
+
+__attribute__((target("avx2")))
+int64_t calcDotI16_avx2(const int16_t * a0, const int16_t * a1, int64_t n) {
+    const __m256i imin = _mm256_set1_epi32(INT32_MIN);
+
+    __m256i acc01 = _mm256_setzero_si256();
+    __m256i accw  = _mm256_setzero_si256();
+
+    const int64_t n16 = n - n%16;
+
+    int64_t is = 0;
+    while (is < n16) {
+        const int64_t iend = std::min(n16, is + 16*kBlockIters);
+
+        __m256i sw = _mm256_setzero_si256();
+
+        for (; is < iend; is += 16) {
+            const __m256i x0 = _mm256_loadu_si256((const __m256i *)(a0 + is));
+            const __m256i x1 = _mm256_loadu_si256((const __m256i *)(a1 + is));
+
+            const __m256i p01 = _mm256_madd_epi16(x0, x1);
+            acc01 = _mm256_add_epi64(acc01, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(p01)));
+            acc01 = _mm256_add_epi64(acc01, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(p01, 1)));
+            sw = _mm256_sub_epi32(sw, _mm256_cmpeq_epi32(p01, imin));
+        }
+
+        accw = _mm256_add_epi64(accw, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(sw)));
+        accw = _mm256_add_epi64(accw, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(sw, 1)));
+    }
+
+    return hsum_epi64_avx2(acc01) + (hsum_epi64_avx2(accw) << 32) + calcDotI16_scalar(a0 + n16, a1 + n16, n - n16);
+}
+
+// Same as calcDotsI16_avx2, for values of any magnitude. The rows of a are split as a = 256*(a >> 8) + (a & 0xff)
+// and both parts are multiplied separately - their products are small enough for the i32 partial sums to last at
+// least 128 iterations. Two rows of a are processed per pass, so that all partial sums stay in registers.
+__attribute__((target("avx2")))
+void calcDotsI16_split_avx2(const int16_t * const * a, const int16_t * const * b, int64_t n, int32_t maxAbsB, int64_t * res) {
+    constexpr int kRA = SIMD::kDotsRowsA;
+    constexpr int kRB = SIMD::kDotsRowsB;
+    constexpr int kRS = 2;
+
+    static_assert(kRA % kRS == 0, "whole passes over the rows of a");
+
+    const int64_t nIters = getDotsIters(kSplitMaxAbs, maxAbsB);
+    const __m256i maskLo = _mm256_set1_epi16(0xff);
+
+    const int64_t n16 = n - n%16;
+
+    for (int ia0 = 0; ia0 < kRA; ia0 += kRS) {
+        __m256i acc[kRS*kRB];
+        KBD_AUDIO_UNROLL
+        for (auto & x : acc) x = _mm256_setzero_si256();
+
+        int64_t is = 0;
+        while (is < n16) {
+            const int64_t iend = std::min(n16, is + 16*nIters);
+
+            __m256i sh[kRS*kRB];
+            __m256i sl[kRS*kRB];
+            KBD_AUDIO_UNROLL
+            for (auto & x : sh) x = _mm256_setzero_si256();
+            KBD_AUDIO_UNROLL
+            for (auto & x : sl) x = _mm256_setzero_si256();
+
+            for (; is < iend; is += 16) {
+                __m256i xb[kRB];
+                KBD_AUDIO_UNROLL
+                for (int ib = 0; ib < kRB; ++ib) {
+                    xb[ib] = _mm256_loadu_si256((const __m256i *)(b[ib] + is));
+                }
+
+                KBD_AUDIO_UNROLL
+                for (int ia = 0; ia < kRS; ++ia) {
+                    const __m256i xa = _mm256_loadu_si256((const __m256i *)(a[ia0 + ia] + is));
+                    const __m256i xh = _mm256_srai_epi16(xa, 8);
+                    const __m256i xl = _mm256_and_si256(xa, maskLo);
+                    KBD_AUDIO_UNROLL
+                    for (int ib = 0; ib < kRB; ++ib) {
+                        sh[ia*kRB + ib] = _mm256_add_epi32(sh[ia*kRB + ib], _mm256_madd_epi16(xh, xb[ib]));
+                        sl[ia*kRB + ib] = _mm256_add_epi32(sl[ia*kRB + ib], _mm256_madd_epi16(xl, xb[ib]));
+                    }
+                }
+            }
+
+            KBD_AUDIO_UNROLL
+            for (int k = 0; k < kRS*kRB; ++k) {
+                acc[k] = _mm256_add_epi64(acc[k], _mm256_slli_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(sh[k])), 8));
+                acc[k] = _mm256_add_epi64(acc[k], _mm256_slli_epi64(_mm256_cvtepi32_epi64(_mm256_extracti128_si256(sh[k], 1)), 8));
+                acc[k] = _mm256_add_epi64(acc[k], _mm256_cvtepi32_epi64(_mm256_castsi256_si128(sl[k])));
+                acc[k] = _mm256_add_epi64(acc[k], _mm256_cvtepi32_epi64(_mm256_extracti128_si256(sl[k], 1)));
+            }
+        }
+
+        KBD_AUDIO_UNROLL
+        for (int ia = 0; ia < kRS; ++ia) {
+            KBD_AUDIO_UNROLL
+            for (int ib = 0; ib < kRB; ++ib) {
+                res[(ia0 + ia)*kRB + ib] = hsum_epi64_avx2(acc[ia*kRB + ib]) + calcDotI16_scalar(a[ia0 + ia] + n16, b[ib] + n16, n - n16);
+            }
+        }
+    }
+}
+
+// Block of dot products with the rows of a and b held in registers. Products are accumulated
+// in i32 for as many iterations as maxAbsA and maxAbsB allow and then flushed to i64.
+__attribute__((target("avx2")))
+void calcDotsI16_avx2(const int16_t * const * a, const int16_t * const * b, int64_t n, int32_t maxAbsA, int32_t maxAbsB, int64_t * res) {
+    constexpr int kRA = SIMD::kDotsRowsA;
+    constexpr int kRB = SIMD::kDotsRowsB;
+
+    const int64_t nIters = getDotsIters(maxAbsA, maxAbsB);
+    if (nIters < kDotsMinIters) {
+        calcDotsI16_split_avx2(a, b, n, maxAbsB, res);
+        return;
+    }
+
+    __m256i acc[kRA*kRB];
+    KBD_AUDIO_UNROLL
+    for (auto & x : acc) x = _mm256_setzero_si256();
+
+    const int64_t n16 = n - n%16;
+
+    int64_t is = 0;
+    while (is < n16) {
+        const int64_t iend = std::min(n16, is + 16*nIters);
+
+        __m256i s[kRA*kRB];
+        KBD_AUDIO_UNROLL
+        for (auto & x : s) x = _mm256_setzero_si256();
+
+        for (; is < iend; is += 16) {
+            __m256i xb[kRB];
+            KBD_AUDIO_UNROLL
+            for (int ib = 0; ib < kRB; ++ib) {
+                xb[ib] = _mm256_loadu_si256((const __m256i *)(b[ib] + is));
+            }
+
+            KBD_AUDIO_UNROLL
+            for (int ia = 0; ia < kRA; ++ia) {
+                const __m256i xa = _mm256_loadu_si256((const __m256i *)(a[ia] + is));
+                KBD_AUDIO_UNROLL
+                for (int ib = 0; ib < kRB; ++ib) {
+                    s[ia*kRB + ib] = _mm256_add_epi32(s[ia*kRB + ib], _mm256_madd_epi16(xa, xb[ib]));
+                }
+            }
+        }
+
+        KBD_AUDIO_UNROLL
+        for (int k = 0; k < kRA*kRB; ++k) {
+            acc[k] = _mm256_add_epi64(acc[k], _mm256_cvtepi32_epi64(_mm256_castsi256_si128(s[k])));
+            acc[k] = _mm256_add_epi64(acc[k], _mm256_cvtepi32_epi64(_mm256_extracti128_si256(s[k], 1)));
+        }
+    }
+
+    KBD_AUDIO_UNROLL
+    for (int ia = 0; ia < kRA; ++ia) {
+        KBD_AUDIO_UNROLL
+        for (int ib = 0; ib < kRB; ++ib) {
+            res[ia*kRB + ib] = hsum_epi64_avx2(acc[ia*kRB + ib]) + calcDotI16_scalar(a[ia] + n16, b[ib] + n16, n - n16);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void filterBiquadsF_avx2(const float * coefficients, float * state, const float * x, int64_t n, float * y) {
+    static_assert(SIMD::kBiquadLanes == 8, "one __m256 per coefficient");
+
+    const __m256 a0 = _mm256_loadu_ps(coefficients + 0*8);
+    const __m256 a1 = _mm256_loadu_ps(coefficients + 1*8);
+    const __m256 a2 = _mm256_loadu_ps(coefficients + 2*8);
+    const __m256 b1 = _mm256_loadu_ps(coefficients + 3*8);
+    const __m256 b2 = _mm256_loadu_ps(coefficients + 4*8);
+
+    __m256 x1 = _mm256_loadu_ps(state + 0*8);
+    __m256 x2 = _mm256_loadu_ps(state + 1*8);
+    __m256 y1 = _mm256_loadu_ps(state + 2*8);
+    __m256 y2 = _mm256_loadu_ps(state + 3*8);
+
+    for (int64_t i = 0; i < n; ++i) {
+        const __m256 xn = _mm256_set1_ps(x[i]);
+
+        __m256 yn = _mm256_mul_ps(a0, xn);
+        yn = _mm256_add_ps(yn, _mm256_mul_ps(a1, x1));
+        yn = _mm256_add_ps(yn, _mm256_mul_ps(a2, x2));
+        yn = _mm256_sub_ps(yn, _mm256_mul_ps(b1, y1));
+        yn = _mm256_sub_ps(yn, _mm256_mul_ps(b2, y2));
+
+        x2 = x1;
+        x1 = xn;
+        y2 = y1;
+        y1 = yn;
+
+        _mm256_storeu_ps(y + i*8, yn);
+    }
+
+    _mm256_storeu_ps(state + 0*8, x1);
+    _mm256_storeu_ps(state + 1*8, x2);
+    _mm256_storeu_ps(state + 2*8, y1);
+    _mm256_storeu_ps(state + 3*8, y2);
+}
+
+__attribute__((target("sse4.1")))
+int64_t hsum_epi64_sse41(__m128i v) {
+    alignas(16) int64_t tmp[2];
+    _mm_store_si128((__m128i *) tmp, v);
+    return tmp[0] + tmp[1];
+}
+
+__attribute__((target("sse4.1")))
+void calcCCSumsI16_sse41(const int16_t * a0, const int16_t * a1, int64_t n, int64_t & sum1, int64_t & sum12, int64_t & sum01) {
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i imin = _mm_set1_epi32(INT32_MIN);
+
+    __m128i acc1  = _mm_setzero_si128();
+    __m128i acc12 = _mm_setzero_si128();
+    __m128i acc01 = _mm_setzero_si128();
+    __m128i accw  = _mm_setzero_si128();
+
+    const int64_t n8 = n - n%8;
+
+    int64_t is = 0;
+    while (is < n8) {
+        const int64_t iend = std::min(n8, is + 8*kBlockIters);
+
+        __m128i s1 = _mm_setzero_si128();
+        __m128i sw = _mm_setzero_si128();
+
+        for (; is < iend; is += 8) {
+            const __m128i x0 = _mm_loadu_si128((const __m128i *)(a0 + is));
+            const __m128i x1 = _mm_loadu_si128((const __m128i *)(a1 + is));
+
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(x1, ones));
+
+            const __m128i p12 = _mm_madd_epi16(x1, x1);
+            acc12 = _mm_add_epi64(acc12, _mm_cvtepu32_epi64(p12));
+            acc12 = _mm_add_epi64(acc12, _mm_cvtepu32_epi64(_mm_srli_si128(p12, 8)));
+
+            const __m128i p01 = _mm_madd_epi16(x0, x1);
+            acc01 = _mm_add_epi64(acc01, _mm_cvtepi32_epi64(p01));
+            acc01 = _mm_add_epi64(acc01, _mm_cvtepi32_epi64(_mm_srli_si128(p01, 8)));
+            sw = _mm_sub_epi32(sw, _mm_cmpeq_epi32(p01, imin));
+        }
+
+        acc1 = _mm_add_epi64(acc1, _mm_cvtepi32_epi64(s1));
+        acc1 = _mm_add_epi64(acc1, _mm_cvtepi32_epi64(_mm_srli_si128(s1, 8)));
+        accw = _mm_add_epi64(accw, _mm_cvtepi32_epi64(sw));
+        accw = _mm_add_epi64(accw, _mm_cvtepi32_epi64(_mm_srli_si128(sw, 8)));
+    }
+
+    sum1  += hsum_epi64_sse41(acc1);
+    sum12 += hsum_epi64_sse41(acc12);
+    sum01 += hsum_epi64_sse41(acc01) + (hsum_epi64_sse41(accw) << 32);
+
+    calcCCSumsI16_scalar(a0 + n8, a1 + n8, n - n8, sum1, sum12, sum01);
+}
+
+__attribute__((target("sse4.1")))
+int64_t calcDotI16_sse41(const int16_t * a0, const int16_t * a1, int64_t n) {
+    const __m128i imin = _mm_set1_epi32(INT32_MIN);
+
+    __m128i acc01 = _mm_setzero_si128();
+    __m128i accw  = _mm_setzero_si128();
+
+    const int64_t n8 = n - n%8;
+
+    int64_t is = 0;
+    while (is < n8) {
+        const int64_t iend = std::min(n8, is + 8*kBlockIters);
+
+        __m128i sw = _mm_setzero_si128();
+
+        for (; is < iend; is += 8) {
+            const __m128i x0 = _mm_loadu_si128((const __m128i *)(a0 + is));
+            const __m128i x1 = _mm_loadu_si128((const __m128i *)(a1 + is));
+
+            const __m128i p01 = _mm_madd_epi16(x0, x1);
+            acc01 = _mm_add_epi64(acc01, _mm_cvtepi32_epi64(p01));
+            acc01 = _mm_add_epi64(acc01, _mm_cvtepi32_epi64(_mm_srli_si128(p01, 8)));
+            sw = _mm_sub_epi32(sw, _mm_cmpeq_epi32(p01, imin));
+        }
+
+        accw = _mm_add_epi64(accw, _mm_cvtepi32_epi64(sw));
+        accw = _mm_add_epi64(accw, _mm_cvtepi32_epi64(_mm_srli_si128(sw, 8)));
+    }
+
+    return hsum_epi64_sse41(acc01) + (hsum_epi64_sse41(accw) << 32) + calcDotI16_scalar(a0 + n8, a1 + n8, n - n8);
+}
+
+// see calcDotsI16_split_avx2
+__attribute__((target("sse4.1")))
+void calcDotsI16_split_sse41(const int16_t * const * a, const int16_t * const * b, int64_t n, int32_t maxAbsB, int64_t * res) {
+    constexpr int kRA = SIMD::kDotsRowsA;
+    constexpr int kRB = SIMD::kDotsRowsB;
+    constexpr int kRS = 2;
+
+    static_assert(kRA % kRS == 0, "whole passes over the rows of a");
+
+    const int64_t nIters = getDotsIters(kSplitMaxAbs, maxAbsB);
+    const __m128i maskLo = _mm_set1_epi16(0xff);
+
+    const int64_t n8 = n - n%8;
+
+    for (int ia0 = 0; ia0 < kRA; ia0 += kRS) {
+        __m128i acc[kRS*kRB];
+        KBD_AUDIO_UNROLL
+        for (auto & x : acc) x = _mm_setzero_si128();
+
+        int64_t is = 0;
+        while (is < n8) {
+            const int64_t iend = std::min(n8, is + 8*nIters);
+
+            __m128i sh[kRS*kRB];
+            __m128i sl[kRS*kRB];
+            KBD_AUDIO_UNROLL
+            for (auto & x : sh) x = _mm_setzero_si128();
+            KBD_AUDIO_UNROLL
+            for (auto & x : sl) x = _mm_setzero_si128();
+
+            for (; is < iend; is += 8) {
+                __m128i xb[kRB];
+                KBD_AUDIO_UNROLL
+                for (int ib = 0; ib < kRB; ++ib) {
+                    xb[ib] = _mm_loadu_si128((const __m128i *)(b[ib] + is));
+                }
+
+                KBD_AUDIO_UNROLL
+                for (int ia = 0; ia < kRS; ++ia) {
+                    const __m128i xa = _mm_loadu_si128((const __m128i *)(a[ia0 + ia] + is));
+                    const __m128i xh = _mm_srai_epi16(xa, 8);
+                    const __m128i xl = _mm_and_si128(xa, maskLo);
+                    KBD_AUDIO_UNROLL
+                    for (int ib = 0; ib < kRB; ++ib) {
+                        sh[ia*kRB + ib] = _mm_add_epi32(sh[ia*kRB + ib], _mm_madd_epi16(xh, xb[ib]));
+                        sl[ia*kRB + ib] = _mm_add_epi32(sl[ia*kRB + ib], _mm_madd_epi16(xl, xb[ib]));
+                    }
+                }
+            }
+
+            KBD_AUDIO_UNROLL
+            for (int k = 0; k < kRS*kRB; ++k) {
+                acc[k] = _mm_add_epi64(acc[k], _mm_slli_epi64(_mm_cvtepi32_epi64(sh[k]), 8));
+                acc[k] = _mm_add_epi64(acc[k], _mm_slli_epi64(_mm_cvtepi32_epi64(_mm_srli_si128(sh[k], 8)), 8));
+                acc[k] = _mm_add_epi64(acc[k], _mm_cvtepi32_epi64(sl[k]));
+                acc[k] = _mm_add_epi64(acc[k], _mm_cvtepi32_epi64(_mm_srli_si128(sl[k], 8)));
+            }
+        }
+
+        KBD_AUDIO_UNROLL
+        for (int ia = 0; ia < kRS; ++ia) {
+            KBD_AUDIO_UNROLL
+            for (int ib = 0; ib < kRB; ++ib) {
+                res[(ia0 + ia)*kRB + ib] = hsum_epi64_sse41(acc[ia*kRB + ib]) + calcDotI16_scalar(a[ia0 + ia] + n8, b[ib] + n8, n - n8);
+            }
+        }
+    }
+}
+
+__attribute__((target("sse4.1")))
+void calcDotsI16_sse41(const int16_t * const * a, const int16_t * const * b, int64_t n, int32_t maxAbsA, int32_t maxAbsB, int64_t * res) {
+    constexpr int kRA = SIMD::kDotsRowsA;
+    constexpr int kRB = SIMD::kDotsRowsB;
+
+    const int64_t nIters = getDotsIters(maxAbsA, maxAbsB);
+    if (nIters < kDotsMinIters) {
+        calcDotsI16_split_sse41(a, b, n, maxAbsB, res);
+        return;
+    }
+
+    __m128i acc[kRA*kRB];
+    KBD_AUDIO_UNROLL
+    for (auto & x : acc) x = _mm_setzero_si128();
+
+    const int64_t n8 = n - n%8;
+
+    int64_t is = 0;
+    while (is < n8) {
+        const int64_t iend = std::min(n8, is + 8*nIters);
+
+        __m128i s[kRA*kRB];
+        KBD_AUDIO_UNROLL
+        for (auto & x : s) x = _mm_setzero_si128();
+
+        for (; is < iend; is += 8) {
+            __m128i xb[kRB];
+            KBD_AUDIO_UNROLL
+            for (int ib = 0; ib < kRB; ++ib) {
+                xb[ib] = _mm_loadu_si128((const __m128i *)(b[ib] + is));
+            }
+
+            KBD_AUDIO_UNROLL
+            for (int ia = 0; ia < kRA; ++ia) {
+                const __m128i xa = _mm_loadu_si128((const __m128i *)(a[ia] + is));
+                KBD_AUDIO_UNROLL
+                for (int ib = 0; ib < kRB; ++ib) {
+                    s[ia*kRB + ib] = _mm_add_epi32(s[ia*kRB + ib], _mm_madd_epi16(xa, xb[ib]));
+                }
+            }
+        }
+
+        KBD_AUDIO_UNROLL
+        for (int k = 0; k < kRA*kRB; ++k) {
+            acc[k] = _mm_add_epi64(acc[k], _mm_cvtepi32_epi64(s[k]));
+            acc[k] = _mm_add_epi64(acc[k], _mm_cvtepi32_epi64(_mm_srli_si128(s[k], 8)));
+        }
+    }
+
+    KBD_AUDIO_UNROLL
+    for (int ia = 0; ia < kRA; ++ia) {
+        KBD_AUDIO_UNROLL
+        for (int ib = 0; ib < kRB; ++ib) {
+            res[ia*kRB + ib] = hsum_epi64_sse41(acc[ia*kRB + ib]) + calcDotI16_scalar(a[ia] + n8, b[ib] + n8, n - n8);
+        }
+    }
+}
+
+// two __m128 per coefficient - the lower and the upper 4 lanes
+__attribute__((target("sse4.1")))
+void filterBiquadsF_sse41(const float * coefficients, float * state, const float * x, int64_t n, float * y) {
+    static_assert(SIMD::kBiquadLanes == 8, "two __m128 per coefficient");
+
+    __m128 a0[2], a1[2], a2[2], b1[2], b2[2];
+    __m128 x1[2], x2[2], y1[2], y2[2];
+
+    for (int h = 0; h < 2; ++h) {
+        a0[h] = _mm_loadu_ps(coefficients + 0*8 + 4*h);
+        a1[h] = _mm_loadu_ps(coefficients + 1*8 + 4*h);
+        a2[h] = _mm_loadu_ps(coefficients + 2*8 + 4*h);
+        b1[h] = _mm_loadu_ps(coefficients + 3*8 + 4*h);
+        b2[h] = _mm_loadu_ps(coefficients + 4*8 + 4*h);
+
+        x1[h] = _mm_loadu_ps(state + 0*8 + 4*h);
+        x2[h] = _mm_loadu_ps(state + 1*8 + 4*h);
+        y1[h] = _mm_loadu_ps(state + 2*8 + 4*h);
+        y2[h] = _mm_loadu_ps(state + 3*8 + 4*h);
+    }
+
+    for (int64_t i = 0; i < n; ++i) {
+        const __m128 xn = _mm_set1_ps(x[i]);
+
+        for (int h = 0; h < 2; ++h) {
+            __m128 yn = _mm_mul_ps(a0[h], xn);
+            yn = _mm_add_ps(yn, _mm_mul_ps(a1[h], x1[h]));
+            yn = _mm_add_ps(yn, _mm_mul_ps(a2[h], x2[h]));
+            yn = _mm_sub_ps(yn, _mm_mul_ps(b1[h], y1[h]));
+            yn = _mm_sub_ps(yn, _mm_mul_ps(b2[h], y2[h]));
+
+            x2[h] = x1[h];
+            x1[h] = xn;
+            y2[h] = y1[h];
+            y1[h] = yn;
+
+            _mm_storeu_ps(y + i*8 + 4*h, yn);
+        }
+    }
+
+    for (int h = 0; h < 2; ++h) {
+        _mm_storeu_ps(state + 0*8 + 4*h, x1[h]);
+        _mm_storeu_ps(state + 1*8 + 4*h, x2[h]);
+        _mm_storeu_ps(state + 2*8 + 4*h, y1[h]);
+        _mm_storeu_ps(state + 3*8 + 4*h, y2[h]);
+    }
+}
+
+#endif
+
+#if defined(KBD_AUDIO_SIMD_NEON)
+
+int64_t hsum_s64_neon(int64x2_t v) {
+    return vgetq_lane_s64(v, 0) + vgetq_lane_s64(v, 1);
+}
+
+// vmull_s16 keeps each product in its own i32 lane, so no overflow correction is needed
+void calcCCSumsI16_neon(const int16_t * a0, const int16_t * a1, int64_t n, int64_t & sum1, int64_t & sum12, int64_t & sum01) {
+    int64x2_t acc1  = vdupq_n_s64(0);
+    int64x2_t acc12 = vdupq_n_s64(0);
+    int64x2_t acc01 = vdupq_n_s64(0);
+
+    const int64_t n8 = n - n%8;
+
+    int64_t is = 0;
+    while (is < n8) {
+        const int64_t iend = std::min(n8, is + 8*kBlockIters);
+
+        int32x4_t s1 = vdupq_n_s32(0);
+
+        for (; is < iend; is += 8) {
+            const int16x8_t x0 = vld1q_s16(a0 + is);
+            const int16x8_t x1 = vld1q_s16(a1 + is);
+
+            s1 = vpadalq_s16(s1, x1);
+
+            acc12 = vpadalq_s32(acc12, vmull_s16(vget_low_s16(x1),  vget_low_s16(x1)));
+            acc12 = vpadalq_s32(acc12, vmull_s16(vget_high_s16(x1), vget_high_s16(x1)));
+
+            acc01 = vpadalq_s32(acc01, vmull_s16(vget_low_s16(x0),  vget_low_s16(x1)));
+            acc01 = vpadalq_s32(acc01, vmull_s16(vget_high_s16(x0), vget_high_s16(x1)));
+        }
+
+        acc1 = vpadalq_s32(acc1, s1);
+    }
+
+    sum1  += hsum_s64_neon(acc1);
+    sum12 += hsum_s64_neon(acc12);
+    sum01 += hsum_s64_neon(acc01);
+
+    calcCCSumsI16_scalar(a0 + n8, a1 + n8, n - n8, sum1, sum12, sum01);
+}
+
+int64_t calcDotI16_neon(const int16_t * a0, const int16_t * a1, int64_t n) {
+    int64x2_t acc01 = vdupq_n_s64(0);
+
+    const int64_t n8 = n - n%8;
+
+    for (int64_t is = 0; is < n8; is += 8) {
+        const int16x8_t x0 = vld1q_s16(a0 + is);
+        const int16x8_t x1 = vld1q_s16(a1 + is);
+
+        acc01 = vpadalq_s32(acc01, vmull_s16(vget_low_s16(x0),  vget_low_s16(x1)));
+        acc01 = vpadalq_s32(acc01, vmull_s16(vget_high_s16(x0), vget_high_s16(x1)));
+    }
+
+    return hsum_s64_neon(acc01) + calcDotI16_scalar(a0 + n8, a1 + n8, n - n8);
+}
+
+// vmull_s16 products are exact in i32 for any values, so they are widened to i64 right away and the block only
+// saves the loads of the per-pair kernel
+void calcDotsI16_neon(const int16_t * const * a, const int16_t * const * b, int64_t n, int32_t , int32_t , int64_t * res) {
+    constexpr int kRA = SIMD::kDotsRowsA;
+    constexpr int kRB = SIMD::kDotsRowsB;
+
+    int64x2_t acc[kRA*kRB];
+    KBD_AUDIO_UNROLL
+    for (auto & x : acc) x = vdupq_n_s64(0);
+
+    const int64_t n8 = n - n%8;
+
+    for (int64_t is = 0; is < n8; is += 8) {
+        int16x8_t xb[kRB];
+        KBD_AUDIO_UNROLL
+        for (int ib = 0; ib < kRB; ++ib) {
+            xb[ib] = vld1q_s16(b[ib] + is);
+        }
+
+        KBD_AUDIO_UNROLL
+        for (int ia = 0; ia < kRA; ++ia) {
+            const int16x8_t xa = vld1q_s16(a[ia] + is);
+            KBD_AUDIO_UNROLL
+            for (int ib = 0; ib < kRB; ++ib) {
+                acc[ia*kRB + ib] = vpadalq_s32(acc[ia*kRB + ib], vmull_s16(vget_low_s16(xa),  vget_low_s16(xb[ib])));
+                acc[ia*kRB + ib] = vpadalq_s32(acc[ia*kRB + ib], vmull_s16(vget_high_s16(xa), vget_high_s16(xb[ib])));
+            }
+        }
+    }
+
+    KBD_AUDIO_UNROLL
+    for (int ia = 0; ia < kRA; ++ia) {
+        KBD_AUDIO_UNROLL
+        for (int ib = 0; ib < kRB; ++ib) {
+            res[ia*kRB + ib] = hsum_s64_neon(acc[ia*kRB + ib]) + calcDotI16_scalar(a[ia] + n8, b[ib] + n8, n - n8);
+        }
+    }
+}
+
+// vmulq + vaddq rather than vmlaq / vfmaq, to round the same way as the scalar code
+void filterBiquadsF_neon(const float * coefficients, float * state, const float * x, int64_t n, float * y) {
+    static_assert(SIMD::kBiquadLanes == 8, "two float32x4_t per coefficient");
+
+    float32x4_t a0[2], a1[2], a2[2], b1[2], b2[2];
+    float32x4_t x1[2], x2[2], y1[2], y2[2];
+
+    for (int h = 0; h < 2; ++h) {
+        a0[h] = vld1q_f32(coefficients + 0*8 + 4*h);
+        a1[h] = vld1q_f32(coefficients + 1*8 + 4*h);
+        a2[h] = vld1q_f32(coefficients + 2*8 + 4*h);
+        b1[h] = vld1q_f32(coefficients + 3*8 + 4*h);
+        b2[h] = vld1q_f32(coefficients + 4*8 + 4*h);
+
+        x1[h] = vld1q_f32(state + 0*8 + 4*h);
+        x2[h] = vld1q_f32(state + 1*8 + 4*h);
+        y1[h] = vld1q_f32(state + 2*8 + 4*h);
+        y2[h] = vld1q_f32(state + 3*8 + 4*h);
+    }
+
+    for (int64_t i = 0; i < n; ++i) {
+        const float32x4_t xn = vdupq_n_f32(x[i]);
+
+        for (int h = 0; h < 2; ++h) {
+            float32x4_t yn = vmulq_f32(a0[h], xn);
+            yn = vaddq_f32(yn, vmulq_f32(a1[h], x1[h]));
+            yn = vaddq_f32(yn, vmulq_f32(a2[h], x2[h]));
+            yn = vsubq_f32(yn, vmulq_f32(b1[h], y1[h]));
+            yn = vsubq_f32(yn, vmulq_f32(b2[h], y2[h]));
+
+            x2[h] = x1[h];
+            x1[h] = xn;
+            y2[h] = y1[h];
+            y1[h] = yn;
+
+            vst1q_f32(y + i*8 + 4*h, yn);
+        }
+    }
+
+    for (int h = 0; h < 2; ++h) {
+        vst1q_f32(state + 0*8 + 4*h, x1[h]);
+        vst1q_f32(state + 1*8 + 4*h, x2[h]);
+        vst1q_f32(state + 2*8 + 4*h, y1[h]);
+        vst1q_f32(state + 3*8 + 4*h, y2[h]);
+    }
+}
+
+#endif
+
+struct Kernels {
+    const char * name = "scalar";
+    SIMD::TKernelCCSumsI16 ccSumsI16 = calcCCSumsI16_scalar;
+    SIMD::TKernelDotI16 dotI16 = calcDotI16_scalar;
+    SIMD::TKernelDotsI16 dotsI16 = calcDotsI16_scalar;
+    SIMD::TKernelBiquadsF biquadsF = filterBiquadsF_scalar;
+};
+
+Kernels selectKernels() {
+    Kernels res;
+
+#if defined(KBD_AUDIO_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        res.name = "avx2";
+        res.ccSumsI16 = calcCCSumsI16_avx2;
+        res.dotI16 = calcDotI16_avx2;
+        res.dotsI16 = calcDotsI16_avx2;
+        res.biquadsF = filterBiquadsF_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        res.name = "sse4.1";
+        res.ccSumsI16 = calcCCSumsI16_sse41;
+        res.dotI16 = calcDotI16_sse41;
+        res.dotsI16 = calcDotsI16_sse41;
+        res.biquadsF = filterBiquadsF_sse41;
+    }
+#elif defined(KBD_AUDIO_SIMD_NEON)
+    res.name = "neon";
+    res.ccSumsI16 = calcCCSumsI16_neon;
+    res.dotI16 = calcDotI16_neon;
+    res.dotsI16 = calcDotsI16_neon;
+    res.biquadsF = filterBiquadsF_neon;
+#endif
+
+    return res;
+}
+
+const Kernels & getKernels() {
+    static const Kernels res = selectKernels();
+    return res;
+}
+
+}
+
+namespace SIMD {
+
+const char * getKernelName() {
+    return getKernels().name;
+}
+
+void calcCCSumsI16(const int16_t * a0, const int16_t * a1, int64_t n, int64_t & sum1, int64_t & sum12, int64_t & sum01) {
+    getKernels().ccSumsI16(a0, a1, n, sum1, sum12, sum01);
+}
+
+int64_t calcDotI16(const int16_t * a0, const int16_t * a1, int64_t n) {
+    return getKernels().dotI16(a0, a1, n);
+}
+
+void calcDotsI16(const int16_t * const * a, const int16_t * const * b, int64_t n, int32_t maxAbsA, int32_t maxAbsB, int64_t * res) {
+    getKernels().dotsI16(a, b, n, maxAbsA, maxAbsB, res);
+}
+
+void filterBiquadsF(const float * coefficients, float * state, const float * x, int64_t n, float * y) {
+    getKernels().biquadsF(coefficients, state, x, n, y);
+}
+
+}
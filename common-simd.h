@@ -0,0 +1,49 @@
+/*! \file common-simd.h
+ *  \brief Runtime-dispatched SIMD kernels for the i16 cross-correlation loops and the filter bank
+ *
+ *  The kernel is selected once at startup based on the CPU features.
+ *  All variants produce results that are bit-identical to the scalar code - common.cpp and common-simd.cpp are
+ *  built with -ffp-contract=off, so that the scalar code is not contracted into fma instructions on targets that
+ *  have them.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace SIMD {
+
+// sum1 = sum(a1), sum12 = sum(a1*a1), sum01 = sum(a0*a1) over n samples
+using TKernelCCSumsI16 = void (*)(const int16_t * a0, const int16_t * a1, int64_t n, int64_t & sum1, int64_t & sum12, int64_t & sum01);
+
+// sum(a0*a1) over n samples
+using TKernelDotI16 = int64_t (*)(const int16_t * a0, const int16_t * a1, int64_t n);
+
+// number of rows of a and b processed together by calcDotsI16
+constexpr int kDotsRowsA = 4;
+constexpr int kDotsRowsB = 2;
+
+// res[ia*kDotsRowsB + ib] = sum(a[ia]*b[ib]) over n samples, for kDotsRowsA x kDotsRowsB rows
+// maxAbsA and maxAbsB bound the magnitude of the values and select how long the i32 partial sums can grow
+using TKernelDotsI16 = void (*)(const int16_t * const * a, const int16_t * const * b, int64_t n, int32_t maxAbsA, int32_t maxAbsB, int64_t * res);
+
+// number of filters processed side by side by filterBiquadsF
+constexpr int kBiquadLanes = 8;
+
+// kBiquadLanes biquad sections over the same input, y[i*kBiquadLanes + l] for lane l :
+//   y = a0*x[i] + a1*x1 + a2*x2 - b1*y1 - b2*y2, evaluated left to right as filterFirstOrderHighPass does
+// coefficients holds a0, a1, a2, b1, b2 and state holds x1, x2, y1, y2 - kBiquadLanes floats each. The state is updated.
+using TKernelBiquadsF = void (*)(const float * coefficients, float * state, const float * x, int64_t n, float * y);
+
+// name of the selected instruction set : "avx2", "sse4.1", "neon" or "scalar"
+const char * getKernelName();
+
+void calcCCSumsI16(const int16_t * a0, const int16_t * a1, int64_t n, int64_t & sum1, int64_t & sum12, int64_t & sum01);
+
+int64_t calcDotI16(const int16_t * a0, const int16_t * a1, int64_t n);
+
+void calcDotsI16(const int16_t * const * a, const int16_t * const * b, int64_t n, int32_t maxAbsA, int32_t maxAbsB, int64_t * res);
+
+void filterBiquadsF(const float * coefficients, float * state, const float * x, int64_t n, float * y);
+
+}
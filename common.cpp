@@ -3,15 +3,28 @@
  */
 
 #include "common.h"
+#include "common-simd.h"
 #include "constants.h"
+#include "thread-pool.h"
+#include "recording.h"
 
 #include <cstring>
 #include <cmath>
+#include <complex>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <fstream>
-#include <deque>
 #include <algorithm>
+#include <random>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define KBD_AUDIO_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #ifndef pi
 #define  pi 3.1415926535897932384626433832795
@@ -26,17 +39,59 @@
 #endif
 
 namespace {
+    // samples read at a time when converting a recording to i16
+    constexpr int64_t kReadChunk_samples = 1 << 16;
+
+    // dst[i] = round(32767*(y[i*stride]*iamax)) like convert(), clipped to the i16 range
+    void quantizeI16(const float * y, int64_t n, int64_t stride, double iamax, TSampleI16 * dst) {
+        constexpr int32_t kMax = std::numeric_limits<TSampleI16>::max();
+        for (int64_t i = 0; i < n; ++i) {
+            // std::round() without the libm call - the truncation is exact for |v| < 2^31
+            const double v = std::max(-double(kMax), std::min(double(kMax), kMax*(y[i*stride]*iamax)));
+            int32_t q = (int32_t) v;
+            const double r = v - q;
+            q += (r >= 0.5) - (r <= -0.5);
+            dst[i] = q;
+        }
+    }
+
+    // reads one chunk into buf, zero-filling whatever is past the end of the file
+    template <typename TSampleInput>
+    void readChunk(std::ifstream & fin, TSampleInput * buf, int64_t n) {
+        fin.read((char *)(buf), n*sizeof(TSampleInput));
+        const int64_t nRead = fin.gcount()/sizeof(TSampleInput);
+        std::fill(buf + nRead, buf + n, TSampleInput(0));
+    }
+
 template <typename TSampleInput, typename TSample>
-    bool readWaveform(std::ifstream & fin, TWaveformT<TSample> & res, int32_t offset, std::streamsize size) {
-        if (std::is_same<TSample, TSampleI16>::value) {
-            std::vector<TSampleInput> buf(size/sizeof(TSampleInput));
-            res.resize(offset + size/sizeof(TSampleInput));
-            fin.read((char *)(buf.data()), size);
-            double amax = calcAbsMax(buf);
+    bool readWaveform(std::ifstream & fin, TWaveformT<TSample> & res, int64_t offset, std::streamsize size) {
+        const int64_t n = size/sizeof(TSampleInput);
+        if constexpr (std::is_same<TSample, TSampleI16>::value) {
+            // two passes over the file in chunks - the abs max first, then the conversion - instead of a
+            // full-size float buffer
+            std::vector<TSampleInput> buf(std::min(n, kReadChunk_samples));
+            res.resize(offset + n);
+
+            const auto pos = fin.tellg();
+
+            double amax = 0.0;
+            for (int64_t i0 = 0; i0 < n; i0 += kReadChunk_samples) {
+                const int64_t nb = std::min(kReadChunk_samples, n - i0);
+                readChunk(fin, buf.data(), nb);
+                for (int64_t i = 0; i < nb; ++i) if (std::abs(buf[i]) > amax) amax = std::abs(buf[i]);
+            }
+
+            fin.clear();
+            fin.seekg(pos);
+
             double iamax = amax != 0.0 ? 1.0/amax : 1.0;
-            for (auto i = 0; i < (int) buf.size(); ++i) res[offset + i] = std::round(std::numeric_limits<TSampleI16>::max()*(buf[i]*iamax));
-        } else if (std::is_same<TSample, TSampleF>::value) {
-            res.resize(offset + size/sizeof(TSample));
+            for (int64_t i0 = 0; i0 < n; i0 += kReadChunk_samples) {
+                const int64_t nb = std::min(kReadChunk_samples, n - i0);
+                readChunk(fin, buf.data(), nb);
+                quantizeI16(buf.data(), nb, 1, iamax, res.data() + offset + i0);
+            }
+        } else if constexpr (std::is_same<TSample, TSampleF>::value) {
+            res.resize(offset + n);
             fin.read((char *)(res.data() + offset), size);
         } else {
             return false;
@@ -105,6 +160,36 @@ bool convert(const TWaveformT<TSampleSrc> & src, TWaveformT<TSampleDst> & dst) {
 
 template bool convert<TSampleF, TSampleI16>(const TWaveformT<TSampleF> & src, TWaveformT<TSampleI16> & dst);
 
+static_assert(TWaveformPlanarMI16::kBands == TSampleMI16::N, "TWaveformPlanarMI16 must have one band per TSampleMI16 channel");
+
+bool convert(const TWaveformPlanarMI16 & src, TWaveformMI16 & dst) {
+    const auto n = src.size();
+    dst.resize(n);
+
+    for (int j = 0; j < TSampleMI16::N; ++j) {
+        const auto plane = src.getPlane(j);
+        for (int64_t i = 0; i < n; ++i) {
+            dst[i][j] = plane[i];
+        }
+    }
+
+    return true;
+}
+
+bool convert(const TWaveformMI16 & src, TWaveformPlanarMI16 & dst) {
+    const int64_t n = src.size();
+    dst.resize(n);
+
+    for (int j = 0; j < TSampleMI16::N; ++j) {
+        auto plane = dst.getPlane(j);
+        for (int64_t i = 0; i < n; ++i) {
+            plane[i] = src[i][j];
+        }
+    }
+
+    return true;
+}
+
 template <typename TSample>
 void filter(TWaveformT<TSample> & waveform, EAudioFilter filterId, float freqCutoff_Hz, int64_t sampleRate) {
     switch (filterId) {
@@ -169,8 +254,49 @@ bool saveToFile(const std::string & fname, TWaveformT<TSample> & waveform) {
 
 template bool saveToFile<TSampleF>(const std::string & fname, TWaveformT<TSampleF> & waveform);
 
+namespace {
+    template <typename TSample>
+    bool readRecording(const std::string & fname, TWaveformT<TSample> & res) {
+        RecordingReader reader;
+        if (reader.open(fname) == false) {
+            return false;
+        }
+
+        const auto & info = reader.getInfo();
+        if (info.sampleRate != kSampleRate) {
+            fprintf(stderr, "Warning: '%s' was recorded at %d Hz, expected %d Hz\n", fname.c_str(), (int) info.sampleRate, (int) kSampleRate);
+        }
+
+        if constexpr (std::is_same<TSample, TSampleI16>::value) {
+            // the abs max comes from the chunk statistics, so a single pass is enough
+            const double amax = reader.getAbsMax();
+            const double iamax = amax != 0.0 ? 1.0/amax : 1.0;
+
+            std::vector<TSampleF> buf(std::min(info.nSamples, kReadChunk_samples));
+            res.resize(info.nSamples);
+            for (int64_t i0 = 0; i0 < info.nSamples; i0 += kReadChunk_samples) {
+                const int64_t nb = std::min(kReadChunk_samples, info.nSamples - i0);
+                if (reader.read(i0, nb, buf.data()) == false) {
+                    return false;
+                }
+                quantizeI16(buf.data(), nb, 1, iamax, res.data() + i0);
+            }
+        } else {
+            if (reader.read(res) == false) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
 template <typename TSampleInput, typename TSample>
 bool readFromFile(const std::string & fname, TWaveformT<TSample> & res) {
+    if (RecordingReader::isContainer(fname)) {
+        return readRecording(fname, res);
+    }
+
     std::ifstream fin(fname, std::ios::binary | std::ios::ate);
     if (fin.good() == false) {
         return false;
@@ -214,8 +340,8 @@ bool readFromFile(const std::string & fname, TWaveformT<TSample> & res, TTrainKe
         static_assert(std::is_same<TSample, TSampleF>::value ||
                       std::is_same<TSample, TSampleI16>::value, "TSample not supported");
 
-        int32_t offset = 0;
-        std::streamsize size = bufferSize_frames*kSamplesPerFrame*sizeof(TSampleInput);
+        int64_t offset = 0;
+        std::streamsize size = int64_t(bufferSize_frames)*kSamplesPerFrame*sizeof(TSampleInput);
         while (true) {
             TKey keyPressed = 0;
             fin.read((char *)(&keyPressed), sizeof(keyPressed));
@@ -238,6 +364,146 @@ bool readFromFile(const std::string & fname, TWaveformT<TSample> & res, TTrainKe
 
 template bool readFromFile<TSampleF, TSampleI16>(const std::string & fname, TWaveformT<TSampleI16> & res, TTrainKeys & trainKeys, int32_t & bufferSize_frames);
 
+//
+// MappedWaveform
+//
+
+struct MappedWaveform::Data {
+    void * mapped = nullptr;
+    size_t mappedSize = 0;
+
+    // the samples, when the file could not be mapped
+    TWaveformF samples;
+
+    TWaveformViewF view;
+
+    double amax = -1.0;
+};
+
+MappedWaveform::MappedWaveform() : data_(new Data()) {}
+
+MappedWaveform::~MappedWaveform() {
+    close();
+}
+
+bool MappedWaveform::open(const std::string & fname) {
+    close();
+
+    auto & data = getData();
+
+    if (RecordingReader::isContainer(fname)) {
+        // the chunks are not contiguous - decode them, the abs max is known from the chunk statistics
+        RecordingReader reader;
+        if (reader.open(fname) == false || reader.read(data.samples) == false) {
+            return false;
+        }
+        if (reader.getInfo().hasStats) {
+            data.amax = reader.getAbsMax();
+        }
+
+        data.view = ::getView(data.samples, 0);
+
+        return true;
+    }
+
+#ifdef KBD_AUDIO_MMAP
+    const int fd = ::open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    const int64_t n = st.st_size/sizeof(TSampleF);
+    if (n == 0) {
+        ::close(fd);
+        return true;
+    }
+
+    void * mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (mapped != MAP_FAILED) {
+        // the samples are mostly consumed front to back
+        madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+
+        data.mapped = mapped;
+        data.mappedSize = st.st_size;
+        data.view = { (const TSampleF *) mapped, n };
+
+        return true;
+    }
+
+    fprintf(stderr, "%s:%d: mmap() of '%s' failed - reading the file instead\n", __FILE__, __LINE__, fname.c_str());
+#endif
+
+    if (readFromFile<TSampleF>(fname, data.samples) == false) {
+        return false;
+    }
+
+    data.view = ::getView(data.samples, 0);
+
+    return true;
+}
+
+void MappedWaveform::close() {
+    auto & data = getData();
+
+#ifdef KBD_AUDIO_MMAP
+    if (data.mapped) {
+        munmap(data.mapped, data.mappedSize);
+    }
+#endif
+
+    data = {};
+}
+
+int64_t MappedWaveform::size() const {
+    return getData().view.n;
+}
+
+TWaveformViewF MappedWaveform::getView() const {
+    return getData().view;
+}
+
+double MappedWaveform::getAbsMax() {
+    auto & data = getData();
+
+    if (data.amax < 0.0) {
+        float amax = 0.0f;
+        for (int64_t i = 0; i < data.view.n; ++i) {
+            amax = std::max(amax, std::abs(data.view.samples[i]));
+        }
+        data.amax = amax;
+    }
+
+    return data.amax;
+}
+
+bool MappedWaveform::convert(int64_t idx, int64_t len, TSampleI16 * res) {
+    const auto & view = getData().view;
+    if (idx < 0 || len < 0 || idx + len > view.n) {
+        return false;
+    }
+
+    const double amax = getAbsMax();
+    const double iamax = amax != 0.0 ? 1.0/amax : 1.0;
+
+    quantizeI16(view.samples + idx, len, 1, iamax, res);
+
+    return true;
+}
+
+bool MappedWaveform::convert(TWaveformI16 & res) {
+    res.resize(size());
+
+    return convert(0, size(), res.data());
+}
+
 //
 // filters
 //
@@ -297,6 +563,207 @@ TSampleF filterSecondOrderButterworthHighPass(TFilterCoefficients & coefficients
     return yn;
 }
 
+namespace {
+    // samples filtered per kernel call - the float outputs of all lanes stay in L1
+    constexpr int64_t kFilterBankBlock_samples = 1024;
+}
+
+bool filterBank(
+    const TWaveformViewF & waveform, EAudioFilter filterId, const std::vector<float> & freqCutoffs_Hz, int64_t sampleRate,
+    std::vector<TWaveformI16> & res) {
+    constexpr int kL = SIMD::kBiquadLanes;
+
+    const int nCutoffs = freqCutoffs_Hz.size();
+    const int64_t n = waveform.n;
+
+    res.resize(nCutoffs);
+
+    std::vector<float> buf(kFilterBankBlock_samples*kL);
+
+    for (int c0 = 0; c0 < nCutoffs; c0 += kL) {
+        const int nLanes = std::min(kL, nCutoffs - c0);
+
+        // a0, a1, a2, b1, b2 - unused lanes keep zero coefficients
+        float coefficients[5*kL] = {};
+        for (int l = 0; l < nLanes; ++l) {
+            TFilterCoefficients cur;
+            switch (filterId) {
+                case EAudioFilter::None:
+                    cur.a0 = 1.0f;
+                    break;
+                case EAudioFilter::FirstOrderHighPass:
+                    cur = ::calculateCoefficientsFirstOrderHighPass(freqCutoffs_Hz[c0 + l], sampleRate);
+                    break;
+                case EAudioFilter::SecondOrderButterworthHighPass:
+                    cur = ::calculateCoefficientsSecondOrderButterworthHighPass(freqCutoffs_Hz[c0 + l], sampleRate);
+                    break;
+                default:
+                    fprintf(stderr, "Unknown filter type: %d\n", filterId);
+                    return false;
+            }
+
+            coefficients[0*kL + l] = cur.a0;
+            coefficients[1*kL + l] = cur.a1;
+            coefficients[2*kL + l] = cur.a2;
+            coefficients[3*kL + l] = cur.b1;
+            coefficients[4*kL + l] = cur.b2;
+        }
+
+        // first pass - the abs max of each output, as calcAbsMax would find it
+        float state[4*kL] = {};
+        float amax[kL] = {};
+        for (int64_t i0 = 0; i0 < n; i0 += kFilterBankBlock_samples) {
+            const int64_t nb = std::min(kFilterBankBlock_samples, n - i0);
+            SIMD::filterBiquadsF(coefficients, state, waveform.samples + i0, nb, buf.data());
+            for (int64_t i = 0; i < nb; ++i) {
+                for (int l = 0; l < kL; ++l) {
+                    amax[l] = std::max(amax[l], std::abs(buf[i*kL + l]));
+                }
+            }
+        }
+
+        // second pass - filter again and quantize like convert(). Recomputing the filters is cheaper than
+        // writing and reading back their float outputs
+        double iamax[kL] = {};
+        TSampleI16 * dst[kL] = {};
+        for (int l = 0; l < nLanes; ++l) {
+            iamax[l] = amax[l] != 0.0f ? 1.0/amax[l] : 1.0;
+
+            res[c0 + l].resize(n);
+            dst[l] = res[c0 + l].data();
+        }
+
+        std::fill(state, state + 4*kL, 0.0f);
+        for (int64_t i0 = 0; i0 < n; i0 += kFilterBankBlock_samples) {
+            const int64_t nb = std::min(kFilterBankBlock_samples, n - i0);
+            SIMD::filterBiquadsF(coefficients, state, waveform.samples + i0, nb, buf.data());
+            for (int l = 0; l < nLanes; ++l) {
+                quantizeI16(buf.data() + l, nb, kL, iamax[l], dst[l] + i0);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool filterAndConvert(
+    const TWaveformViewF & waveform, EAudioFilter filterId, float freqCutoff_Hz, int64_t sampleRate,
+    TWaveformI16 & res, double amax) {
+    TFilterCoefficients coefficients;
+
+    switch (filterId) {
+        case EAudioFilter::None:
+            break;
+        case EAudioFilter::FirstOrderHighPass:
+            coefficients = ::calculateCoefficientsFirstOrderHighPass(freqCutoff_Hz, sampleRate);
+            break;
+        case EAudioFilter::SecondOrderButterworthHighPass:
+            coefficients = ::calculateCoefficientsSecondOrderButterworthHighPass(freqCutoff_Hz, sampleRate);
+            break;
+        default:
+            fprintf(stderr, "Unknown filter type: %d\n", filterId);
+            return false;
+    }
+
+    const int64_t n = waveform.n;
+
+    TSampleF buf[kFilterBankBlock_samples];
+
+    // filters the samples [i0, i0 + nb) into buf, continuing from the current filter state
+    auto filterBlock = [&](int64_t i0, int64_t nb) {
+        const TSampleF * x = waveform.samples + i0;
+        switch (filterId) {
+            case EAudioFilter::FirstOrderHighPass:
+                for (int64_t i = 0; i < nb; ++i) buf[i] = ::filterFirstOrderHighPass(coefficients, x[i]);
+                break;
+            case EAudioFilter::SecondOrderButterworthHighPass:
+                for (int64_t i = 0; i < nb; ++i) buf[i] = ::filterSecondOrderButterworthHighPass(coefficients, x[i]);
+                break;
+            default:
+                std::copy(x, x + nb, buf);
+                break;
+        }
+    };
+
+    if (amax <= 0.0) {
+        const auto coefficients0 = coefficients;
+
+        float amaxF = 0.0f;
+        for (int64_t i0 = 0; i0 < n; i0 += kFilterBankBlock_samples) {
+            const int64_t nb = std::min(kFilterBankBlock_samples, n - i0);
+            filterBlock(i0, nb);
+            for (int64_t i = 0; i < nb; ++i) {
+                amaxF = std::max(amaxF, std::abs(buf[i]));
+            }
+        }
+
+        amax = amaxF;
+        coefficients = coefficients0;
+    }
+
+    const double iamax = amax != 0.0 ? 1.0/amax : 1.0;
+
+    res.resize(n);
+    for (int64_t i0 = 0; i0 < n; i0 += kFilterBankBlock_samples) {
+        const int64_t nb = std::min(kFilterBankBlock_samples, n - i0);
+        filterBlock(i0, nb);
+        quantizeI16(buf, nb, 1, iamax, res.data() + i0);
+    }
+
+    return true;
+}
+
+//
+// sliding window max / min
+//
+
+namespace {
+    template<typename T, typename TOp>
+    void calcSlidingExtremum(const T * values, int64_t n, int64_t k, T * work, T * res, TOp op) {
+        if (k <= 0 || n < k) {
+            return;
+        }
+
+        // work[i] = op of values[i] up to the end of the k-block that contains i
+        for (int64_t b0 = 0; b0 < n; b0 += k) {
+            const int64_t b1 = std::min(n, b0 + k);
+            T cur = values[b1 - 1];
+            for (int64_t i = b1 - 1; i >= b0; --i) {
+                cur = op(cur, values[i]);
+                work[i] = cur;
+            }
+        }
+
+        // the first window is exactly the first block
+        res[0] = work[0];
+
+        // a window ending at j covers the tail of the previous block and the head of the block of j
+        for (int64_t b0 = k; b0 < n; b0 += k) {
+            const int64_t b1 = std::min(n, b0 + k);
+            T cur = values[b0];
+            for (int64_t j = b0; j < b1; ++j) {
+                cur = op(cur, values[j]);
+                res[j - k + 1] = op(work[j - k + 1], cur);
+            }
+        }
+    }
+}
+
+template<typename T>
+void calcSlidingMax(const T * values, int64_t n, int64_t nWindow, T * work, T * res) {
+    calcSlidingExtremum(values, n, nWindow, work, res, [](T a, T b) { return std::max(a, b); });
+}
+
+template<typename T>
+void calcSlidingMin(const T * values, int64_t n, int64_t nWindow, T * work, T * res) {
+    calcSlidingExtremum(values, n, nWindow, work, res, [](T a, T b) { return std::min(a, b); });
+}
+
+template void calcSlidingMax<TSampleI16>(const TSampleI16 * values, int64_t n, int64_t nWindow, TSampleI16 * work, TSampleI16 * res);
+template void calcSlidingMax<TSampleF>(const TSampleF * values, int64_t n, int64_t nWindow, TSampleF * work, TSampleF * res);
+template void calcSlidingMin<TSampleI16>(const TSampleI16 * values, int64_t n, int64_t nWindow, TSampleI16 * work, TSampleI16 * res);
+template void calcSlidingMin<TSampleF>(const TSampleF * values, int64_t n, int64_t nWindow, TSampleF * work, TSampleF * res);
+
 //
 // calcCC
 //
@@ -313,20 +780,28 @@ std::tuple<double, double> calcSum(const TKeyWaveformF & waveform, int is0, int
     return std::tuple<double, double>(sum, sum2);
 }
 
+// the samples of all channels are adjacent in memory, so they are summed as one i16 stream
 template<>
 std::tuple<int64_t, int64_t> calcSum(const TWaveformViewT<TSampleMI16> & waveform) {
     int64_t sum = 0;
     int64_t sum2 = 0;
+    int64_t unused = 0;
 
-    auto samples = waveform.samples;
-    auto n       = waveform.n;
+    auto values = reinterpret_cast<const TSampleI16 *>(waveform.samples);
+    auto n      = waveform.n*TSampleMI16::N;
 
-    for (int is = 0; is < n; ++is) {
-        for (int j = 0; j < TSampleMI16::N; j++) {
-            int32_t a0 = samples[is][j];
-            sum += a0;
-            sum2 += a0*a0;
-        }
+    SIMD::calcCCSumsI16(values, values, n, sum, sum2, unused);
+
+    return std::tuple<int64_t, int64_t>(sum, sum2);
+}
+
+std::tuple<int64_t, int64_t> calcSum(const TWaveformPlanarViewMI16 & waveform) {
+    int64_t sum = 0;
+    int64_t sum2 = 0;
+    int64_t unused = 0;
+
+    for (int j = 0; j < TWaveformPlanarMI16::kBands; ++j) {
+        SIMD::calcCCSumsI16(waveform.planes[j], waveform.planes[j], waveform.n, sum, sum2, unused);
     }
 
     return std::tuple<int64_t, int64_t>(sum, sum2);
@@ -419,18 +894,42 @@ TValueCC calcCC(
 #endif
     auto n = std::min(n0, n1);
 
-    for (int64_t is = 0; is < n; ++is) {
-        for (int j = 0; j < TSampleMI16::N; j++) {
-            int32_t a0 = samples0[is][j];
-            int32_t a1 = samples1[is][j];
+    n *= TSampleMI16::N;
 
-            sum1 += a1;
-            sum12 += a1*a1;
-            sum01 += a0*a1;
-        }
+    SIMD::calcCCSumsI16(reinterpret_cast<const TSampleI16 *>(samples0), reinterpret_cast<const TSampleI16 *>(samples1), n, sum1, sum12, sum01);
+
+    {
+        double nom   = sum01*n - sum0*sum1;
+        double den2a = sum02*n - sum0*sum0;
+        double den2b = sum12*n - sum1*sum1;
+        cc = (nom)/(sqrt(den2a*den2b));
     }
 
-    n *= TSampleMI16::N;
+    return cc;
+}
+
+TValueCC calcCC(
+    const TWaveformPlanarViewMI16 & waveform0,
+    const TWaveformPlanarViewMI16 & waveform1,
+    int64_t sum0, int64_t sum02) {
+    TValueCC cc = -1.0f;
+
+    int64_t sum1 = 0;
+    int64_t sum12 = 0;
+    int64_t sum01 = 0;
+
+#ifdef MY_DEBUG
+    if (waveform0.n != waveform1.n) {
+        printf("BUG 234f8273\n");
+    }
+#endif
+    auto n = std::min(waveform0.n, waveform1.n);
+
+    for (int j = 0; j < TWaveformPlanarMI16::kBands; ++j) {
+        SIMD::calcCCSumsI16(waveform0.planes[j], waveform1.planes[j], n, sum1, sum12, sum01);
+    }
+
+    n *= TWaveformPlanarMI16::kBands;
 
     {
         double nom   = sum01*n - sum0*sum1;
@@ -466,13 +965,17 @@ TValueCC calcCC(
 #endif
     auto n = std::min(n0, n1);
 
-    for (int64_t is = 0; is < n; ++is) {
-        int32_t a0 = samples0[is];
-        int32_t a1 = samples1[is];
+    if constexpr (std::is_same<T, TSampleI16>::value) {
+        SIMD::calcCCSumsI16(samples0, samples1, n, sum1, sum12, sum01);
+    } else {
+        for (int64_t is = 0; is < n; ++is) {
+            int32_t a0 = samples0[is];
+            int32_t a1 = samples1[is];
 
-        sum1 += a1;
-        sum12 += a1*a1;
-        sum01 += a0*a1;
+            sum1 += a1;
+            sum12 += a1*a1;
+            sum01 += a0*a1;
+        }
     }
 
     {
@@ -493,53 +996,694 @@ template TValueCC calcCC<TSampleI16>(
     int64_t sum0, int64_t sum02);
 
 //
-// findBestCC
+// lag scans
 //
 
-std::tuple<TValueCC, TOffset> findBestCC(
-    const TKeyWaveformF & waveform0,
-    const TKeyWaveformF & waveform1,
-    int is0, int is1,
-    int alignWindow) {
-    TOffset besto = -1;
-    TValueCC bestcc = -1.0f;
+namespace {
+    static_assert(sizeof(TSampleMI16) == TSampleMI16::N*sizeof(TSampleI16), "TSampleMI16 must be tightly packed");
 
-    int is00 = waveform0.size()/2 - (is1 - is0)/2;
-    auto ret = calcSum(waveform0, is00, is00 + is1 - is0);
-    auto sum0  = std::get<0>(ret);
-    auto sum02 = std::get<1>(ret);
+    // number of i16 values per sample
+    template<typename T> constexpr int64_t kValuesPerSample = 1;
+    template<> constexpr int64_t kValuesPerSample<TSampleMI16> = TSampleMI16::N;
 
-#ifdef __EMSCRIPTEN__
-    int nWorkers = std::min(4, std::max(1, int(std::thread::hardware_concurrency()) - 2));
-#else
-    int nWorkers = std::min(4u, std::thread::hardware_concurrency());
-    std::mutex mutex;
-    std::vector<std::thread> workers(nWorkers);
-    for (int i = 0; i < (int) workers.size(); ++i) {
-        auto & worker = workers[i];
-        worker = std::thread([&, sum0 = sum0, sum02 = sum02, i]() {
-            TOffset cbesto = -1;
-            TValueCC cbestcc = -1.0f;
-
-            for (int o = -alignWindow + i; o <= alignWindow; o += nWorkers) {
-                auto cc = calcCC(waveform0, waveform1, sum0, sum02, is00, is0 + o, is1 + o);
-                if (cc > cbestcc) {
-                    cbesto = o;
-                    cbestcc = cc;
-                }
-            }
+    inline const int16_t * getValues(const TSampleI16 * samples)  { return samples; }
+    inline const int16_t * getValues(const TSampleMI16 * samples) { return samples->data(); }
 
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                if (cbestcc > bestcc) {
-                    bestcc = cbestcc;
-                    besto = cbesto;
-                }
-            }
+    inline TValueCC calcCCFromSums(int64_t sum0, int64_t sum02, int64_t sum1, int64_t sum12, int64_t sum01, int64_t n) {
+        double nom   = sum01*n - sum0*sum1;
+        double den2a = sum02*n - sum0*sum0;
+        double den2b = sum12*n - sum1*sum1;
+        return (nom)/(sqrt(den2a*den2b));
+    }
+
+    // sum and sum of squares of an n0-sample window of values1 for each of the 2*alignWindow + 1 lags
+    // the window slides by one sample per lag, so each lag costs O(1) instead of O(n0)
+    void calcLagSums(const int16_t * values1, int64_t nv, int64_t n0, int64_t alignWindow, int64_t * sum1, int64_t * sum12) {
+        int64_t s1  = 0;
+        int64_t s12 = 0;
+        for (int64_t iv = 0; iv < n0*nv; ++iv) {
+            int32_t a1 = values1[iv];
+            s1  += a1;
+            s12 += a1*a1;
+        }
+
+        for (int64_t o = 0; o <= 2*alignWindow; ++o) {
+            if (o > 0) {
+                for (int64_t j = 0; j < nv; ++j) {
+                    int32_t aOut = values1[(o - 1)*nv + j];
+                    int32_t aIn  = values1[(o + n0 - 1)*nv + j];
+                    s1  += aIn - aOut;
+                    s12 += aIn*aIn - aOut*aOut;
+                }
+            }
+            sum1[o]  = s1;
+            sum12[o] = s12;
+        }
+    }
+
+    // All keypress windows of a similarity map, copied once into one contiguous aligned buffer,
+    // together with their per-lag sums. The O(N^2) pair loop reads only from here.
+    // waveform0 of a press is the middle n0 samples of its waveform1 window, so only waveform1 is stored.
+    struct KeyPressArena {
+        static constexpr int64_t kAlign_bytes = 64;
+
+        int64_t nPresses    = 0;
+        int64_t nv          = 1; // i16 values per sample
+        int64_t n0          = 0; // samples in waveform0
+        int64_t n1          = 0; // samples in waveform1
+        int64_t alignWindow = 0;
+        int64_t stride      = 0; // i16 values between the starts of two consecutive windows
+
+        std::vector<int16_t> buffer;
+        int16_t * values = nullptr;
+
+        // sums of waveform1 for each lag, 2*alignWindow + 1 entries per press
+        std::vector<int64_t> sum1;
+        std::vector<int64_t> sum12;
+
+        // largest magnitude of the values of waveform1 of each press
+        std::vector<int32_t> maxAbs;
+
+        int64_t nLags() const { return 2*alignWindow + 1; }
+
+        const int16_t * getValues0(int64_t i) const { return values + i*stride + alignWindow*nv; }
+        const int16_t * getValues1(int64_t i) const { return values + i*stride; }
+
+        const int64_t * getSum1(int64_t i)  const { return sum1.data()  + i*nLags(); }
+        const int64_t * getSum12(int64_t i) const { return sum12.data() + i*nLags(); }
+
+        // waveform0 is waveform1 at lag alignWindow
+        int64_t getSum0(int64_t i)  const { return getSum1(i)[alignWindow]; }
+        int64_t getSum02(int64_t i) const { return getSum12(i)[alignWindow]; }
+    };
+
+    template<typename T>
+    void initKeyPressArena(
+            const int32_t keyPressWidth_samples,
+            const int32_t alignWindow_samples,
+            const int32_t offsetFromPeak_samples,
+            const TKeyPressCollectionT<T> & keyPresses,
+            int nWorkers,
+            KeyPressArena & arena) {
+        const int64_t w = keyPressWidth_samples;
+        const int64_t a = alignWindow_samples;
+
+        arena.nPresses    = keyPresses.size();
+        arena.nv          = kValuesPerSample<T>;
+        arena.n0          = 2*w;
+        arena.n1          = 2*w + 2*a;
+        arena.alignWindow = a;
+
+        const int64_t kAlign_values = KeyPressArena::kAlign_bytes/sizeof(int16_t);
+        arena.stride = ((arena.n1*arena.nv + kAlign_values - 1)/kAlign_values)*kAlign_values;
+
+        arena.buffer.resize(arena.nPresses*arena.stride + kAlign_values);
+        arena.values = arena.buffer.data();
+        while (((uintptr_t) arena.values) % KeyPressArena::kAlign_bytes != 0) ++arena.values;
+
+        arena.sum1.resize(arena.nPresses*arena.nLags());
+        arena.sum12.resize(arena.nPresses*arena.nLags());
+        arena.maxAbs.resize(arena.nPresses);
+
+        ThreadPool::getShared().parallelFor(nWorkers, [&](int64_t ith) {
+            for (int64_t i = ith; i < arena.nPresses; i += nWorkers) {
+                const auto & keyPress = keyPresses[i];
+                const auto values = getValues(keyPress.waveform.samples + keyPress.pos + offsetFromPeak_samples - w - a);
+
+                auto dst = arena.values + i*arena.stride;
+                std::copy(values, values + arena.n1*arena.nv, dst);
+
+                int32_t maxAbs = 0;
+                for (int64_t k = 0; k < arena.n1*arena.nv; ++k) {
+                    maxAbs = std::max(maxAbs, std::abs(int32_t(dst[k])));
+                }
+                arena.maxAbs[i] = maxAbs;
+
+                calcLagSums(dst, arena.nv, arena.n0, a, arena.sum1.data() + i*arena.nLags(), arena.sum12.data() + i*arena.nLags());
+            }
         });
     }
-    for (auto & worker : workers) worker.join();
-#endif
+
+    std::tuple<TValueCC, TOffset> findBestCC(const KeyPressArena & arena, int64_t i, int64_t j) {
+        TValueCC bestcc = -1.0;
+        TOffset besto = -1;
+
+        const auto nv = arena.nv;
+        const auto n0 = arena.n0;
+        const auto alignWindow = arena.alignWindow;
+
+        const auto values0 = arena.getValues0(i);
+        const auto values1 = arena.getValues1(j);
+
+        const auto sum0  = arena.getSum0(i);
+        const auto sum02 = arena.getSum02(i);
+        const auto sum1  = arena.getSum1(j);
+        const auto sum12 = arena.getSum12(j);
+
+        for (int o = 0; o <= 2*alignWindow; ++o) {
+            const auto sum01 = SIMD::calcDotI16(values0, values1 + o*nv, n0*nv);
+            auto cc = calcCCFromSums(sum0, sum02, sum1[o], sum12[o], sum01, n0*nv);
+            if (cc > bestcc) {
+                besto = o - alignWindow;
+                bestcc = cc;
+            }
+        }
+
+        return std::tuple<TValueCC, TOffset>(bestcc, besto);
+    }
+
+    // coarse-to-fine search : decimation factor of the coarse windows and number of coarse lags to refine
+    constexpr int64_t kCoarseDecimation = 4;
+    constexpr int kCoarseCandidates = 3;
+
+    // Arena of the same windows averaged over groups of factor samples.
+    // Lag od of the coarse arena corresponds to lag od*factor of the full resolution one.
+    bool initCoarseKeyPressArena(const KeyPressArena & arena, int64_t factor, int nWorkers, KeyPressArena & coarse) {
+        if (arena.n0 % factor != 0 || arena.alignWindow % factor != 0 || arena.alignWindow < factor) {
+            return false;
+        }
+
+        const auto nv = arena.nv;
+
+        coarse.nPresses    = arena.nPresses;
+        coarse.nv          = nv;
+        coarse.n0          = arena.n0/factor;
+        coarse.n1          = arena.n1/factor;
+        coarse.alignWindow = arena.alignWindow/factor;
+        coarse.stride      = coarse.n1*nv;
+
+        coarse.buffer.resize(coarse.nPresses*coarse.stride);
+        coarse.values = coarse.buffer.data();
+
+        coarse.sum1.resize(coarse.nPresses*coarse.nLags());
+        coarse.sum12.resize(coarse.nPresses*coarse.nLags());
+
+        ThreadPool::getShared().parallelFor(nWorkers, [&](int64_t ith) {
+            for (int64_t i = ith; i < coarse.nPresses; i += nWorkers) {
+                const auto src = arena.getValues1(i);
+                auto dst = coarse.values + i*coarse.stride;
+
+                for (int64_t k = 0; k < coarse.n1; ++k) {
+                    for (int64_t j = 0; j < nv; ++j) {
+                        int32_t sum = 0;
+                        for (int64_t d = 0; d < factor; ++d) {
+                            sum += src[(k*factor + d)*nv + j];
+                        }
+                        dst[k*nv + j] = sum/factor;
+                    }
+                }
+
+                calcLagSums(dst, nv, coarse.n0, coarse.alignWindow, coarse.sum1.data() + i*coarse.nLags(), coarse.sum12.data() + i*coarse.nLags());
+            }
+        });
+
+        return true;
+    }
+
+    // Correlates the coarse windows at all coarse lags and evaluates the full resolution CC only for
+    // the lags within one coarse step of the kCoarseCandidates best coarse lags.
+    // Returns the same result as findBestCC(arena, i, j) whenever the true peak is among the candidates.
+    std::tuple<TValueCC, TOffset> findBestCCCoarseToFine(const KeyPressArena & arena, const KeyPressArena & coarse, int64_t i, int64_t j) {
+        const auto factor = arena.alignWindow/coarse.alignWindow;
+
+        int64_t candidates[kCoarseCandidates];
+        TValueCC candidatesCC[kCoarseCandidates];
+        int nCandidates = 0;
+
+        {
+            const auto values0 = coarse.getValues0(i);
+            const auto values1 = coarse.getValues1(j);
+
+            const auto sum0  = coarse.getSum0(i);
+            const auto sum02 = coarse.getSum02(i);
+            const auto sum1  = coarse.getSum1(j);
+            const auto sum12 = coarse.getSum12(j);
+
+            const auto n = coarse.n0*coarse.nv;
+
+            for (int64_t od = 0; od <= 2*coarse.alignWindow; ++od) {
+                const auto sum01 = SIMD::calcDotI16(values0, values1 + od*coarse.nv, n);
+                const auto cc = calcCCFromSums(sum0, sum02, sum1[od], sum12[od], sum01, n);
+                if (!(cc == cc)) continue;
+
+                int k = nCandidates < kCoarseCandidates ? nCandidates++ : kCoarseCandidates;
+                while (k > 0 && candidatesCC[k - 1] < cc) {
+                    if (k < kCoarseCandidates) {
+                        candidates[k] = candidates[k - 1];
+                        candidatesCC[k] = candidatesCC[k - 1];
+                    }
+                    --k;
+                }
+                if (k < kCoarseCandidates) {
+                    candidates[k] = od;
+                    candidatesCC[k] = cc;
+                }
+            }
+        }
+
+        // visit the refined lags in increasing order, so ties are resolved as in the exhaustive search
+        for (int k = 1; k < nCandidates; ++k) {
+            for (int l = k; l > 0 && candidates[l - 1] > candidates[l]; --l) {
+                std::swap(candidates[l - 1], candidates[l]);
+            }
+        }
+
+        TValueCC bestcc = -1.0;
+        TOffset besto = -1;
+
+        const auto nv = arena.nv;
+        const auto n = arena.n0*nv;
+
+        const auto values0 = arena.getValues0(i);
+        const auto values1 = arena.getValues1(j);
+
+        const auto sum0  = arena.getSum0(i);
+        const auto sum02 = arena.getSum02(i);
+        const auto sum1  = arena.getSum1(j);
+        const auto sum12 = arena.getSum12(j);
+
+        int64_t oNext = 0;
+        for (int k = 0; k < nCandidates; ++k) {
+            const int64_t o0 = std::max(oNext, candidates[k]*factor - factor + 1);
+            const int64_t o1 = std::min(2*arena.alignWindow, candidates[k]*factor + factor - 1);
+            for (int64_t o = o0; o <= o1; ++o) {
+                const auto sum01 = SIMD::calcDotI16(values0, values1 + o*nv, n);
+                const auto cc = calcCCFromSums(sum0, sum02, sum1[o], sum12[o], sum01, n);
+                if (cc > bestcc) {
+                    besto = o - arena.alignWindow;
+                    bestcc = cc;
+                }
+            }
+            oNext = std::max(oNext, o1 + 1);
+        }
+
+        return std::tuple<TValueCC, TOffset>(bestcc, besto);
+    }
+
+    // cache budget for the per-press data of one tile of the similarity map (~ L2 per core)
+    constexpr int64_t kTileCache_bytes = 256*1024;
+
+    // number of presses per tile side, so that the row and column data of a tile fit in the cache budget
+    int64_t getTileSize(int64_t bytesPerPress) {
+        return std::max<int64_t>(4, std::min<int64_t>(256, kTileCache_bytes/(2*std::max<int64_t>(1, bytesPerPress))));
+    }
+
+    // Processes the pairs i < j of the upper triangle of an n x n matrix in square tiles.
+    // Tiles are handed out dynamically, so that all workers finish together, and within a tile
+    // the data of both sets of presses stays in cache.
+    //   func(ith, i0, i1, j0, j1) - process all pairs i < j with i in [i0, i1) and j in [j0, j1)
+    template<typename TTileFunc>
+    void processUpperTriangleTiled(int64_t n, int64_t tileSize, int nWorkers, const TTileFunc & func) {
+        const int64_t nTiles = (n + tileSize - 1)/tileSize;
+
+        std::vector<std::pair<int64_t, int64_t>> tiles;
+        for (int64_t ti = 0; ti < nTiles; ++ti) {
+            for (int64_t tj = ti; tj < nTiles; ++tj) {
+                tiles.emplace_back(ti, tj);
+            }
+        }
+
+        std::atomic<int64_t> nextTile(0);
+
+        ThreadPool::getShared().parallelFor(nWorkers, [&](int64_t ith) {
+            while (true) {
+                const int64_t it = nextTile++;
+                if (it >= (int64_t) tiles.size()) break;
+
+                const int64_t i0 = tiles[it].first*tileSize;
+                const int64_t j0 = tiles[it].second*tileSize;
+
+                func(ith, i0, std::min(n, i0 + tileSize), j0, std::min(n, j0 + tileSize));
+            }
+        });
+    }
+
+    void setMatch(TSimilarityMap & res, int64_t i, int64_t j, const std::tuple<TValueCC, TOffset> & match) {
+        const auto bestcc     = std::get<0>(match);
+        const auto bestoffset = std::get<1>(match);
+
+        res.set(i, j, bestcc, bestoffset);
+    }
+
+    // For a fixed lag, the dot products between the waveform0 windows of the rows and the shifted
+    // waveform1 windows of the columns of a tile form a matrix product. It is computed in register
+    // blocks of SIMD::kDotsRowsA x SIMD::kDotsRowsB presses, with all lags of a block visited before
+    // moving to the next one, so the windows of the block stay in L1 as in the direct search.
+    // Lags are visited in increasing order, so the result is identical to findBestCC(arena, i, j).
+    void processTileGEMM(const KeyPressArena & arena, int64_t i0, int64_t i1, int64_t j0, int64_t j1, TSimilarityMap & res) {
+        constexpr int kRA = SIMD::kDotsRowsA;
+        constexpr int kRB = SIMD::kDotsRowsB;
+
+        const auto nv = arena.nv;
+        const auto n = arena.n0*nv;
+
+        const int16_t * a[kRA];
+        const int16_t * b[kRB];
+        int64_t dots[kRA*kRB];
+
+        TValueCC bestcc[kRA*kRB];
+        TOffset besto[kRA*kRB];
+
+        for (int64_t ib0 = i0; ib0 < i1; ib0 += kRA) {
+            const int64_t ib1 = std::min(i1, ib0 + kRA);
+            if (j1 <= ib0 + 1) break;
+
+            int32_t maxAbsA = 0;
+            for (int k = 0; k < kRA; ++k) {
+                const int64_t i = std::min(ib0 + k, ib1 - 1);
+                a[k] = arena.getValues0(i);
+                maxAbsA = std::max(maxAbsA, arena.maxAbs[i]);
+            }
+
+            for (int64_t jb0 = std::max(j0, ib0 + 1); jb0 < j1; jb0 += kRB) {
+                const int64_t jb1 = std::min(j1, jb0 + kRB);
+
+                int32_t maxAbsB = 0;
+                for (int k = 0; k < kRB; ++k) {
+                    maxAbsB = std::max(maxAbsB, arena.maxAbs[std::min(jb0 + k, jb1 - 1)]);
+                }
+
+                for (int k = 0; k < kRA*kRB; ++k) {
+                    bestcc[k] = -1.0;
+                    besto[k] = -1;
+                }
+
+                for (int64_t o = 0; o <= 2*arena.alignWindow; ++o) {
+                    for (int k = 0; k < kRB; ++k) {
+                        b[k] = arena.getValues1(std::min(jb0 + k, jb1 - 1)) + o*nv;
+                    }
+
+                    SIMD::calcDotsI16(a, b, n, maxAbsA, maxAbsB, dots);
+
+                    for (int64_t i = ib0; i < ib1; ++i) {
+                        const auto sum0  = arena.getSum0(i);
+                        const auto sum02 = arena.getSum02(i);
+                        for (int64_t j = std::max(jb0, i + 1); j < jb1; ++j) {
+                            const auto k = (i - ib0)*kRB + (j - jb0);
+                            const auto cc = calcCCFromSums(sum0, sum02, arena.getSum1(j)[o], arena.getSum12(j)[o], dots[k], n);
+                            if (cc > bestcc[k]) {
+                                bestcc[k] = cc;
+                                besto[k] = o - arena.alignWindow;
+                            }
+                        }
+                    }
+                }
+
+                for (int64_t i = ib0; i < ib1; ++i) {
+                    for (int64_t j = std::max(jb0, i + 1); j < jb1; ++j) {
+                        const auto k = (i - ib0)*kRB + (j - jb0);
+                        setMatch(res, i, j, std::tuple<TValueCC, TOffset>(bestcc[k], besto[k]));
+                    }
+                }
+            }
+        }
+    }
+
+    // diagonal and average CC of each press over the upper triangle, summed in the same order as a row-wise pass
+    template<typename T>
+    void finalizeSimilarityMap(TKeyPressCollectionT<T> & keyPresses, TSimilarityMap & res) {
+        const int nPresses = keyPresses.size();
+
+        for (int i = 0; i < nPresses; ++i) {
+            res.set(i, i, 1.0f, 0);
+
+            auto & avgcc = keyPresses[i].ccAvg;
+            for (int j = i + 1; j < nPresses; ++j) {
+                avgcc += res.getCC(i, j);
+            }
+            avgcc /= (nPresses - 1);
+        }
+    }
+}
+
+//
+// FFT cross-correlation
+//
+
+namespace {
+    // Minimal radix-2 real FFT. The Core library does not link FFTW, so this is all we need for
+    // computing the cross-correlation of two key windows over all lags at once.
+    class RealFFT {
+    public:
+        using TComplex = std::complex<double>;
+
+        // n must be a power of 2, n >= 4
+        explicit RealFFT(int n) : m_n(n), m_m(n/2), m_rev(n/2), m_wHalf(n/4), m_wFull(n/2 + 1) {
+            int nbits = 0;
+            while ((1 << nbits) < m_m) ++nbits;
+
+            for (int i = 0; i < m_m; ++i) {
+                int r = 0;
+                for (int b = 0; b < nbits; ++b) {
+                    if (i & (1 << b)) r |= 1 << (nbits - 1 - b);
+                }
+                m_rev[i] = r;
+            }
+
+            for (int k = 0; k < m_m/2; ++k) m_wHalf[k] = std::polar(1.0, -2.0*pi*k/m_m);
+            for (int k = 0; k <= m_m; ++k)  m_wFull[k] = std::polar(1.0, -2.0*pi*k/m_n);
+        }
+
+        int size() const { return m_n; }
+        int sizeSpectrum() const { return m_m + 1; }
+
+        // x - n real samples, X - n/2 + 1 complex bins
+        void forward(const double * x, TComplex * X) const {
+            for (int k = 0; k < m_m; ++k) X[k] = TComplex(x[2*k], x[2*k + 1]);
+            fft(X, false);
+
+            const auto z0 = X[0];
+            X[0]   = TComplex(z0.real() + z0.imag(), 0.0);
+            X[m_m] = TComplex(z0.real() - z0.imag(), 0.0);
+
+            for (int k = 1; k <= m_m/2; ++k) {
+                const auto zk  = X[k];
+                const auto zmk = X[m_m - k];
+
+                const auto ek = 0.5*(zk + std::conj(zmk));
+                const auto ok = TComplex(0.0, -0.5)*(zk - std::conj(zmk));
+
+                X[k]       = ek + m_wFull[k]*ok;
+                X[m_m - k] = std::conj(ek) + m_wFull[m_m - k]*std::conj(ok);
+            }
+        }
+
+        // X - n/2 + 1 complex bins (destroyed), x - n real samples, scaled by 1/n
+        void inverse(TComplex * X, double * x) const {
+            {
+                const auto x0 = X[0];
+                const auto xm = X[m_m];
+                X[0] = 0.5*(x0 + std::conj(xm)) + TComplex(0.0, 0.5)*(x0 - std::conj(xm));
+            }
+
+            for (int k = 1; k <= m_m/2; ++k) {
+                const auto xk  = X[k];
+                const auto xmk = X[m_m - k];
+
+                const auto ek = 0.5*(xk + std::conj(xmk));
+                const auto ok = 0.5*(xk - std::conj(xmk))*std::conj(m_wFull[k]);
+
+                X[k]       = ek + TComplex(0.0, 1.0)*ok;
+                X[m_m - k] = std::conj(ek) + TComplex(0.0, 1.0)*std::conj(ok);
+            }
+
+            fft(X, true);
+
+            const double scale = 1.0/m_m;
+            for (int k = 0; k < m_m; ++k) {
+                x[2*k]     = scale*X[k].real();
+                x[2*k + 1] = scale*X[k].imag();
+            }
+        }
+
+    private:
+        // in-place, unscaled complex FFT of size n/2
+        void fft(TComplex * z, bool inv) const {
+            for (int i = 0; i < m_m; ++i) {
+                if (i < m_rev[i]) std::swap(z[i], z[m_rev[i]]);
+            }
+
+            for (int len = 2; len <= m_m; len <<= 1) {
+                const int half = len/2;
+                const int step = m_m/len;
+                for (int i = 0; i < m_m; i += len) {
+                    for (int k = 0; k < half; ++k) {
+                        const auto w = inv ? std::conj(m_wHalf[k*step]) : m_wHalf[k*step];
+                        const auto u = z[i + k];
+                        const auto v = z[i + k + half]*w;
+                        z[i + k]        = u + v;
+                        z[i + k + half] = u - v;
+                    }
+                }
+            }
+        }
+
+        int m_n;
+        int m_m;
+        std::vector<int> m_rev;
+        std::vector<TComplex> m_wHalf;
+        std::vector<TComplex> m_wFull;
+    };
+
+    int getFFTSize(int64_t n) {
+        int res = 4;
+        while (res < n) res <<= 1;
+        return res;
+    }
+
+    using TSpectrum = std::vector<RealFFT::TComplex>;
+
+    // spectrum of n zero-padded values
+    void calcSpectrum(const RealFFT & fft, const int16_t * values, int64_t n, std::vector<double> & work, TSpectrum & res) {
+        work.assign(fft.size(), 0.0);
+        for (int64_t iv = 0; iv < n; ++iv) work[iv] = values[iv];
+
+        res.resize(fft.sizeSpectrum());
+        fft.forward(work.data(), res.data());
+    }
+
+    // best lag from the FFT cross-correlation spectrum
+    //   spectrum0 - spectrum of waveform0 (n0 samples of nv values)
+    //   spectrum1 - spectrum of waveform1 (n0 + 2*alignWindow samples of nv values)
+    //   sum1      - waveform1 sums for each lag
+    //   work      - destroyed
+    // multi-value samples are correlated as flat arrays - lag o is at offset o*nv
+    std::tuple<TValueCC, TOffset> findBestCCFromSpectra(
+        const RealFFT & fft,
+        const TSpectrum & spectrum0,
+        const TSpectrum & spectrum1,
+        int64_t sum0, int64_t sum02,
+        const int64_t * sum1,
+        const int64_t * sum12,
+        int64_t nv, int64_t n0, int64_t alignWindow,
+        TSpectrum & work,
+        std::vector<double> & corr) {
+        TValueCC bestcc = -1.0;
+        TOffset besto = -1;
+
+        const int ns = fft.sizeSpectrum();
+
+        work.resize(ns);
+        for (int k = 0; k < ns; ++k) {
+            work[k] = std::conj(spectrum0[k])*spectrum1[k];
+        }
+
+        corr.resize(fft.size());
+        fft.inverse(work.data(), corr.data());
+
+        for (int o = 0; o <= 2*alignWindow; ++o) {
+            // the exact dot product is an integer - rounding removes the FFT round-off
+            const int64_t sum01 = std::llround(corr[o*nv]);
+            auto cc = calcCCFromSums(sum0, sum02, sum1[o], sum12[o], sum01, n0*nv);
+            if (cc > bestcc) {
+                besto = o - alignWindow;
+                bestcc = cc;
+            }
+        }
+
+        return std::tuple<TValueCC, TOffset>(bestcc, besto);
+    }
+
+    template<typename T>
+    bool calculateSimilartyMapFFT(
+            const KeyPressArena & arena,
+            TKeyPressCollectionT<T> & keyPresses,
+            TSimilarityMap & res,
+            int nWorkers) {
+        const int nPresses = arena.nPresses;
+
+        const auto nv = arena.nv;
+        const auto n0 = arena.n0;
+        const auto n1 = arena.n1;
+
+        // waveform0 is zero-padded to the same size, so lags up to 2*alignWindow never wrap around
+        const RealFFT fft(getFFTSize(n1*nv));
+
+        std::vector<TSpectrum> spectrum1(nPresses);
+
+        ThreadPool::getShared().parallelFor(nWorkers, [&](int64_t ith) {
+            std::vector<double> work;
+            for (int i = ith; i < nPresses; i += nWorkers) {
+                calcSpectrum(fft, arena.getValues1(i), n1*nv, work, spectrum1[i]);
+            }
+        });
+
+        struct Workspace {
+            std::vector<double> work;
+            std::vector<double> corr;
+            TSpectrum workSpectrum;
+            std::vector<TSpectrum> spectrum0;
+        };
+
+        std::vector<Workspace> workspaces(nWorkers);
+
+        const int64_t tileSize = getTileSize(sizeof(RealFFT::TComplex)*fft.sizeSpectrum());
+
+        processUpperTriangleTiled(nPresses, tileSize, nWorkers, [&](int ith, int64_t i0, int64_t i1, int64_t j0, int64_t j1) {
+            auto & ws = workspaces[ith];
+
+            ws.spectrum0.resize(tileSize);
+            for (int64_t i = i0; i < i1; ++i) {
+                calcSpectrum(fft, arena.getValues0(i), n0*nv, ws.work, ws.spectrum0[i - i0]);
+            }
+
+            for (int64_t i = i0; i < i1; ++i) {
+                for (int64_t j = std::max(j0, i + 1); j < j1; ++j) {
+                    setMatch(res, i, j, findBestCCFromSpectra(fft, ws.spectrum0[i - i0], spectrum1[j],
+                                                              arena.getSum0(i), arena.getSum02(i), arena.getSum1(j), arena.getSum12(j),
+                                                              nv, n0, arena.alignWindow, ws.workSpectrum, ws.corr));
+                }
+            }
+        });
+
+        finalizeSimilarityMap(keyPresses, res);
+
+        return true;
+    }
+}
+
+//
+// findBestCC
+//
+
+std::tuple<TValueCC, TOffset> findBestCC(
+    const TKeyWaveformF & waveform0,
+    const TKeyWaveformF & waveform1,
+    int is0, int is1,
+    int alignWindow) {
+    TOffset besto = -1;
+    TValueCC bestcc = -1.0f;
+
+    int is00 = waveform0.size()/2 - (is1 - is0)/2;
+    auto ret = calcSum(waveform0, is00, is00 + is1 - is0);
+    auto sum0  = std::get<0>(ret);
+    auto sum02 = std::get<1>(ret);
+
+    auto & pool = ThreadPool::getShared();
+
+    const int nWorkers = std::min(4, pool.getNThreads());
+
+    std::mutex mutex;
+    pool.parallelFor(nWorkers, [&](int64_t i) {
+        TOffset cbesto = -1;
+        TValueCC cbestcc = -1.0f;
+
+        for (int o = -alignWindow + i; o <= alignWindow; o += nWorkers) {
+            auto cc = calcCC(waveform0, waveform1, sum0, sum02, is00, is0 + o, is1 + o);
+            if (cc > cbestcc) {
+                cbesto = o;
+                cbestcc = cc;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (cbestcc > bestcc) {
+                bestcc = cbestcc;
+                besto = cbesto;
+            }
+        }
+    });
 
     return std::tuple<TValueCC, TOffset>(bestcc, besto);
 }
@@ -549,14 +1693,13 @@ std::tuple<TValueCC, TOffset> findBestCC(
     const TWaveformViewT<T> & waveform0,
     const TWaveformViewT<T> & waveform1,
     int64_t alignWindow) {
+    constexpr int64_t nv = kValuesPerSample<T>;
+
     TValueCC bestcc = -1.0;
     TOffset besto = -1;
 
-    //auto samples0 = waveform0.samples;
     auto n0       = waveform0.n;
 
-    auto samples1 = waveform1.samples;
-
 #ifdef MY_DEBUG
     auto n1 = waveform1.n;
     if (n0 + 2*alignWindow != n1) {
@@ -568,8 +1711,19 @@ std::tuple<TValueCC, TOffset> findBestCC(
     auto sum0  = std::get<0>(ret);
     auto sum02 = std::get<1>(ret);
 
+    // only the cross term depends on both windows - the waveform1 sums are updated incrementally
+    const auto values0 = getValues(waveform0.samples);
+    const auto values1 = getValues(waveform1.samples);
+
+    thread_local std::vector<int64_t> sum1;
+    thread_local std::vector<int64_t> sum12;
+    sum1.resize(2*alignWindow + 1);
+    sum12.resize(2*alignWindow + 1);
+    calcLagSums(values1, nv, n0, alignWindow, sum1.data(), sum12.data());
+
     for (int o = 0; o <= 2*alignWindow; ++o) {
-        auto cc = calcCC(waveform0, { samples1 + o, n0 }, sum0, sum02);
+        const auto sum01 = SIMD::calcDotI16(values0, values1 + o*nv, n0*nv);
+        auto cc = calcCCFromSums(sum0, sum02, sum1[o], sum12[o], sum01, n0*nv);
         if (cc > bestcc) {
             besto = o - alignWindow;
             bestcc = cc;
@@ -586,157 +1740,771 @@ template std::tuple<TValueCC, TOffset> findBestCC<TSampleI16>(
     const TWaveformViewT<TSampleI16> & waveform1,
     int64_t alignWindow);
 
+template std::tuple<TValueCC, TOffset> findBestCC<TSampleMI16>(
+    const TWaveformViewT<TSampleMI16> & waveform0,
+    const TWaveformViewT<TSampleMI16> & waveform1,
+    int64_t alignWindow);
+
+template<typename T>
+std::tuple<TValueCC, TOffset> findBestCCFFT(
+    const TWaveformViewT<T> & waveform0,
+    const TWaveformViewT<T> & waveform1,
+    int64_t alignWindow) {
+    constexpr int64_t nv = kValuesPerSample<T>;
+
+    const auto n0 = waveform0.n;
+    const auto n1 = n0 + 2*alignWindow;
+
+    const auto values0 = getValues(waveform0.samples);
+    const auto values1 = getValues(waveform1.samples);
+
+    const RealFFT fft(getFFTSize(n1*nv));
+
+    std::vector<double> work;
+    std::vector<double> corr;
+    TSpectrum workSpectrum;
+    TSpectrum spectrum0;
+    TSpectrum spectrum1;
+
+    calcSpectrum(fft, values0, n0*nv, work, spectrum0);
+    calcSpectrum(fft, values1, n1*nv, work, spectrum1);
+
+    auto ret = calcSum(waveform0);
+    auto sum0  = std::get<0>(ret);
+    auto sum02 = std::get<1>(ret);
+
+    std::vector<int64_t> sum1(2*alignWindow + 1);
+    std::vector<int64_t> sum12(2*alignWindow + 1);
+    calcLagSums(values1, nv, n0, alignWindow, sum1.data(), sum12.data());
+
+    return findBestCCFromSpectra(fft, spectrum0, spectrum1, sum0, sum02, sum1.data(), sum12.data(), nv, n0, alignWindow, workSpectrum, corr);
+}
+
+template std::tuple<TValueCC, TOffset> findBestCCFFT<TSampleI16>(
+    const TWaveformViewT<TSampleI16> & waveform0,
+    const TWaveformViewT<TSampleI16> & waveform1,
+    int64_t alignWindow);
+
+template std::tuple<TValueCC, TOffset> findBestCCFFT<TSampleMI16>(
+    const TWaveformViewT<TSampleMI16> & waveform0,
+    const TWaveformViewT<TSampleMI16> & waveform1,
+    int64_t alignWindow);
+
+//
+// key templates
+//
+
+namespace {
+    // magnitude of the quantized template and window values
+    // small enough for the blocked kernels to accumulate several iterations in i32
+    constexpr int32_t kKeyTemplateAmpl = 8191;
+
+    void quantizeKeyWaveform(const TSampleF * src, int64_t n, TSampleI16 * dst) {
+        double amax = 0.0;
+        for (int64_t i = 0; i < n; ++i) {
+            amax = std::max(amax, (double) std::abs(src[i]));
+        }
+
+        const double scale = amax > 0.0 ? kKeyTemplateAmpl/amax : 1.0;
+        for (int64_t i = 0; i < n; ++i) {
+            dst[i] = std::round(scale*src[i]);
+        }
+    }
+}
+
+bool initKeyTemplateBank(
+    const std::map<TKey, TKeyWaveformF> & templates,
+    int n0,
+    TKeyTemplateBank & res) {
+    res = {};
+
+    if (n0 <= 0) {
+        fprintf(stderr, "%s: invalid template size %d\n", __func__, n0);
+        return false;
+    }
+
+    const int64_t nRows = ((templates.size() + SIMD::kDotsRowsA - 1)/SIMD::kDotsRowsA)*SIMD::kDotsRowsA;
+
+    res.nTemplates = templates.size();
+    res.n0 = n0;
+    res.values.assign(nRows*n0, 0);
+    res.sum0.assign(nRows, 0);
+    res.sum02.assign(nRows, 0);
+
+    for (const auto & kt : templates) {
+        const auto & waveform = kt.second;
+        const int64_t is00 = waveform.size()/2 - n0/2;
+        if (is00 < 0 || is00 + n0 > (int64_t) waveform.size()) {
+            fprintf(stderr, "%s: template of key %d is shorter than %d samples\n", __func__, kt.first, n0);
+            res = {};
+            return false;
+        }
+
+        const int64_t row = res.keys.size();
+        auto values = res.values.data() + row*n0;
+        quantizeKeyWaveform(waveform.data() + is00, n0, values);
+
+        const auto ret = calcSum(TWaveformViewI16 { values, n0 });
+        res.sum0[row]  = std::get<0>(ret);
+        res.sum02[row] = std::get<1>(ret);
+
+        res.keys.push_back(kt.first);
+    }
+
+    return true;
+}
+
+bool calcKeyConfidence(
+    const TKeyTemplateBank & bank,
+    const TKeyWaveformF & waveform,
+    int is0, int is1,
+    int alignWindow,
+    TKeyConfidenceMap & res,
+    TKeyOffsetMap * bestOffsets) {
+    res.clear();
+    if (bestOffsets) {
+        bestOffsets->clear();
+    }
+
+    if (is1 - is0 != bank.n0) {
+        fprintf(stderr, "%s: window size %d does not match the template size %d\n", __func__, is1 - is0, (int) bank.n0);
+        return false;
+    }
+
+    if (is0 - alignWindow < 0 || is1 + alignWindow > (int) waveform.size()) {
+        fprintf(stderr, "%s: window [%d, %d) +/- %d is out of range\n", __func__, is0, is1, alignWindow);
+        return false;
+    }
+
+    const int64_t n0    = bank.n0;
+    const int64_t nLags = 2*alignWindow + 1;
+    const int64_t nRows = bank.sum0.size();
+
+    thread_local std::vector<TSampleI16> values1;
+    thread_local std::vector<int64_t> sum1;
+    thread_local std::vector<int64_t> sum12;
+
+    values1.resize(n0 + 2*alignWindow);
+    sum1.resize(nLags);
+    sum12.resize(nLags);
+
+    quantizeKeyWaveform(waveform.data() + is0 - alignWindow, values1.size(), values1.data());
+    calcLagSums(values1.data(), 1, n0, alignWindow, sum1.data(), sum12.data());
+
+    // the lags are split in contiguous chunks - merging the chunks in order gives the same offsets as a sequential scan
+    auto & pool = ThreadPool::getShared();
+
+    const int64_t nLagBlocks = (nLags + SIMD::kDotsRowsB - 1)/SIMD::kDotsRowsB;
+    const int64_t nChunks = std::min<int64_t>({ nLagBlocks, pool.getNThreads(), std::max<int64_t>(1, (nRows*nLags*n0) >> 22) });
+    const int64_t nLagsPerChunk = ((nLagBlocks + nChunks - 1)/nChunks)*SIMD::kDotsRowsB;
+
+    std::vector<TValueCC> bestcc(nChunks*nRows, -1.0);
+    std::vector<TOffset> besto(nChunks*nRows, -1);
+
+    pool.parallelFor(nChunks, [&](int64_t ic) {
+        const int64_t o0 = ic*nLagsPerChunk;
+        const int64_t o1 = std::min(nLags, o0 + nLagsPerChunk);
+
+        auto cbestcc = bestcc.data() + ic*nRows;
+        auto cbesto  = besto.data() + ic*nRows;
+
+        const int16_t * a[SIMD::kDotsRowsA];
+        const int16_t * b[SIMD::kDotsRowsB];
+        int64_t dots[SIMD::kDotsRowsA*SIMD::kDotsRowsB];
+
+        for (int64_t r0 = 0; r0 < nRows; r0 += SIMD::kDotsRowsA) {
+            for (int ia = 0; ia < SIMD::kDotsRowsA; ++ia) {
+                a[ia] = bank.values.data() + (r0 + ia)*n0;
+            }
+
+            for (int64_t o = o0; o < o1; o += SIMD::kDotsRowsB) {
+                for (int ib = 0; ib < SIMD::kDotsRowsB; ++ib) {
+                    b[ib] = values1.data() + std::min(o + ib, nLags - 1);
+                }
+
+                SIMD::calcDotsI16(a, b, n0, kKeyTemplateAmpl, kKeyTemplateAmpl, dots);
+
+                for (int ia = 0; ia < SIMD::kDotsRowsA; ++ia) {
+                    const int64_t r = r0 + ia;
+                    for (int ib = 0; ib < SIMD::kDotsRowsB && o + ib < o1; ++ib) {
+                        const auto cc = calcCCFromSums(bank.sum0[r], bank.sum02[r], sum1[o + ib], sum12[o + ib], dots[ia*SIMD::kDotsRowsB + ib], n0);
+                        if (cc > cbestcc[r]) {
+                            cbestcc[r] = cc;
+                            cbesto[r] = o + ib - alignWindow;
+                        }
+                    }
+                }
+            }
+        }
+    });
+
+    for (int64_t r = 0; r < bank.nTemplates; ++r) {
+        TValueCC cc = -1.0;
+        TOffset offset = -1;
+        for (int64_t ic = 0; ic < nChunks; ++ic) {
+            if (bestcc[ic*nRows + r] > cc) {
+                cc = bestcc[ic*nRows + r];
+                offset = besto[ic*nRows + r];
+            }
+        }
+
+        res[bank.keys[r]] = cc;
+        if (bestOffsets) {
+            (*bestOffsets)[bank.keys[r]] = offset;
+        }
+    }
+
+    return true;
+}
+
 //
 // calculateSimilarityMap
 //
 
-template<>
+namespace {
+    template<typename T>
+    bool calculateSimilartyMap(const KeyPressArena & arena, TKeyPressCollectionT<T> & keyPresses, TSimilarityMap & res, ECCMethod method, int nWorkers) {
+        const int nPresses = arena.nPresses;
+
+        if (method == ECCMethod::FFT) {
+            return calculateSimilartyMapFFT(arena, keyPresses, res, nWorkers);
+        }
+
+        KeyPressArena coarse;
+        if (method == ECCMethod::CoarseToFine) {
+            if (initCoarseKeyPressArena(arena, kCoarseDecimation, nWorkers, coarse) == false) {
+                fprintf(stderr, "warning : align window %d cannot be decimated, using direct search\n", (int) arena.alignWindow);
+                method = ECCMethod::Direct;
+            }
+        }
+
+        if (method == ECCMethod::GEMM) {
+            const int64_t tileSize = getTileSize(sizeof(int16_t)*arena.stride);
+
+            processUpperTriangleTiled(nPresses, tileSize, nWorkers, [&](int , int64_t i0, int64_t i1, int64_t j0, int64_t j1) {
+                processTileGEMM(arena, i0, i1, j0, j1, res);
+            });
+
+            finalizeSimilarityMap(keyPresses, res);
+
+            return true;
+        }
+
+        const int64_t tileSize = getTileSize(sizeof(int16_t)*(arena.stride + coarse.stride));
+
+        processUpperTriangleTiled(nPresses, tileSize, nWorkers, [&](int , int64_t i0, int64_t i1, int64_t j0, int64_t j1) {
+            for (int64_t i = i0; i < i1; ++i) {
+                for (int64_t j = std::max(j0, i + 1); j < j1; ++j) {
+                    if (method == ECCMethod::CoarseToFine) {
+                        setMatch(res, i, j, findBestCCCoarseToFine(arena, coarse, i, j));
+                    } else {
+                        setMatch(res, i, j, findBestCC(arena, i, j));
+                    }
+                }
+            }
+        });
+
+        finalizeSimilarityMap(keyPresses, res);
+
+        return true;
+    }
+}
+
+template<typename T>
 bool calculateSimilartyMap(
         const int32_t keyPressWidth_samples,
         const int32_t alignWindow_samples,
         const int32_t offsetFromPeak_samples,
-        TKeyPressCollectionT<TSampleMI16> & keyPresses,
-        TSimilarityMap & res) {
+        TKeyPressCollectionT<T> & keyPresses,
+        TSimilarityMap & res,
+        ECCMethod method) {
+    if (alignWindow_samples < 0 || alignWindow_samples > kMaxAlignWindow_samples) {
+        fprintf(stderr, "%s:%d: align window %d is out of range [0, %d]\n", __FILE__, __LINE__, alignWindow_samples, kMaxAlignWindow_samples);
+        return false;
+    }
+
     int nPresses = keyPresses.size();
 
-    int w = keyPressWidth_samples;
-    int a = alignWindow_samples;
+    res.reset(nPresses);
 
-    res.clear();
-    res.resize(nPresses);
-    for (auto & x : res) x.resize(nPresses);
+    const int nWorkers = ThreadPool::getShared().getNThreads();
 
-#ifdef __EMSCRIPTEN__
-    int nWorkers = std::min(kMaxThreads, std::max(1, int(std::thread::hardware_concurrency()) - 2));
-#else
-    int nWorkers = std::thread::hardware_concurrency();
-#endif
+    KeyPressArena arena;
+    initKeyPressArena(keyPressWidth_samples, alignWindow_samples, offsetFromPeak_samples, keyPresses, nWorkers, arena);
 
-    std::vector<std::thread> workers(nWorkers);
-    for (int iw = 0; iw < (int) workers.size(); ++iw) {
-        auto & worker = workers[iw];
-        worker = std::thread([&](int ith) {
-            for (int i = ith; i < nPresses; i += nWorkers) {
-                res[i][i].cc = 1.0f;
-                res[i][i].offset = 0;
+    return calculateSimilartyMap(arena, keyPresses, res, method, nWorkers);
+}
+
+template bool calculateSimilartyMap<TSampleI16>(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        TKeyPressCollectionT<TSampleI16> & keyPresses,
+        TSimilarityMap & res,
+        ECCMethod method);
+
+template bool calculateSimilartyMap<TSampleMI16>(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        TKeyPressCollectionT<TSampleMI16> & keyPresses,
+        TSimilarityMap & res,
+        ECCMethod method);
+
+//
+// updateSimilarityMap
+//
 
-                const auto & waveform0 = keyPresses[i].waveform;
-                const auto & pos0      = keyPresses[i].pos;
+struct SimilarityMapCache::Data {
+    KeyPressArena arena;
+    ECCMethod method = ECCMethod::Direct;
+    int64_t nUpdated = 0;
+};
 
-                auto & avgcc = keyPresses[i].ccAvg;
+SimilarityMapCache::SimilarityMapCache() : data_(new Data()) {}
+SimilarityMapCache::~SimilarityMapCache() {}
 
-                const auto samples0 = waveform0.samples;
+void SimilarityMapCache::clear() {
+    data_.reset(new Data());
+}
 
-                for (int j = i + 1; j < nPresses; ++j) {
-                    if (i == j) continue;
+int64_t SimilarityMapCache::getNUpdated() const {
+    return data_->nUpdated;
+}
 
-                    const auto waveform1 = keyPresses[j].waveform;
-                    const auto pos1      = keyPresses[j].pos;
+template<typename T>
+bool updateSimilarityMap(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        TKeyPressCollectionT<T> & keyPresses,
+        SimilarityMapCache & cache,
+        TSimilarityMap & res,
+        ECCMethod method) {
+    if (alignWindow_samples < 0 || alignWindow_samples > kMaxAlignWindow_samples) {
+        fprintf(stderr, "%s:%d: align window %d is out of range [0, %d]\n", __FILE__, __LINE__, alignWindow_samples, kMaxAlignWindow_samples);
+        cache.clear();
+        return false;
+    }
+
+    const int64_t nPresses = keyPresses.size();
+    const int nWorkers = ThreadPool::getShared().getNThreads();
+
+    auto & data = *cache.data_;
 
-                    const auto samples1 = waveform1.samples;
-                    const auto ret = findBestCC(TWaveformViewT<TSampleMI16> { samples0 + pos0 + offsetFromPeak_samples - w,     2*w },
-                                                TWaveformViewT<TSampleMI16> { samples1 + pos1 + offsetFromPeak_samples - w - a, 2*w + 2*a }, a);
+    KeyPressArena arena;
+    initKeyPressArena(keyPressWidth_samples, alignWindow_samples, offsetFromPeak_samples, keyPresses, nWorkers, arena);
 
-                    const auto bestcc     = std::get<0>(ret);
-                    const auto bestoffset = std::get<1>(ret);
+    const auto & prev = data.arena;
 
-                    res[i][j].cc = bestcc;
-                    res[i][j].offset = bestoffset;
+    const bool isCompatible =
+        prev.nPresses == arena.nPresses && prev.nv == arena.nv && prev.n0 == arena.n0 && prev.n1 == arena.n1 &&
+        prev.alignWindow == arena.alignWindow && data.method == method && (int64_t) res.size() == nPresses;
 
-                    res[j][i].cc = bestcc;
-                    res[j][i].offset = -bestoffset;
+    if (isCompatible == false) {
+        res.reset(nPresses);
+
+        if (calculateSimilartyMap(arena, keyPresses, res, method, nWorkers) == false) {
+            cache.clear();
+            return false;
+        }
 
-                    avgcc += bestcc;
+        data.arena = std::move(arena);
+        data.method = method;
+        data.nUpdated = nPresses;
+
+        return true;
+    }
+
+    std::vector<int64_t> changed;
+    std::vector<bool> isChanged(nPresses, false);
+    for (int64_t i = 0; i < nPresses; ++i) {
+        if (std::equal(arena.getValues1(i), arena.getValues1(i) + arena.n1*arena.nv, prev.getValues1(i)) == false) {
+            changed.push_back(i);
+            isChanged[i] = true;
+        }
+    }
+
+    KeyPressArena coarse;
+    if (method == ECCMethod::CoarseToFine && changed.size() > 0) {
+        if (initCoarseKeyPressArena(arena, kCoarseDecimation, nWorkers, coarse) == false) {
+            method = ECCMethod::Direct;
+        }
+    }
+
+    // each pair with at least one changed press is recomputed exactly once
+    ThreadPool::getShared().parallelFor(nWorkers, [&](int64_t ith) {
+        for (int64_t k = ith; k < (int64_t) changed.size(); k += nWorkers) {
+            const int64_t i = changed[k];
+            for (int64_t j = 0; j < nPresses; ++j) {
+                if (j == i || (isChanged[j] && j < i)) continue;
+
+                const int64_t i0 = std::min(i, j);
+                const int64_t i1 = std::max(i, j);
+                if (method == ECCMethod::CoarseToFine) {
+                    setMatch(res, i0, i1, findBestCCCoarseToFine(arena, coarse, i0, i1));
+                } else {
+                    setMatch(res, i0, i1, findBestCC(arena, i0, i1));
                 }
-                avgcc /= (nPresses - 1);
             }
-        }, iw);
-    }
+        }
+    });
 
-    for (auto & worker : workers) worker.join();
+    finalizeSimilarityMap(keyPresses, res);
+
+    data.arena = std::move(arena);
+    data.nUpdated = changed.size();
 
     return true;
 }
 
+template bool updateSimilarityMap<TSampleI16>(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        TKeyPressCollectionT<TSampleI16> & keyPresses,
+        SimilarityMapCache & cache,
+        TSimilarityMap & res,
+        ECCMethod method);
+
+template bool updateSimilarityMap<TSampleMI16>(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        TKeyPressCollectionT<TSampleMI16> & keyPresses,
+        SimilarityMapCache & cache,
+        TSimilarityMap & res,
+        ECCMethod method);
+
 template<typename T>
-bool calculateSimilartyMap(
+double calcCoarseToFineMismatchRate(
         const int32_t keyPressWidth_samples,
         const int32_t alignWindow_samples,
         const int32_t offsetFromPeak_samples,
-        TKeyPressCollectionT<T> & keyPresses,
-        TSimilarityMap & res) {
-    int nPresses = keyPresses.size();
+        const TKeyPressCollectionT<T> & keyPresses,
+        int64_t nPairsMax) {
+    const int64_t nPresses = keyPresses.size();
+    const int64_t nPairs = nPresses*(nPresses - 1)/2;
+    if (nPairs == 0 || nPairsMax <= 0) {
+        return 0.0;
+    }
+
+    const int nWorkers = ThreadPool::getShared().getNThreads();
+
+    KeyPressArena arena;
+    initKeyPressArena(keyPressWidth_samples, alignWindow_samples, offsetFromPeak_samples, keyPresses, nWorkers, arena);
+
+    KeyPressArena coarse;
+    if (initCoarseKeyPressArena(arena, kCoarseDecimation, nWorkers, coarse) == false) {
+        return 0.0;
+    }
+
+    // pairs evenly spread over the upper triangle
+    std::vector<std::pair<int64_t, int64_t>> pairs;
+    {
+        const int64_t step = std::max<int64_t>(1, nPairs/nPairsMax);
+
+        int64_t k = 0;
+        for (int64_t i = 0; i < nPresses && (int64_t) pairs.size() < nPairsMax; ++i) {
+            for (int64_t j = i + 1; j < nPresses && (int64_t) pairs.size() < nPairsMax; ++j, ++k) {
+                if (k % step == 0) pairs.emplace_back(i, j);
+            }
+        }
+    }
+
+    std::atomic<int64_t> nMismatch(0);
+    ThreadPool::getShared().parallelFor(nWorkers, [&](int64_t ith) {
+        for (int64_t k = ith; k < (int64_t) pairs.size(); k += nWorkers) {
+            const auto i = pairs[k].first;
+            const auto j = pairs[k].second;
+            if (std::get<1>(findBestCCCoarseToFine(arena, coarse, i, j)) != std::get<1>(findBestCC(arena, i, j))) {
+                ++nMismatch;
+            }
+        }
+    });
+
+    return double(nMismatch)/pairs.size();
+}
+
+template double calcCoarseToFineMismatchRate<TSampleI16>(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        const TKeyPressCollectionT<TSampleI16> & keyPresses,
+        int64_t nPairsMax);
+
+template double calcCoarseToFineMismatchRate<TSampleMI16>(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        const TKeyPressCollectionT<TSampleMI16> & keyPresses,
+        int64_t nPairsMax);
+
+//
+// KeyPressDetector
+//
+
+namespace {
+    // minimum number of samples per chunk for parallel key press detection
+    constexpr int64_t kFindKeysChunkMin_samples = 1 << 18;
+
+    // KeyPressDetector processes the input in blocks of this size, so its memory does not depend on the input size
+    constexpr int64_t kKeyPressDetectorBlock_samples = 1 << 14;
+}
+
+template<typename T>
+struct KeyPressDetector<T>::Data {
+    struct Candidate {
+        TKeyPressPosition pos;
+        T abs;
+    };
+
+    Parameters parameters;
+
+    int64_t k = 0;
+    int64_t nProcessed = 0;
+
+    // no output is produced for the samples before nBegin - see reset(offset, nWarmUp)
+    int64_t nBegin = 0;
+
+    // background ring buffer
+    // for integer samples the average is computed from the exact sum of the ring, so that it depends only
+    // on the samples in the ring and not on the rounding history
+    int rbBegin = 0;
+    int64_t rbSum = 0;
+    double rbAverage = 0.0;
+    std::vector<double> rbSamples;
+
+    // absolute values of the last k - 1 processed samples, padded with lowest() before the first one
+    std::vector<T> tail;
+
+    // work buffers for one block of samples
+    std::vector<T> buf;
+    std::vector<T> work;
+    std::vector<T> maxFull;
+    std::vector<T> maxRight;
+
+    // local maxima above the background threshold, before the removeLowPower and reset passes
+    std::vector<Candidate> candidates;
+};
+
+template<typename T>
+KeyPressDetector<T>::KeyPressDetector(Parameters && parameters) : data_(new Data()) {
+    getData().parameters = std::move(parameters);
+    reset();
+}
+
+template<typename T>
+KeyPressDetector<T>::~KeyPressDetector() {}
+
+template<typename T>
+void KeyPressDetector<T>::reset() {
+    reset(0, 0);
+}
+
+template<typename T>
+void KeyPressDetector<T>::reset(int64_t offset, int64_t nWarmUp) {
+    auto & data = getData();
+
+    data.k = data.parameters.historySize;
+    data.nProcessed = offset;
+    data.nBegin = offset + nWarmUp;
+
+    data.rbBegin = 0;
+    data.rbSum = 0;
+    data.rbAverage = 0.0;
+    data.rbSamples.assign(8*data.parameters.historySize, 0.0);
+
+    data.tail.assign(std::max<int64_t>(0, data.k - 1), std::numeric_limits<T>::lowest());
+    data.candidates.clear();
+}
+
+template<typename T>
+bool KeyPressDetector<T>::process(const T * samples, int64_t n, TWaveformT<T> * waveformThreshold, TWaveformT<T> * waveformMax) {
+    auto & data = getData();
+
+    const auto k = data.k;
+    const auto thresholdBackground = data.parameters.thresholdBackground;
+
+    if (k <= 0) {
+        fprintf(stderr, "%s: invalid history size %d\n", __func__, (int) k);
+        return false;
+    }
+
+    auto & rbBegin   = data.rbBegin;
+    auto & rbAverage = data.rbAverage;
+    auto & rbSamples = data.rbSamples;
+
+    auto & tail      = data.tail;
+    auto & buf       = data.buf;
+    auto & work      = data.work;
+    auto & maxFull   = data.maxFull;
+    auto & maxRight  = data.maxRight;
+
+    // The sample at itest = i - k/2 is a candidate when it is the last occurrence of the max of the window
+    // (i - k, i], i.e. it equals the max of the window and is larger than the max of the k/2 samples after it.
+    const int64_t kr = k/2;
+
+    for (int64_t b0 = 0; b0 < n; b0 += kKeyPressDetectorBlock_samples) {
+        const int64_t m = std::min(n - b0, kKeyPressDetectorBlock_samples);
+
+        // buf = [ tail | block ], so buf[k - 1 + q] is the q-th sample of the block
+        buf.resize(k - 1 + m);
+        work.resize(buf.size());
+        maxFull.resize(m);
+        maxRight.resize(m);
+
+        std::copy(tail.begin(), tail.end(), buf.begin());
+        for (int64_t q = 0; q < m; ++q) {
+            buf[k - 1 + q] = std::abs(samples[b0 + q]);
+        }
+
+        calcSlidingMax(buf.data(), buf.size(), k, work.data(), maxFull.data());
+        if (kr > 0) {
+            calcSlidingMax(buf.data() + k - kr, m + kr - 1, kr, work.data(), maxRight.data());
+        }
+
+        for (int64_t q = 0; q < m; ++q) {
+            const int64_t i = data.nProcessed + q;
+            const T acur = buf[k - 1 + q];
+
+            {
+                int64_t ii = i - k/2;
+                if (ii >= 0) {
+                    if constexpr (std::is_integral<T>::value) {
+                        data.rbSum += int64_t(acur) - int64_t(rbSamples[rbBegin]);
+                        rbAverage = double(data.rbSum)/rbSamples.size();
+                    } else {
+                        rbAverage *= rbSamples.size();
+                        rbAverage -= rbSamples[rbBegin];
+                        rbAverage += acur;
+                        rbAverage /= rbSamples.size();
+                    }
+                    rbSamples[rbBegin] = acur;
+                    if (++rbBegin >= (int) rbSamples.size()) {
+                        rbBegin = 0;
+                    }
+                }
+            }
+
+            if (i >= k && i >= data.nBegin) {
+                // the end-of-waveform condition is applied in getKeyPresses()
+                int64_t itest = i - k/2;
+                const T atest = buf[k - 1 + q - kr];
+                if (itest >= 2*k && atest >= maxFull[q] && (kr == 0 || atest > maxRight[q])) {
+                    if (atest > thresholdBackground*rbAverage) {
+                        data.candidates.push_back({ itest, atest });
+                    }
+                }
+                if (waveformThreshold) {
+                    (*waveformThreshold)[itest] = thresholdBackground*rbAverage;
+                }
+                if (waveformMax) {
+                    (*waveformMax)[itest] = maxFull[q];
+                }
+            }
+        }
+
+        std::copy(buf.end() - tail.size(), buf.end(), tail.begin());
+
+        data.nProcessed += m;
+    }
+
+    return true;
+}
+
+template<typename T>
+int64_t KeyPressDetector<T>::getNProcessed() const {
+    return getData().nProcessed;
+}
+
+template<typename T>
+int64_t KeyPressDetector<T>::getNWarmUp() const {
+    const auto & data = getData();
 
-    int w = keyPressWidth_samples;
-    int a = alignWindow_samples;
+    return data.rbSamples.size() + data.k;
+}
 
-    res.clear();
-    res.resize(nPresses);
-    for (auto & x : res) x.resize(nPresses);
+template<typename T>
+bool KeyPressDetector<T>::append(const KeyPressDetector & other) {
+    auto & data = getData();
+    const auto & dataOther = other.getData();
 
-#ifdef __EMSCRIPTEN__
-    int nWorkers = std::min(kMaxThreads, std::max(1, int(std::thread::hardware_concurrency()) - 2));
-#else
-    int nWorkers = std::thread::hardware_concurrency();
-#endif
+    if (dataOther.nBegin != data.nProcessed) {
+        fprintf(stderr, "%s: the other detector starts at %d instead of %d\n", __func__, (int) dataOther.nBegin, (int) data.nProcessed);
+        return false;
+    }
 
-    std::vector<std::thread> workers(nWorkers);
-    for (int iw = 0; iw < (int) workers.size(); ++iw) {
-        auto & worker = workers[iw];
-        worker = std::thread([&](int ith) {
-            for (int i = ith; i < nPresses; i += nWorkers) {
-                res[i][i].cc = 1.0f;
-                res[i][i].offset = 0;
+    data.nProcessed = dataOther.nProcessed;
 
-                const auto & waveform0 = keyPresses[i].waveform;
-                const auto & pos0      = keyPresses[i].pos;
+    data.rbBegin   = dataOther.rbBegin;
+    data.rbSum     = dataOther.rbSum;
+    data.rbAverage = dataOther.rbAverage;
+    data.rbSamples = dataOther.rbSamples;
 
-                auto & avgcc = keyPresses[i].ccAvg;
+    data.tail = dataOther.tail;
+    data.candidates.insert(data.candidates.end(), dataOther.candidates.begin(), dataOther.candidates.end());
 
-                const auto samples0 = waveform0.samples;
+    return true;
+}
 
-                for (int j = i + 1; j < nPresses; ++j) {
-                    if (i == j) continue;
+template<typename T>
+bool KeyPressDetector<T>::getKeyPresses(TKeyPressCollectionT<T> & res, const TWaveformViewT<T> & waveform) const {
+    const auto & data = getData();
 
-                    const auto waveform1 = keyPresses[j].waveform;
-                    const auto pos1      = keyPresses[j].pos;
+    const auto k = data.k;
+    const auto n = data.nProcessed;
 
-                    const auto samples1 = waveform1.samples;
-                    const auto ret = findBestCC(TWaveformViewT<T> { samples0 + pos0 + offsetFromPeak_samples - w,     2*w },
-                                                TWaveformViewT<T> { samples1 + pos1 + offsetFromPeak_samples - w - a, 2*w + 2*a }, a);
+    res.clear();
 
-                    const auto bestcc     = std::get<0>(ret);
-                    const auto bestoffset = std::get<1>(ret);
+    std::vector<typename Data::Candidate> cur;
+    for (const auto & c : data.candidates) {
+        if (c.pos >= n - 2*k) break;
+        cur.push_back(c);
+    }
 
-                    res[i][j].cc = bestcc;
-                    res[i][j].offset = bestoffset;
+    if (data.parameters.removeLowPower) {
+        while (true) {
+            auto oldn = cur.size();
 
-                    res[j][i].cc = bestcc;
-                    res[j][i].offset = -bestoffset;
+            double avgPower = 0.0;
+            for (const auto & c : cur) {
+                avgPower += c.abs;
+            }
+            avgPower /= cur.size();
 
-                    avgcc += bestcc;
+            auto tmp = std::move(cur);
+            cur.clear();
+            for (const auto & c : tmp) {
+                if (c.abs > 0.3*avgPower) {
+                    cur.push_back(c);
                 }
-                avgcc /= (nPresses - 1);
             }
-        }, iw);
+
+            if (cur.size() == oldn) break;
+        }
     }
 
-    for (auto & worker : workers) worker.join();
+    // the max of the window centered at a key press is the key press itself
+    const typename Data::Candidate * last = nullptr;
+    for (const auto & c : cur) {
+        if (last == nullptr || c.pos - last->pos > data.parameters.historySizeReset || c.abs > last->abs) {
+            res.push_back(TKeyPressDataT<T> { waveform, c.pos, 0.0, -1, -1, '?' });
+            last = &c;
+        }
+    }
 
     return true;
 }
 
-template bool calculateSimilartyMap<TSampleI16>(
-        const int32_t keyPressWidth_samples,
-        const int32_t alignWindow_samples,
-        const int32_t offsetFromPeak_samples,
-        TKeyPressCollectionT<TSampleI16> & keyPresses,
-        TSimilarityMap & res);
+template class KeyPressDetector<TSampleI16>;
+template class KeyPressDetector<TSampleF>;
 
 //
 // findKeyPresses
 //
 
+// key presses are detected on the first channel only
 template<>
 bool findKeyPresses(
         const TWaveformViewT<TSampleMI16> & waveform,
@@ -751,97 +2519,27 @@ bool findKeyPresses(
     waveformThreshold.resize(waveform.n);
     waveformMax.resize(waveform.n);
 
-    int rbBegin = 0;
-    double rbAverage = 0.0;
-    std::vector<double> rbSamples(8*historySize, 0.0);
-
-    int k = historySize;
-    std::deque<int64_t> que(k);
-
-    auto samples = waveform.samples;
-    auto n       = waveform.n;
-
-    TWaveformT<TSampleMI16> waveformAbs(n);
-    for (int64_t i = 0; i < n; ++i) {
-        waveformAbs[i][0] = std::abs(samples[i][0]);
+    TWaveformI16 waveform0(waveform.n);
+    for (int64_t i = 0; i < waveform.n; ++i) {
+        waveform0[i] = waveform.samples[i][0];
     }
 
-    for (int64_t i = 0; i < n; ++i) {
-        {
-            int64_t ii = i - k/2;
-            if (ii >= 0) {
-                rbAverage *= rbSamples.size();
-                rbAverage -= rbSamples[rbBegin];
-                double acur = waveformAbs[i][0];
-                rbSamples[rbBegin] = acur;
-                rbAverage += acur;
-                rbAverage /= rbSamples.size();
-                if (++rbBegin >= (int) rbSamples.size()) {
-                    rbBegin = 0;
-                }
-            }
-        }
-
-        if (i < k) {
-            while((!que.empty()) && waveformAbs[i] >= waveformAbs[que.back()]) {
-                que.pop_back();
-            }
-            que.push_back(i);
-        } else {
-            while((!que.empty()) && que.front() <= i - k) {
-                que.pop_front();
-            }
-
-            while((!que.empty()) && waveformAbs[i] >= waveformAbs[que.back()]) {
-                que.pop_back();
-            }
-
-            que.push_back(i);
-
-            int64_t itest = i - k/2;
-            if (itest >= 2*k && itest < n - 2*k && que.front() == itest) {
-                double acur = waveformAbs[itest][0];
-                if (acur > thresholdBackground*rbAverage) {
-                    res.emplace_back(TKeyPressDataT<TSampleMI16> { std::move(waveform), itest, 0.0, -1, -1, '?' });
-                }
-            }
-            waveformThreshold[itest][0] = thresholdBackground*rbAverage;
-            waveformMax[itest] = waveformAbs[que.front()];
-        }
+    TKeyPressCollectionI16 res0;
+    TWaveformI16 waveformThreshold0;
+    TWaveformI16 waveformMax0;
+    if (findKeyPresses(getView(waveform0, 0), res0, waveformThreshold0, waveformMax0,
+                       thresholdBackground, historySize, historySizeReset, removeLowPower) == false) {
+        return false;
     }
 
-    if (removeLowPower) {
-        while (true) {
-            auto oldn = res.size();
-
-            double avgPower = 0.0;
-            for (const auto & kp : res) {
-                avgPower += waveformAbs[kp.pos][0];
-            }
-            avgPower /= res.size();
-
-            auto tmp = std::move(res);
-            for (const auto & kp : tmp) {
-                if (waveformAbs[kp.pos][0] > 0.3*avgPower) {
-                    res.push_back(kp);
-                }
-            }
-
-            if (res.size() == oldn) break;
-        }
+    for (int64_t i = 0; i < waveform.n; ++i) {
+        waveformThreshold[i][0] = waveformThreshold0[i];
+        waveformMax[i] = {};
+        waveformMax[i][0] = waveformMax0[i];
     }
 
-    if (res.size() > 1) {
-        TKeyPressCollectionT<TSampleMI16> res2;
-        res2.push_back(res.front());
-
-        for (int i = 1; i < (int) res.size(); ++i) {
-            if (res[i].pos - res2.back().pos > historySizeReset || waveformMax[res[i].pos] > waveformMax[res2.back().pos]) {
-                res2.push_back(res[i]);
-            }
-        }
-
-        std::swap(res, res2);
+    for (const auto & kp : res0) {
+        res.emplace_back(TKeyPressDataT<TSampleMI16> { waveform, kp.pos, 0.0, -1, -1, '?' });
     }
 
     return true;
@@ -857,104 +2555,70 @@ bool findKeyPresses(
         int historySize,
         int historySizeReset,
         bool removeLowPower) {
-    res.clear();
     waveformThreshold.resize(waveform.n);
     waveformMax.resize(waveform.n);
 
-    int rbBegin = 0;
-    double rbAverage = 0.0;
-    std::vector<double> rbSamples(8*historySize, 0.0);
-
-    int k = historySize;
-    std::deque<int64_t> que(k);
+    return findKeyPresses(waveform, res, thresholdBackground, historySize, historySizeReset, removeLowPower, &waveformThreshold, &waveformMax);
+}
 
-    auto samples = waveform.samples;
-    auto n       = waveform.n;
+template<typename T>
+bool findKeyPresses(
+        const TWaveformViewT<T> & waveform,
+        TKeyPressCollectionT<T> & res,
+        double thresholdBackground,
+        int historySize,
+        int historySizeReset,
+        bool removeLowPower,
+        TWaveformT<T> * waveformThreshold,
+        TWaveformT<T> * waveformMax) {
+    res.clear();
 
-    TWaveformT<T> waveformAbs(n);
-    for (int64_t i = 0; i < n; ++i) {
-        waveformAbs[i] = std::abs(samples[i]);
+    if (waveformThreshold) {
+        waveformThreshold->resize(waveform.n);
+    }
+    if (waveformMax) {
+        waveformMax->resize(waveform.n);
     }
 
-    for (int64_t i = 0; i < n; ++i) {
-        {
-            int64_t ii = i - k/2;
-            if (ii >= 0) {
-                rbAverage *= rbSamples.size();
-                rbAverage -= rbSamples[rbBegin];
-                double acur = waveformAbs[i];
-                rbSamples[rbBegin] = acur;
-                rbAverage += acur;
-                rbAverage /= rbSamples.size();
-                if (++rbBegin >= (int) rbSamples.size()) {
-                    rbBegin = 0;
-                }
-            }
-        }
-
-        if (i < k) {
-            while((!que.empty()) && waveformAbs[i] >= waveformAbs[que.back()]) {
-                que.pop_back();
-            }
-            que.push_back(i);
-        } else {
-            while((!que.empty()) && que.front() <= i - k) {
-                que.pop_front();
-            }
-
-            while((!que.empty()) && waveformAbs[i] >= waveformAbs[que.back()]) {
-                que.pop_back();
-            }
-
-            que.push_back(i);
+    // Long waveforms are split into chunks that are processed in parallel. Each chunk starts getNWarmUp()
+    // samples early, so its state matches the serial one, and the candidates of the chunks are concatenated
+    // in order. The removeLowPower and reset passes run once over all candidates, so the result is identical.
+    auto & pool = ThreadPool::getShared();
 
-            int64_t itest = i - k/2;
-            if (itest >= 2*k && itest < n - 2*k && que.front() == itest) {
-                double acur = waveformAbs[itest];
-                if (acur > thresholdBackground*rbAverage) {
-                    res.emplace_back(TKeyPressDataT<T> { std::move(waveform), itest, 0.0, -1, -1, '?' });
-                }
-            }
-            waveformThreshold[itest] = thresholdBackground*rbAverage;
-            waveformMax[itest] = waveformAbs[que.front()];
-        }
-    }
+    std::vector<std::unique_ptr<KeyPressDetector<T>>> detectors(1);
+    detectors[0].reset(new KeyPressDetector<T>({ thresholdBackground, historySize, historySizeReset, removeLowPower }));
 
-    if (removeLowPower) {
-        while (true) {
-            auto oldn = res.size();
+    const int64_t nWarmUp = detectors[0]->getNWarmUp();
+    const int64_t nChunkMin = std::max<int64_t>(kFindKeysChunkMin_samples, 16*nWarmUp);
+    const int64_t nChunks = std::is_integral<T>::value ? std::max<int64_t>(1, std::min<int64_t>(pool.getNThreads(), waveform.n/nChunkMin)) : 1;
 
-            double avgPower = 0.0;
-            for (const auto & kp : res) {
-                avgPower += waveformAbs[kp.pos];
-            }
-            avgPower /= res.size();
+    detectors.resize(nChunks);
 
-            auto tmp = std::move(res);
-            for (const auto & kp : tmp) {
-                if (waveformAbs[kp.pos] > 0.3*avgPower) {
-                    res.push_back(kp);
-                }
-            }
+    std::atomic_bool ok(true);
+    pool.parallelFor(nChunks, [&](int64_t ic) {
+        const int64_t is0 = (ic*waveform.n)/nChunks;
+        const int64_t is1 = ((ic + 1)*waveform.n)/nChunks;
+        const int64_t isw = std::max<int64_t>(0, is0 - nWarmUp);
 
-            if (res.size() == oldn) break;
+        if (!detectors[ic]) {
+            detectors[ic].reset(new KeyPressDetector<T>({ thresholdBackground, historySize, historySizeReset, removeLowPower }));
         }
-    }
-
-    if (res.size() > 1) {
-        TKeyPressCollectionT<T> res2;
-        res2.push_back(res.front());
+        detectors[ic]->reset(isw, is0 - isw);
 
-        for (int i = 1; i < (int) res.size(); ++i) {
-            if (res[i].pos - res2.back().pos > historySizeReset || waveformMax[res[i].pos] > waveformMax[res2.back().pos]) {
-                res2.push_back(res[i]);
-            }
+        if (detectors[ic]->process(waveform.samples + isw, is1 - isw, waveformThreshold, waveformMax) == false) {
+            ok = false;
         }
+    });
 
-        std::swap(res, res2);
+    for (int64_t ic = 1; ic < nChunks && ok; ++ic) {
+        ok = detectors[0]->append(*detectors[ic]);
     }
 
-    return true;
+    if (ok == false) {
+        return false;
+    }
+
+    return detectors[0]->getKeyPresses(res, waveform);
 }
 
 template bool findKeyPresses<TSampleI16>(
@@ -967,6 +2631,16 @@ template bool findKeyPresses<TSampleI16>(
         int historySizeReset,
         bool removeLowPower);
 
+template bool findKeyPresses<TSampleI16>(
+        const TWaveformViewT<TSampleI16> & waveform,
+        TKeyPressCollectionT<TSampleI16> & res,
+        double thresholdBackground,
+        int historySize,
+        int historySizeReset,
+        bool removeLowPower,
+        TWaveformT<TSampleI16> * waveformThreshold,
+        TWaveformT<TSampleI16> * waveformMax);
+
 template<typename T>
 bool saveKeyPresses(const std::string & fname, const TKeyPressCollectionT<T> & keyPresses) {
     std::ofstream fout(fname, std::ios::binary);
@@ -1013,6 +2687,264 @@ bool dumpKeyPresses(const std::string & fname, const TKeyPressCollectionT<T> & d
 
 template bool dumpKeyPresses<TSampleI16>(const std::string & fname, const TKeyPressCollectionT<TSampleI16> & data);
 
+//
+// analysis cache
+//
+
+namespace {
+    constexpr char kAnalysisCacheMagic[8] = { 'K', 'B', 'D', 'C', 'A', 'C', 'H', 'E' };
+    constexpr uint32_t kAnalysisCacheVersion = 2;
+
+    static_assert(sizeof(TAnalysisKey) == 40, "TAnalysisKey must not have padding - it is hashed and stored bytewise");
+    static_assert(sizeof(stPackedMatch) == 6, "Unexpected stPackedMatch layout");
+
+    // the XXH64 primes
+    constexpr uint64_t kHashP1 = 0x9E3779B185EBCA87ull;
+    constexpr uint64_t kHashP2 = 0xC2B2AE3D27D4EB4Full;
+    constexpr uint64_t kHashP3 = 0x165667B19E3779F9ull;
+    constexpr uint64_t kHashP4 = 0x85EBCA77C2B2AE63ull;
+    constexpr uint64_t kHashP5 = 0x27D4EB2F165667C5ull;
+
+    inline uint64_t rotl64(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline uint64_t read64(const uint8_t * p) {
+        uint64_t res;
+        std::memcpy(&res, p, sizeof(res));
+        return res;
+    }
+
+    inline uint64_t hashRound(uint64_t acc, uint64_t v) {
+        return rotl64(acc + v*kHashP2, 31)*kHashP1;
+    }
+
+    template <typename T>
+    void append(std::vector<char> & buf, const T * data, size_t n) {
+        buf.insert(buf.end(), (const char *)(data), (const char *)(data + n));
+    }
+
+    template <typename T>
+    bool extract(const std::vector<char> & buf, size_t & pos, T * data, size_t n) {
+        if (pos + n*sizeof(T) > buf.size()) return false;
+        std::memcpy((void *)(data), buf.data() + pos, n*sizeof(T));
+        pos += n*sizeof(T);
+        return true;
+    }
+}
+
+uint64_t calcHash(const void * data, size_t size, uint64_t seed) {
+    const uint8_t * p = (const uint8_t *) data;
+    const uint8_t * end = p + size;
+
+    uint64_t res = 0;
+
+    if (size >= 32) {
+        // 4 independent lanes, so that the multiplications of a stripe overlap
+        uint64_t acc[4] = { seed + kHashP1 + kHashP2, seed + kHashP2, seed, seed - kHashP1 };
+        do {
+            for (int i = 0; i < 4; ++i) {
+                acc[i] = hashRound(acc[i], read64(p + 8*i));
+            }
+            p += 32;
+        } while (end - p >= 32);
+
+        res = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+        for (int i = 0; i < 4; ++i) {
+            res = (res ^ hashRound(0, acc[i]))*kHashP1 + kHashP4;
+        }
+    } else {
+        res = seed + kHashP5;
+    }
+
+    res += size;
+
+    for (; end - p >= 8; p += 8) {
+        res = rotl64(res ^ hashRound(0, read64(p)), 27)*kHashP1 + kHashP4;
+    }
+
+    if (end - p >= 4) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        res = rotl64(res ^ (v*kHashP1), 23)*kHashP2 + kHashP3;
+        p += 4;
+    }
+
+    for (; p < end; ++p) {
+        res = rotl64(res ^ (*p*kHashP5), 11)*kHashP1;
+    }
+
+    res ^= res >> 33;
+    res *= kHashP2;
+    res ^= res >> 29;
+    res *= kHashP3;
+    res ^= res >> 32;
+
+    return res;
+}
+
+uint64_t calcRecordingHash(const std::string & fname, const TWaveformViewF & samples) {
+    if (RecordingReader::isContainer(fname)) {
+        RecordingReader reader;
+        if (reader.open(fname) && reader.getInfo().hasStats) {
+            const auto & info = reader.getInfo();
+
+            std::ifstream fin(fname, std::ios::binary | std::ios::ate);
+            const int64_t size_bytes = fin.good() ? (int64_t) fin.tellg() : -1;
+
+            uint64_t res = calcHashOf(size_bytes);
+            res = calcHashOf((int32_t) info.sampleType, res);
+            res = calcHashOf(info.sampleRate, res);
+            res = calcHashOf(info.nChannels, res);
+            res = calcHashOf(info.chunkSize_samples, res);
+            res = calcHashOf(info.nSamples, res);
+
+            std::vector<float> stats(2*info.nChunks);
+            for (int64_t i = 0; i < info.nChunks; ++i) {
+                reader.getChunkStats(i, stats[2*i + 0], stats[2*i + 1]);
+            }
+
+            return calcHash(stats.data(), stats.size()*sizeof(float), res);
+        }
+    }
+
+    return calcHash(samples.samples, samples.n*sizeof(TSampleF));
+}
+
+uint64_t calcDetectionHash(double thresholdBackground, int historySize, int historySizeReset, bool removeLowPower, double thresholdLowSimilarity) {
+    uint64_t res = calcHashOf(thresholdBackground);
+    res = calcHashOf(historySize, res);
+    res = calcHashOf(historySizeReset, res);
+    res = calcHashOf(removeLowPower, res);
+    res = calcHashOf(thresholdLowSimilarity, res);
+
+    return res;
+}
+
+std::string getAnalysisCachePath(const std::string & fnameRecording, const TAnalysisKey & key) {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) calcHashOf(key));
+
+    return fnameRecording + "." + hex + ".cache";
+}
+
+bool saveAnalysisCache(const std::string & fname, const TAnalysisKey & key, const TAnalysisCache & cache) {
+    const int32_t nMap = cache.similarityMap.size();
+    const int64_t nPositions = cache.positions.size();
+    const size_t nPacked = size_t(nMap)*(nMap + 1)/2;
+
+    std::vector<char> buf;
+    buf.reserve(128 + nPositions*sizeof(TKeyPressPosition) + nPacked*sizeof(stPackedMatch));
+
+    const uint32_t reserved = 0;
+    append(buf, kAnalysisCacheMagic, sizeof(kAnalysisCacheMagic));
+    append(buf, &kAnalysisCacheVersion, 1);
+    append(buf, &reserved, 1);
+    append(buf, &key, 1);
+    append(buf, &cache.freqCutoff_Hz, 1);
+    append(buf, &nMap, 1);
+    append(buf, &nPositions, 1);
+    append(buf, cache.positions.data(), nPositions);
+    append(buf, cache.similarityMap.getPacked(), nPacked);
+
+    // detects truncated or damaged files
+    const uint64_t checksum = calcHash(buf.data(), buf.size());
+    append(buf, &checksum, 1);
+
+    // unique per writer - parameter sweeps run many processes on the same recording
+    const std::string fnameTmp = fname + ".tmp" + std::to_string(std::random_device{}());
+    {
+        std::ofstream fout(fnameTmp, std::ios::binary);
+        if (fout.good() == false) {
+            fprintf(stderr, "%s:%d: failed to open '%s'\n", __FILE__, __LINE__, fnameTmp.c_str());
+            return false;
+        }
+
+        fout.write(buf.data(), buf.size());
+        if (fout.good() == false) {
+            fout.close();
+            std::remove(fnameTmp.c_str());
+            return false;
+        }
+    }
+
+    if (std::rename(fnameTmp.c_str(), fname.c_str()) != 0) {
+        // rename() does not replace existing files everywhere
+        std::remove(fname.c_str());
+        if (std::rename(fnameTmp.c_str(), fname.c_str()) != 0) {
+            std::remove(fnameTmp.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool loadAnalysisCache(const std::string & fname, const TAnalysisKey & key, TAnalysisCache & cache) {
+    std::vector<char> buf;
+    {
+        std::ifstream fin(fname, std::ios::binary | std::ios::ate);
+        if (fin.good() == false) {
+            return false;
+        }
+
+        const int64_t size = fin.tellg();
+        if (size < (int64_t) sizeof(uint64_t)) {
+            return false;
+        }
+
+        buf.resize(size);
+        fin.seekg(0, std::ios::beg);
+        fin.read(buf.data(), size);
+        if (fin.gcount() != size) {
+            return false;
+        }
+    }
+
+    uint64_t checksum = 0;
+    std::memcpy(&checksum, buf.data() + buf.size() - sizeof(checksum), sizeof(checksum));
+    buf.resize(buf.size() - sizeof(checksum));
+    if (checksum != calcHash(buf.data(), buf.size())) {
+        fprintf(stderr, "%s:%d: '%s' is damaged - ignoring it\n", __FILE__, __LINE__, fname.c_str());
+        return false;
+    }
+
+    size_t pos = 0;
+
+    char magic[sizeof(kAnalysisCacheMagic)];
+    uint32_t version = 0;
+    uint32_t reserved = 0;
+    TAnalysisKey keyCached;
+    if (extract(buf, pos, magic, sizeof(magic)) == false || std::memcmp(magic, kAnalysisCacheMagic, sizeof(magic)) != 0 ||
+        extract(buf, pos, &version, 1) == false || version != kAnalysisCacheVersion ||
+        extract(buf, pos, &reserved, 1) == false ||
+        extract(buf, pos, &keyCached, 1) == false || (keyCached == key) == false) {
+        return false;
+    }
+
+    int32_t freqCutoff_Hz = 0;
+    int32_t nMap = 0;
+    int64_t nPositions = 0;
+    if (extract(buf, pos, &freqCutoff_Hz, 1) == false ||
+        extract(buf, pos, &nMap, 1) == false ||
+        extract(buf, pos, &nPositions, 1) == false ||
+        nMap < 0 || nPositions < 0 ||
+        uint64_t(nPositions)*sizeof(TKeyPressPosition) + uint64_t(nMap)*(nMap + 1)/2*sizeof(stPackedMatch) != buf.size() - pos) {
+        return false;
+    }
+
+    cache.freqCutoff_Hz = freqCutoff_Hz;
+    cache.positions.resize(nPositions);
+    cache.similarityMap.reset(nMap);
+    if (extract(buf, pos, cache.positions.data(), nPositions) == false ||
+        extract(buf, pos, cache.similarityMap.getPacked(), size_t(nMap)*(nMap + 1)/2) == false) {
+        cache = {};
+        return false;
+    }
+
+    return true;
+}
+
 template<typename TSample>
 void cbPlayback(void * userData, uint8_t * stream, int len) {
     TPlaybackDataT<TSample> * data = (TPlaybackDataT<TSample> *)(userData);
@@ -1058,44 +2990,153 @@ template<typename T>
 bool generateLowResWaveform(const TWaveformViewT<T> & waveform, TWaveformT<T> & waveformLowRes, int nWindow) {
     waveformLowRes.resize(waveform.n);
 
-    int k = nWindow;
-    std::deque<int64_t> que(k);
+    const int64_t k = nWindow;
+    const int64_t n = waveform.n;
 
-    //auto [samples, n] = waveform;
-    auto samples = waveform.samples;
-    auto n       = waveform.n;
+    if (k <= 0 || n <= k) {
+        return true;
+    }
 
     TWaveformT<T> waveformAbs(n);
     for (int64_t i = 0; i < n; ++i) {
-        waveformAbs[i] = std::abs(samples[i]);
+        waveformAbs[i] = std::abs(waveform.samples[i]);
     }
 
-    for (int64_t i = 0; i < n; ++i) {
-        if (i < k) {
-            while((!que.empty()) && waveformAbs[i] >= waveformAbs[que.back()]) {
-                que.pop_back();
+    // the windows [j, j + k) for j in [1, n - k], each stored at its center j + k - 1 - k/2
+    TWaveformT<T> work(n);
+    calcSlidingMax(waveformAbs.data() + 1, n - 1, k, work.data(), waveformLowRes.data() + k - k/2);
+
+    return true;
+}
+
+template bool generateLowResWaveform<TSampleI16>(const TWaveformViewT<TSampleI16> & waveform, TWaveformT<TSampleI16> & waveformLowRes, int nWindow);
+
+template<typename T>
+bool updateWaveformPyramid(const TWaveformViewT<T> & waveform, TWaveformPyramidT<T> & pyramid) {
+    const int64_t n = waveform.n;
+    const int64_t k = TWaveformPyramidT<T>::kBinSize;
+
+    auto & levelMin = pyramid.levelMin;
+    auto & levelMax = pyramid.levelMax;
+
+    int l = 0;
+    for (; (k << l) <= n; ++l) {
+        if (l == (int) levelMin.size()) {
+            levelMin.emplace_back();
+            levelMax.emplace_back();
+        }
+
+        const int64_t nBins = n/(k << l);
+        const int64_t nOld = std::min((int64_t) levelMin[l].size(), nBins);
+
+        levelMin[l].resize(nBins);
+        levelMax[l].resize(nBins);
+
+        auto curMin = levelMin[l].data();
+        auto curMax = levelMax[l].data();
+
+        if (l == 0) {
+            for (int64_t j = nOld; j < nBins; ++j) {
+                const T * samples = waveform.samples + j*k;
+                T vmin = samples[0];
+                T vmax = samples[0];
+                for (int64_t i = 1; i < k; ++i) {
+                    vmin = std::min(vmin, samples[i]);
+                    vmax = std::max(vmax, samples[i]);
+                }
+                curMin[j] = vmin;
+                curMax[j] = vmax;
             }
-            que.push_back(i);
         } else {
-            while((!que.empty()) && que.front() <= i - k) {
-                que.pop_front();
+            const auto prevMin = levelMin[l - 1].data();
+            const auto prevMax = levelMax[l - 1].data();
+            for (int64_t j = nOld; j < nBins; ++j) {
+                curMin[j] = std::min(prevMin[2*j], prevMin[2*j + 1]);
+                curMax[j] = std::max(prevMax[2*j], prevMax[2*j + 1]);
             }
+        }
+    }
+
+    levelMin.resize(l);
+    levelMax.resize(l);
+
+    pyramid.n = n;
+
+    return true;
+}
+
+template bool updateWaveformPyramid<TSampleI16>(const TWaveformViewT<TSampleI16> & waveform, TWaveformPyramidT<TSampleI16> & pyramid);
+
+template<typename T>
+bool getWaveformMinMax(
+    const TWaveformViewT<T> & waveform, const TWaveformPyramidT<T> & pyramid,
+    int64_t offset, int64_t nview, int nBins,
+    TWaveformT<T> & resMin, TWaveformT<T> & resMax) {
+    if (nBins <= 0 || nview <= 0 || offset < 0 || offset + nview > pyramid.n || waveform.n < pyramid.n) {
+        return false;
+    }
 
-            while((!que.empty()) && waveformAbs[i] >= waveformAbs[que.back()]) {
-                que.pop_back();
+    resMin.resize(nBins);
+    resMax.resize(nBins);
+
+    const int64_t k = TWaveformPyramidT<T>::kBinSize;
+    const int nLevels = pyramid.levelMin.size();
+
+    for (int b = 0; b < nBins; ++b) {
+        const int64_t i0 = offset + (b*nview)/nBins;
+        const int64_t i1 = std::max(i0 + 1, offset + ((b + 1)*nview)/nBins);
+
+        T vmin = std::numeric_limits<T>::max();
+        T vmax = std::numeric_limits<T>::lowest();
+
+        auto addSamples = [&](int64_t j0, int64_t j1) {
+            for (int64_t i = j0; i < j1; ++i) {
+                vmin = std::min(vmin, waveform.samples[i]);
+                vmax = std::max(vmax, waveform.samples[i]);
             }
+        };
+
+        auto addBin = [&](int l, int64_t j) {
+            vmin = std::min(vmin, pyramid.levelMin[l][j]);
+            vmax = std::max(vmax, pyramid.levelMax[l][j]);
+        };
+
+        // the complete bins of the first level inside [i0, i1)
+        int64_t j0 = (i0 + k - 1)/k;
+        int64_t j1 = i1/k;
+
+        if (j0 >= j1) {
+            addSamples(i0, i1);
+        } else {
+            addSamples(i0, j0*k);
+            addSamples(j1*k, i1);
+
+            // climb the levels, taking the unpaired bins at the two ends of the range
+            for (int l = 0; j0 < j1; ++l) {
+                if (l + 1 == nLevels) {
+                    for (int64_t j = j0; j < j1; ++j) addBin(l, j);
+                    break;
+                }
 
-            que.push_back(i);
+                if (j0 & 1) addBin(l, j0++);
+                if (j1 & 1) addBin(l, --j1);
 
-            int64_t itest = i - k/2;
-            waveformLowRes[itest] = waveformAbs[que.front()];
+                j0 >>= 1;
+                j1 >>= 1;
+            }
         }
+
+        resMin[b] = vmin;
+        resMax[b] = vmax;
     }
 
     return true;
 }
 
-template bool generateLowResWaveform<TSampleI16>(const TWaveformViewT<TSampleI16> & waveform, TWaveformT<TSampleI16> & waveformLowRes, int nWindow);
+template bool getWaveformMinMax<TSampleI16>(
+    const TWaveformViewT<TSampleI16> & waveform, const TWaveformPyramidT<TSampleI16> & pyramid,
+    int64_t offset, int64_t nview, int nBins,
+    TWaveformT<TSampleI16> & resMin, TWaveformT<TSampleI16> & resMax);
 
 template<typename T>
 bool adjustKeyPresses(TKeyPressCollectionT<T> & keyPresses, TSimilarityMap & sim) {
@@ -1114,7 +3155,7 @@ bool adjustKeyPresses(TKeyPressCollectionT<T> & keyPresses, TSimilarityMap & sim
     std::vector<Pair> ccpairs;
     for (int i = 0; i < n - 1; ++i) {
         for (int j = i + 1; j < n; ++j) {
-            ccpairs.emplace_back(Pair{i, j, sim[i][j].cc});
+            ccpairs.emplace_back(Pair{i, j, sim.getCC(i, j)});
         }
     }
 
@@ -1130,16 +3171,16 @@ bool adjustKeyPresses(TKeyPressCollectionT<T> & keyPresses, TSimilarityMap & sim
         int k1 = curpair.j;
         if (used[k0] && used[k1]) continue;
 
-        if (sim[k0][k1].offset != 0) res = true;
+        const auto offset = sim.getOffset(k0, k1);
+        if (offset != 0) res = true;
 
         if (used[k1] == false) {
-            keyPresses[k1].pos += sim[k0][k1].offset;
+            keyPresses[k1].pos += offset;
         } else {
-            keyPresses[k0].pos -= sim[k0][k1].offset;
+            keyPresses[k0].pos -= offset;
         }
 
-        sim[k0][k1].offset = 0;
-        sim[k1][k0].offset = 0;
+        sim.setOffset(k0, k1, 0);
 
         if (used[k0] == false) { used[k0] = true; ++nused; }
         if (used[k1] == false) { used[k1] = true; ++nused; }
@@ -1169,7 +3210,7 @@ bool removeLowSimilarityKeys(TKeyPressCollectionT<T> & keyPresses, TSimilarityMa
         for (int j = 0 ; j < n; ++j) {
             if (i == j) continue;
 
-            if (sim[i][j].cc > threshold) {
+            if (sim.getCC(i, j) > threshold) {
                 used[i] = true;
                 used[j] = true;
                 break;
@@ -1198,21 +3239,18 @@ bool removeLowSimilarityKeys(TKeyPressCollectionT<T> & keyPresses, TSimilarityMa
         }
     }
 
+    std::vector<int> idx;
     for (int i = 0; i < n; ++i) {
-        auto cur = sim[i];
-        sim[i].clear();
-        for (int j = 0; j < n; ++j) {
-            if (used[j]) {
-                sim[i].push_back(cur[j]);
-            }
+        if (used[i]) {
+            idx.push_back(i);
         }
     }
 
     auto sim0 = sim;
-    sim.clear();
-    for (int i = 0; i < n; ++i) {
-        if (used[i]) {
-            sim.push_back(sim0[i]);
+    sim.reset(idx.size());
+    for (int i = 0; i < (int) idx.size(); ++i) {
+        for (int j = i; j < (int) idx.size(); ++j) {
+            sim.set(i, j, sim0.getCC(idx[i], idx[j]), sim0.getOffset(idx[i], idx[j]));
         }
     }
 
@@ -6,27 +6,41 @@
 #pragma once
 
 #include <map>
+#include <memory>
 #include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 #include <chrono>
+#include <cstdint>
+#include <type_traits>
 
 // types
 
 struct stMatch;
+struct stSimilarityMap;
 template<typename T, int N> struct stSampleMulti;
 template<typename T> struct stWaveformView;
+template<typename T, int N> struct stWaveformPlanar;
+template<typename T, int N> struct stWaveformPlanarView;
 template<typename T> struct stKeyPressData;
 template<typename T> struct stKeyPressDataNew;
 template<typename T> struct stKeyPressCollection;
 template<typename T> struct stKeyPressCollectionNew;
 template<typename T> struct stPlaybackData;
+template<typename T> struct stWaveformPyramid;
+struct stKeyTemplateBank;
+struct stAnalysisKey;
+struct stAnalysisCache;
 
 template<typename T> using TWaveformT              = std::vector<T>;
 template<typename T> using TWaveformViewT          = stWaveformView<T>;
+template<typename T, int N> using TWaveformPlanarT      = stWaveformPlanar<T, N>;
+template<typename T, int N> using TWaveformPlanarViewT  = stWaveformPlanarView<T, N>;
 template<typename T> using TKeyPressDataT          = stKeyPressData<T>;
 template<typename T> using TKeyPressCollectionT    = stKeyPressCollection<T>;
 template<typename T> using TPlaybackDataT          = stPlaybackData<T>;
+template<typename T> using TWaveformPyramidT       = stWaveformPyramid<T>;
 
 using TConfidence   = float;
 using TValueCC      = double;
@@ -44,9 +58,13 @@ using TTrainKeys        = std::vector<TKey>;
 
 using TLetter               = int32_t;
 using TMatch                = stMatch;
-using TSimilarityMap        = std::vector<std::vector<TMatch>>;
+using TSimilarityMap        = stSimilarityMap;
 using TClusters             = std::vector<TClusterId>;
 using TClusterToLetterMap   = std::map<TClusterId, TLetter>;
+using TKeyOffsetMap         = std::map<TKey, TOffset>;
+using TKeyTemplateBank      = stKeyTemplateBank;
+using TAnalysisKey          = stAnalysisKey;
+using TAnalysisCache        = stAnalysisCache;
 
 // - i16 samples
 
@@ -55,6 +73,7 @@ using TWaveformViewI16          = TWaveformViewT<TSampleI16>;
 using TKeyPressDataI16          = TKeyPressDataT<TSampleI16>;
 using TKeyPressCollectionI16    = TKeyPressCollectionT<TSampleI16>;
 using TPlaybackDataI16          = TPlaybackDataT<TSampleI16>;
+using TWaveformPyramidI16       = TWaveformPyramidT<TSampleI16>;
 
 using TWaveformMI16             = TWaveformT<TSampleMI16>;
 using TWaveformViewMI16         = TWaveformViewT<TSampleMI16>;
@@ -62,9 +81,14 @@ using TKeyPressDataMI16         = TKeyPressDataT<TSampleMI16>;
 using TKeyPressCollectionMI16   = TKeyPressCollectionT<TSampleMI16>;
 using TPlaybackDataMI16         = TPlaybackDataT<TSampleMI16>;
 
+using TWaveformPlanarMI16       = TWaveformPlanarT<TSampleI16, 4>;
+using TWaveformPlanarViewMI16   = TWaveformPlanarViewT<TSampleI16, 4>;
+
 // - float samples
 
 using TWaveformF    = TWaveformT<TSampleF>;
+using TWaveformViewF            = TWaveformViewT<TSampleF>;
+using TKeyPressCollectionF      = TKeyPressCollectionT<TSampleF>;
 using TKeyWaveformF = std::vector<TSampleF>;
 using TKeyHistoryF  = std::vector<TKeyWaveformF>;
 
@@ -74,12 +98,86 @@ enum EAudioFilter {
     SecondOrderButterworthHighPass,
 };
 
+enum ECCMethod {
+    Direct = 0,     // evaluate calcCC for every lag
+    FFT,            // all lags at once via FFT cross-correlation
+    CoarseToFine,   // decimated windows select candidate lags, refined at full resolution - approximate
+    GEMM,           // all pairs of a tile as blocked matrix products, one per lag
+};
+
 // structs
 struct stMatch {
     TValueCC    cc      = 0.0;
     TOffset     offset  = 0;
 };
 
+// the offsets are stored as int16_t, in memory and in the analysis cache - the similarity map functions reject
+// align windows above kMaxAlignWindow_samples
+static constexpr int32_t kMaxAlignWindow_samples = INT16_MAX;
+
+#pragma pack(push, 1)
+struct stPackedMatch {
+    float       cc      = 0.0f;
+    int16_t     offset  = 0;
+};
+#pragma pack(pop)
+
+// Symmetric similarity map of n key presses, stored as a packed upper triangle (including the diagonal)
+// in a single allocation : cc(j, i) = cc(i, j) and offset(j, i) = -offset(i, j)
+// Entries are read with map[i][j] or the get* accessors, and written with the set* accessors.
+struct stSimilarityMap {
+    struct Row {
+        const stSimilarityMap & map;
+        const int i;
+
+        const stMatch operator[](int j) const { return map.get(i, j); }
+    };
+
+    int size() const { return n; }
+    bool empty() const { return n == 0; }
+
+    void clear() {
+        n = 0;
+        data.clear();
+        data.shrink_to_fit();
+    }
+
+    // n x n map with all entries set to zero
+    void reset(int nNew) {
+        n = nNew;
+        data.assign(size_t(n)*(n + 1)/2, stPackedMatch());
+    }
+
+    TValueCC getCC(int i, int j) const { return data[index(i, j)].cc; }
+    TOffset getOffset(int i, int j) const { return i <= j ? data[index(i, j)].offset : -data[index(i, j)].offset; }
+
+    stMatch get(int i, int j) const { return { getCC(i, j), getOffset(i, j) }; }
+    Row operator[](int i) const { return { *this, i }; }
+
+    void setCC(int i, int j, TValueCC cc) { data[index(i, j)].cc = cc; }
+    void setOffset(int i, int j, TOffset offset) { data[index(i, j)].offset = i <= j ? offset : -offset; }
+
+    void set(int i, int j, TValueCC cc, TOffset offset) {
+        setCC(i, j, cc);
+        setOffset(i, j, offset);
+    }
+
+    size_t getMemorySize_bytes() const { return data.size()*sizeof(stPackedMatch); }
+
+    // the packed upper triangle, for serialization
+    const stPackedMatch * getPacked() const { return data.data(); }
+    stPackedMatch * getPacked() { return data.data(); }
+
+private:
+    size_t index(int i, int j) const {
+        if (i > j) std::swap(i, j);
+        return size_t(i)*(2*n - i + 1)/2 + (j - i);
+    }
+
+    int n = 0;
+    std::vector<stPackedMatch> data;
+};
+
 template<typename T, int SIZE>
 struct stSampleMulti : public std::array<T, SIZE> {
     static const int N = SIZE;
@@ -92,6 +190,27 @@ struct stWaveformView {
     int64_t n         = 0;
 };
 
+// N bands of a waveform, each band stored in its own contiguous plane of n samples
+template<typename T, int N>
+struct stWaveformPlanar {
+    static const int kBands = N;
+
+    void resize(int64_t n) { this->n = n; data.resize(N*n); }
+    int64_t size() const { return n; }
+
+    T * getPlane(int j) { return data.data() + j*n; }
+    const T * getPlane(int j) const { return data.data() + j*n; }
+
+    int64_t n = 0;
+    std::vector<T> data;
+};
+
+template<typename T, int N>
+struct stWaveformPlanarView {
+    const T * planes[N] = {};
+    int64_t n           = 0;
+};
+
 template<typename T>
 struct stKeyPressData {
     TWaveformViewT<T>   waveform;
@@ -117,6 +236,60 @@ struct stPlaybackData {
     TWaveformViewT<T> waveform;
 };
 
+// Min / max of a waveform over bins of kBinSize << l samples for each level l. Only complete bins are stored,
+// so appending samples only touches the tail of each level.
+template<typename T>
+struct stWaveformPyramid {
+    static const int64_t kBinSize = 16;
+
+    int64_t n = 0; // number of samples in the pyramid
+
+    std::vector<std::vector<T>> levelMin;
+    std::vector<std::vector<T>> levelMax;
+};
+
+// The averaged waveforms of all trained keys, quantized to i16 and stored as the rows of one matrix.
+// Only the middle n0 samples of each template are kept - the part that findBestCC compares.
+struct stKeyTemplateBank {
+    int64_t nTemplates = 0;
+    int64_t n0         = 0;
+
+    std::vector<TKey> keys;
+    std::vector<TSampleI16> values; // rows padded with zeros to a multiple of 4
+    std::vector<int64_t> sum0;
+    std::vector<int64_t> sum02;
+};
+
+// Everything an analysis result depends on - a cached result is reused only if all fields match
+struct stAnalysisKey {
+    uint64_t recordingHash = 0; // calcRecordingHash() or calcHash() of the samples of the recording
+
+    int32_t filterId = 0;
+    int32_t freqCutoff_Hz = 0; // as requested - 0 if the cutoff is searched for
+
+    int32_t keyPressWidth_samples = 0;
+    int32_t alignWindow_samples = 0;
+    int32_t offsetFromPeak_samples = 0;
+    int32_t ccMethod = 0;
+
+    // calcHashOf() of the remaining inputs of the tool, e.g. the detection parameters
+    uint64_t extraHash = 0;
+
+    bool operator==(const stAnalysisKey & other) const {
+        return recordingHash == other.recordingHash && filterId == other.filterId && freqCutoff_Hz == other.freqCutoff_Hz &&
+            keyPressWidth_samples == other.keyPressWidth_samples && alignWindow_samples == other.alignWindow_samples &&
+            offsetFromPeak_samples == other.offsetFromPeak_samples && ccMethod == other.ccMethod && extraHash == other.extraHash;
+    }
+};
+
+// The results of the analysis stages that precede clustering
+struct stAnalysisCache {
+    int32_t freqCutoff_Hz = 0; // the cutoff that was used
+
+    std::vector<TKeyPressPosition> positions;
+    TSimilarityMap similarityMap;
+};
+
 struct TFilterCoefficients {
     float a0 = 0.0f;
     float a1 = 0.0f;
@@ -149,6 +322,22 @@ stWaveformView<T> getView(const TWaveformT<T> & waveform, int64_t idx, int64_t l
     return { waveform.data() + idx, len };
 }
 
+template<typename T, int N>
+stWaveformPlanarView<T, N> getView(const TWaveformPlanarT<T, N> & waveform, int64_t idx, int64_t len) {
+    stWaveformPlanarView<T, N> res;
+    for (int j = 0; j < N; ++j) {
+        res.planes[j] = waveform.getPlane(j) + idx;
+    }
+    res.n = len;
+
+    return res;
+}
+
+template<typename T, int N>
+stWaveformPlanarView<T, N> getView(const TWaveformPlanarT<T, N> & waveform, int64_t idx) {
+    return getView(waveform, idx, waveform.size() - idx);
+}
+
 std::map<std::string, std::string> parseCmdArguments(int argc, char ** argv);
 
 template <typename T>
@@ -159,6 +348,10 @@ float toSeconds(T t0, T t1) {
 template <typename TSampleSrc, typename TSampleDst>
 bool convert(const TWaveformT<TSampleSrc> & src, TWaveformT<TSampleDst> & dst);
 
+// interleave / deinterleave the bands of a multi-band waveform
+bool convert(const TWaveformPlanarMI16 & src, TWaveformMI16 & dst);
+bool convert(const TWaveformMI16 & src, TWaveformPlanarMI16 & dst);
+
 template <typename TSample>
 double calcAbsMax(const TWaveformT<TSample> & waveform);
 
@@ -174,6 +367,37 @@ bool readFromFile(const std::string & fname, TWaveformT<TSample> & res);
 template <typename TSampleInput, typename TSample>
 bool readFromFile(const std::string & fname, TWaveformT<TSample> & res, TTrainKeys & trainKeys, int32_t & bufferSize_frames);
 
+// A raw float32 recording mapped into memory instead of read into a vector. Opening is immediate regardless of
+// the file size, the samples are paged in on first access and the page cache is shared between all processes
+// that map the same recording. Falls back to reading the file where mmap is not available. Chunked recordings
+// (see recording.h) are decoded into memory instead.
+class MappedWaveform {
+    public:
+        MappedWaveform();
+        ~MappedWaveform();
+
+        bool open(const std::string & fname);
+        void close();
+
+        int64_t size() const;
+
+        // valid until close() - the view of a closed or empty recording has no samples
+        TWaveformViewF getView() const;
+
+        // abs max of all samples, computed on first use
+        double getAbsMax();
+
+        // the samples [idx, idx + len) converted to i16 exactly as convert() converts the whole recording
+        bool convert(int64_t idx, int64_t len, TSampleI16 * res);
+        bool convert(TWaveformI16 & res);
+
+    private:
+        struct Data;
+        std::unique_ptr<Data> data_;
+        Data & getData() { return *data_; }
+        const Data & getData() const { return *data_; }
+};
+
 //
 // filters
 //
@@ -186,6 +410,45 @@ TSampleF filterFirstOrderHighPass(TFilterCoefficients & coefficients, TSampleF s
 
 TSampleF filterSecondOrderButterworthHighPass(TFilterCoefficients & coefficients, TSampleF sample);
 
+// Filter the waveform with one high-pass filter of the given type per cutoff frequency and convert each output to
+// i16 - the same result as a filter() + convert() per cutoff. The filters run side by side, kFilterBankLanes at a
+// time, in two passes over the input (abs max, then quantize) without any float intermediate waveforms.
+bool filterBank(
+    const TWaveformViewF & waveform, EAudioFilter filterId, const std::vector<float> & freqCutoffs_Hz, int64_t sampleRate,
+    std::vector<TWaveformI16> & res);
+
+inline bool filterBank(
+    const TWaveformF & waveform, EAudioFilter filterId, const std::vector<float> & freqCutoffs_Hz, int64_t sampleRate,
+    std::vector<TWaveformI16> & res) {
+    return filterBank(getView(waveform, 0), filterId, freqCutoffs_Hz, sampleRate, res);
+}
+
+// filter() + convert() block by block, without modifying the input or a float copy of it. With amax > 0 the
+// output is scaled as if amax was the abs max of the filtered waveform - a single pass, with the samples beyond
+// it clipped. Otherwise a first pass finds the actual abs max and the result matches filter() + convert().
+bool filterAndConvert(
+    const TWaveformViewF & waveform, EAudioFilter filterId, float freqCutoff_Hz, int64_t sampleRate,
+    TWaveformI16 & res, double amax = 0.0);
+
+inline bool filterAndConvert(
+    const TWaveformF & waveform, EAudioFilter filterId, float freqCutoff_Hz, int64_t sampleRate,
+    TWaveformI16 & res, double amax = 0.0) {
+    return filterAndConvert(getView(waveform, 0), filterId, freqCutoff_Hz, sampleRate, res, amax);
+}
+
+//
+// sliding window max / min
+//
+
+// res[i] = max(values[i], ..., values[i + nWindow - 1]) for i in [0, n - nWindow]
+// van Herk / Gil-Werman : block prefix and suffix maxima, O(1) per sample for any window size and no branches
+// on the values. work must have room for n values. Nothing is written if n < nWindow.
+template<typename T>
+void calcSlidingMax(const T * values, int64_t n, int64_t nWindow, T * work, T * res);
+
+template<typename T>
+void calcSlidingMin(const T * values, int64_t n, int64_t nWindow, T * work, T * res);
+
 //
 // calcSum
 //
@@ -195,6 +458,9 @@ std::tuple<double, double> calcSum(const TKeyWaveformF & waveform, int is0, int
 template<typename T>
 std::tuple<int64_t, int64_t> calcSum(const TWaveformViewT<T> & waveform);
 
+// sums over all bands - same result as calcSum() of the interleaved TWaveformViewMI16
+std::tuple<int64_t, int64_t> calcSum(const TWaveformPlanarViewMI16 & waveform);
+
 //
 // calcCC
 //
@@ -211,6 +477,12 @@ TValueCC calcCC(
     const TWaveformViewT<T> & waveform1,
     int64_t sum0, int64_t sum02);
 
+// CC over all bands - same result as calcCC() of the interleaved TWaveformViewMI16
+TValueCC calcCC(
+    const TWaveformPlanarViewMI16 & waveform0,
+    const TWaveformPlanarViewMI16 & waveform1,
+    int64_t sum0, int64_t sum02);
+
 //
 // findBestCC
 //
@@ -227,6 +499,33 @@ std::tuple<TValueCC, TOffset> findBestCC(
     const TWaveformViewT<T> & waveform1,
     int64_t alignWindow);
 
+// same result as findBestCC, but all 2*alignWindow + 1 lags are computed with a single FFT cross-correlation
+template<typename T>
+std::tuple<TValueCC, TOffset> findBestCCFFT(
+    const TWaveformViewT<T> & waveform0,
+    const TWaveformViewT<T> & waveform1,
+    int64_t alignWindow);
+
+//
+// key templates
+//
+
+bool initKeyTemplateBank(
+    const std::map<TKey, TKeyWaveformF> & templates,
+    int n0,
+    TKeyTemplateBank & res);
+
+// best CC of every template with waveform[is0 + o, is1 + o) over all |o| <= alignWindow
+// Same as calling findBestCC for each template, up to the i16 quantization of the waveforms,
+// but all templates and lags are evaluated in a single pass of the SIMD dot-product kernels.
+bool calcKeyConfidence(
+    const TKeyTemplateBank & bank,
+    const TKeyWaveformF & waveform,
+    int is0, int is1,
+    int alignWindow,
+    TKeyConfidenceMap & res,
+    TKeyOffsetMap * bestOffsets = nullptr);
+
 //
 // calculateSimilarityMap
 //
@@ -237,7 +536,59 @@ bool calculateSimilartyMap(
         const int32_t alignWindow_samples,
         const int32_t offsetFromPeak_samples,
         TKeyPressCollectionT<T> & keyPresses,
-        TSimilarityMap & res);
+        TSimilarityMap & res,
+        ECCMethod method = ECCMethod::Direct);
+
+// fraction of up to nPairsMax key press pairs for which ECCMethod::CoarseToFine finds a different offset than
+// the exhaustive search
+template<typename T>
+double calcCoarseToFineMismatchRate(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        const TKeyPressCollectionT<T> & keyPresses,
+        int64_t nPairsMax);
+
+class SimilarityMapCache;
+
+// Same result as calculateSimilartyMap, but res must be the map of the previous call with the same cache.
+// Only the rows and columns of the key presses whose window changed since then are recomputed.
+// If the number of presses, the window sizes or the method changed, the full map is calculated.
+template<typename T>
+bool updateSimilarityMap(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        TKeyPressCollectionT<T> & keyPresses,
+        SimilarityMapCache & cache,
+        TSimilarityMap & res,
+        ECCMethod method = ECCMethod::Direct);
+
+// Key press windows and method of the last similarity map computed by updateSimilarityMap
+class SimilarityMapCache {
+    public:
+        SimilarityMapCache();
+        ~SimilarityMapCache();
+
+        void clear();
+
+        // number of key presses whose rows were recomputed by the last update
+        int64_t getNUpdated() const;
+
+    private:
+        template<typename T>
+        friend bool updateSimilarityMap(
+                const int32_t keyPressWidth_samples,
+                const int32_t alignWindow_samples,
+                const int32_t offsetFromPeak_samples,
+                TKeyPressCollectionT<T> & keyPresses,
+                SimilarityMapCache & cache,
+                TSimilarityMap & res,
+                ECCMethod method);
+
+        struct Data;
+        std::unique_ptr<Data> data_;
+};
 
 //
 // findKeyPresses
@@ -254,6 +605,66 @@ bool findKeyPresses(
         int historySizeReset,
         bool removeLowPower);
 
+// Same result as above, but the absolute values of the waveform are not copied and the background threshold
+// and window max traces are written only if requested, so the memory used does not depend on the waveform length
+template<typename T>
+bool findKeyPresses(
+        const TWaveformViewT<T> & waveform,
+        TKeyPressCollectionT<T> & res,
+        double thresholdBackground,
+        int historySize,
+        int historySizeReset,
+        bool removeLowPower,
+        TWaveformT<T> * waveformThreshold = nullptr,
+        TWaveformT<T> * waveformMax = nullptr);
+
+// Streaming version of findKeyPresses - the waveform is passed in consecutive blocks as it is recorded.
+// After n samples have been processed, getKeyPresses() returns the same key presses as findKeyPresses()
+// on these n samples, so the total cost of a recording is O(n) regardless of how often the result is queried.
+// A key press at position pos is reported once pos + 2*historySize samples have been processed.
+template<typename T>
+class KeyPressDetector {
+    public:
+        struct Parameters {
+            double thresholdBackground = 8.0;
+            int historySize = 512;
+            int historySizeReset = 2*1024;
+            bool removeLowPower = true;
+        };
+
+        explicit KeyPressDetector(Parameters && parameters);
+        ~KeyPressDetector();
+
+        // forget all processed samples
+        void reset();
+
+        // Continue a waveform from sample offset, without producing output for its first nWarmUp samples.
+        // For integer samples the state depends only on the last getNWarmUp() samples, so with that many
+        // warm-up samples the output is identical to that of a detector that processed the waveform from 0.
+        void reset(int64_t offset, int64_t nWarmUp);
+        int64_t getNWarmUp() const;
+
+        // append the key presses of a detector that continued the waveform from getNProcessed()
+        // used to combine consecutive chunks of a waveform that were processed in parallel
+        bool append(const KeyPressDetector & other);
+
+        // process the next n samples of the waveform
+        // optionally store the traces of the background threshold and the window max at their absolute positions
+        // the traces must already have room for all processed samples
+        bool process(const T * samples, int64_t n, TWaveformT<T> * waveformThreshold = nullptr, TWaveformT<T> * waveformMax = nullptr);
+
+        int64_t getNProcessed() const;
+
+        // the key presses reference the given waveform view, which should contain the processed samples
+        bool getKeyPresses(TKeyPressCollectionT<T> & res, const TWaveformViewT<T> & waveform = {}) const;
+
+    private:
+        struct Data;
+        std::unique_ptr<Data> data_;
+        Data & getData() { return *data_; }
+        const Data & getData() const { return *data_; }
+};
+
 template<typename T>
 bool saveKeyPresses(const std::string & fname, const TKeyPressCollectionT<T> & keyPresses);
 
@@ -263,6 +674,52 @@ bool loadKeyPresses(const std::string & fname, const TWaveformViewT<T> & wavefor
 template<typename T>
 bool dumpKeyPresses(const std::string & fname, const TKeyPressCollectionT<T> & data);
 
+//
+// analysis cache
+//
+
+// XXH64 - 8 bytes per step in 4 lanes, pass the result as seed to hash several buffers
+uint64_t calcHash(const void * data, size_t size, uint64_t seed = 0);
+
+// bytewise hash of a single value - a separate name, so that calls with a pointer and a size never resolve here
+template<typename T>
+uint64_t calcHashOf(const T & value, uint64_t seed = 0) {
+    static_assert(std::is_trivially_copyable<T>::value && std::is_pointer<T>::value == false, "Type cannot be hashed bytewise");
+    return calcHash(&value, sizeof(value), seed);
+}
+
+// TAnalysisKey::recordingHash of the recording in fname, whose samples are passed in. Container recordings with chunk
+// statistics are identified by their header, chunk statistics and file size without touching the samples
+uint64_t calcRecordingHash(const std::string & fname, const TWaveformViewF & samples);
+
+// TAnalysisKey::extraHash of the key press detection followed by the removal of low-similarity key presses
+uint64_t calcDetectionHash(double thresholdBackground, int historySize, int historySizeReset, bool removeLowPower, double thresholdLowSimilarity);
+
+// the cache file of the given analysis of a recording : <recording>.<key hash>.cache
+std::string getAnalysisCachePath(const std::string & fnameRecording, const TAnalysisKey & key);
+
+// the file is written under a temporary name and renamed, so concurrent runs never see partial entries
+bool saveAnalysisCache(const std::string & fname, const TAnalysisKey & key, const TAnalysisCache & cache);
+
+// false if the file does not exist, is damaged or was written for a different key
+bool loadAnalysisCache(const std::string & fname, const TAnalysisKey & key, TAnalysisCache & cache);
+
+template<typename T>
+void getKeyPositions(const TKeyPressCollectionT<T> & keyPresses, std::vector<TKeyPressPosition> & res) {
+    res.resize(keyPresses.size());
+    for (int i = 0; i < (int) keyPresses.size(); ++i) res[i] = keyPresses[i].pos;
+}
+
+template<typename T>
+void setKeyPositions(const std::vector<TKeyPressPosition> & positions, const TWaveformViewT<T> & waveform, TKeyPressCollectionT<T> & res) {
+    res.clear();
+    res.resize(positions.size());
+    for (int i = 0; i < (int) positions.size(); ++i) {
+        res[i].waveform = waveform;
+        res[i].pos = positions[i];
+    }
+}
+
 template<typename T>
 void cbPlayback(void * userData, uint8_t * stream, int len);
 
@@ -274,6 +731,19 @@ bool generateLowResWaveform(const TWaveformT<T> & waveform, TWaveformT<T> & wave
     return generateLowResWaveform(getView(waveform, 0), waveformLowRes, nWindow);
 }
 
+// Bring the pyramid up to date with the waveform : the samples [pyramid.n, waveform.n) are appended and a
+// shorter waveform truncates it. If any of the first pyramid.n samples change, start over with an empty pyramid.
+template<typename T>
+bool updateWaveformPyramid(const TWaveformViewT<T> & waveform, TWaveformPyramidT<T> & pyramid);
+
+// Min / max of the samples [offset, offset + nview) split in nBins equal bins, O(nBins) regardless of nview.
+// The waveform must be the one the pyramid was built from - it is used for the partial bins at the edges.
+template<typename T>
+bool getWaveformMinMax(
+    const TWaveformViewT<T> & waveform, const TWaveformPyramidT<T> & pyramid,
+    int64_t offset, int64_t nview, int nBins,
+    TWaveformT<T> & resMin, TWaveformT<T> & resMax);
+
 template<typename T>
 bool adjustKeyPresses(TKeyPressCollectionT<T> & keyPresses, TSimilarityMap & sim);
 
@@ -0,0 +1,108 @@
+/*! \file compress-kbd.cpp
+ *  \brief Convert recordings to losslessly compressed chunked recordings
+ *  \author Georgi Gerganov
+ */
+
+#include "constants.h"
+#include "common.h"
+#include "recording.h"
+
+#include <cmath>
+#include <chrono>
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s input.kbd output.kbd [-q] [-r]\n", argv[0]);
+    printf("    -q - quantize recordings that are not 16-bit exact, normalized to full scale (lossy)\n");
+    printf("    -r - write a legacy raw float32 recording instead\n");
+    printf("\n");
+
+    if (argc < 3) {
+        return -127;
+    }
+
+    auto argm = parseCmdArguments(argc, argv);
+    bool allowQuantize = argm.count("q") > 0;
+    bool writeRaw = argm.count("r") > 0;
+
+    const auto tStart = std::chrono::high_resolution_clock::now();
+
+    RecordingReader reader;
+    TWaveformF waveform;
+    printf("[+] Reading '%s'\n", argv[1]);
+    if (reader.open(argv[1]) == false || reader.read(waveform) == false) {
+        fprintf(stderr, "Failed to read '%s'\n", argv[1]);
+        return -1;
+    }
+
+    const auto info = reader.getInfo();
+    printf("[+] %g seconds at %d Hz\n", float(info.nSamples)/info.sampleRate, (int) info.sampleRate);
+
+    if (writeRaw) {
+        if (info.sampleRate != kSampleRate) {
+            fprintf(stderr, "Warning: raw recordings are assumed to be at %d Hz\n", (int) kSampleRate);
+        }
+        if (saveToFile(argv[2], waveform) == false) {
+            fprintf(stderr, "Failed to write '%s'\n", argv[2]);
+            return -2;
+        }
+        return 0;
+    }
+
+    // the i16 payload stores round(32768*x) - lossless only if all samples are already on that grid
+    bool isExact = true;
+    for (const auto & s : waveform) {
+        const float v = 32768.0f*s;
+        if (v != std::round(v) || v < -32768.0f || v > 32767.0f) {
+            isExact = false;
+            break;
+        }
+    }
+
+    if (isExact == false) {
+        if (allowQuantize == false) {
+            fprintf(stderr, "'%s' is not 16-bit exact - use -q to quantize it\n", argv[1]);
+            return -3;
+        }
+
+        const double amax = reader.getAbsMax();
+        const float scale = amax > 0.0 ? (32767.0/32768.0)/amax : 1.0f;
+        for (auto & s : waveform) s *= scale;
+
+        printf("[!] Quantizing to 16 bits\n");
+    }
+
+    RecordingWriter writer;
+    {
+        RecordingWriter::Parameters parameters;
+        parameters.sampleType = RecordingInfo::I16;
+        parameters.sampleRate = info.sampleRate;
+        parameters.compress = true;
+
+        printf("[+] Writing '%s'\n", argv[2]);
+        if (writer.open(argv[2], std::move(parameters)) == false ||
+            writer.write(waveform.data(), waveform.size()) == false ||
+            writer.close() == false) {
+            fprintf(stderr, "Failed to write '%s'\n", argv[2]);
+            return -2;
+        }
+    }
+
+    // decode the result once, so that a bad archive is noticed now rather than when it is needed
+    if (isExact) {
+        RecordingReader check;
+        TWaveformF decoded;
+        if (check.open(argv[2]) == false || check.read(decoded) == false || decoded != waveform) {
+            fprintf(stderr, "Verification of '%s' failed\n", argv[2]);
+            return -4;
+        }
+    }
+
+    const auto tEnd = std::chrono::high_resolution_clock::now();
+
+    printf("[+] Compressed %g MB of float32 samples to %g MB (%.2fx) in %4.3f seconds\n",
+           float(info.nSamples*sizeof(TSampleF))/1024.0f/1024.0f,
+           float(writer.getTotalSize_bytes())/1024.0f/1024.0f,
+           double(info.nSamples*sizeof(TSampleF))/writer.getTotalSize_bytes(), toSeconds(tStart, tEnd));
+
+    return 0;
+}
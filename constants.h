@@ -54,6 +54,9 @@ static constexpr int kFindKeysHistorySize = 512;
 static constexpr int kFindKeysHistorySizeReset = 2048;
 static constexpr bool kFindKeysRemoveLowPower = true;
 
+// key presses with low similarity to all others are dropped before clustering
+static constexpr float kRemoveLowSimilarityThreshold = 0.3f;
+
 static std::map<char, std::vector<char>> kNearbyKeys = {
     { 'a', { 'a', 'q', 'w', 's', 'z', 'x',                               } },
     { 'b', { 'b', 'f', 'g', 'h', 'v', 'n',                               } },
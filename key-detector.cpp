@@ -36,29 +36,27 @@ int main(int argc, char ** argv) {
     size_t totalSize_bytes = 0;
 
     TWaveformF waveformF;
-    TWaveformI16 waveformI16;
-    TKeyPressCollectionT<TSampleI16> keyPresses;
+    TWaveformF waveformFFiltered;
+    TKeyPressCollectionF keyPresses;
+
+    // apply default filtering, because keypress detection without it is impossible
+    // only the new samples are filtered and passed to the detector, so the cost does not grow with the recording
+    auto filterCoefficients = calculateCoefficientsFirstOrderHighPass(kFreqCutoff_Hz, kSampleRate);
+    KeyPressDetector<TSampleF> keyPressDetector({ 8.0, 512, 2*1024, true });
 
     AudioLogger audioLogger;
 
     AudioLogger::Callback cbAudio = [&](const auto & frames) {
+        waveformFFiltered.clear();
         for (auto & frame : frames) {
             waveformF.insert(waveformF.end(), frame.begin(), frame.end());
-        }
-
-        {
-            // apply default filtering, because keypress detection without it is impossible
-            auto waveformFFiltered = waveformF;
-            ::filter(waveformFFiltered, EAudioFilter::FirstOrderHighPass, kFreqCutoff_Hz, kSampleRate);
-
-            if (convert(waveformFFiltered, waveformI16) == false) {
-                printf("Conversion failed\n");
+            for (auto s : frame) {
+                waveformFFiltered.push_back(::filterFirstOrderHighPass(filterCoefficients, s));
             }
         }
 
-        TWaveformI16 waveformMax;
-        TWaveformI16 waveformThreshold;
-        if (findKeyPresses(getView(waveformI16, 0), keyPresses, waveformThreshold, waveformMax, 8.0, 512, 2*1024, true) == false) {
+        if (keyPressDetector.process(waveformFFiltered.data(), waveformFFiltered.size()) == false ||
+            keyPressDetector.getKeyPresses(keyPresses) == false) {
             printf("Failed to detect keypresses\n");
         }
 
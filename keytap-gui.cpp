@@ -35,6 +35,9 @@
 
 // constants
 
+// half-width of the window around a detected key press that is compared with the key templates
+static constexpr int kCmpWindow_samples = kSamplesPerWaveformTrain/4;
+
 static const std::vector<float> kRowOffset = { 0.0f, 1.5f, 1.8f, 2.1f, 5.5f };
 static const std::vector<std::vector<int>> kKeyboard = {
     { '`', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', 127},
@@ -152,6 +155,7 @@ int main(int argc, char ** argv) {
     TKeyConfidenceMap keyConfidenceDisplay;
     std::map<TKey, TKeyHistoryF> keySoundHistoryAmpl;
     std::map<TKey, TKeyWaveformF> keySoundAverageAmpl;
+    TKeyTemplateBank keyTemplateBank;
 
     int ntest = 0;
 
@@ -231,25 +235,21 @@ int main(int argc, char ** argv) {
 
                 for (int ipos = 0; ipos < (int) positionsToPredict.size() ; ++ipos) {
                     auto curPos = positionsToPredict[ipos];
-                    int scmp0 = curPos - 0.25*kSamplesPerWaveformTrain;
-                    int scmp1 = curPos + 0.25*kSamplesPerWaveformTrain;
+                    int scmp0 = curPos - kCmpWindow_samples;
+                    int scmp1 = curPos + kCmpWindow_samples;
 
                     char res = -1;
                     TValueCC maxcc = -1.0f;
                     TOffset offs = 0;
                     TKeyConfidenceMap keyConfidenceTmp;
-                    for (const auto & ka : keySoundAverageAmpl) {
-                        //auto [bestcc, bestoffset] = findBestCC(keySoundAverageAmpl[ka.first], ampl, scmp0, scmp1, alignWindow);
-                        auto ret = findBestCC(keySoundAverageAmpl[ka.first], ampl, scmp0, scmp1, alignWindow);
-                        auto bestcc     = std::get<0>(ret);
-                        auto bestoffset = std::get<1>(ret);
-
-                        if (bestcc > maxcc) {
-                            res = ka.first;
-                            maxcc = bestcc;
-                            offs = bestoffset;
+                    TKeyOffsetMap keyOffsetTmp;
+                    calcKeyConfidence(keyTemplateBank, ampl, scmp0, scmp1, alignWindow, keyConfidenceTmp, &keyOffsetTmp);
+                    for (const auto & kc : keyConfidenceTmp) {
+                        if (kc.second > maxcc) {
+                            res = kc.first;
+                            maxcc = kc.second;
+                            offs = keyOffsetTmp[kc.first];
                         }
-                        keyConfidenceTmp[ka.first] = bestcc;
                     }
 
                     if (maxcc > thresholdCC) {
@@ -739,6 +739,10 @@ int main(int argc, char ** argv) {
                 for (auto & v : kh.second) v = (v/curAmplMax)*amplMax;
             }
 
+            if (initKeyTemplateBank(keySoundAverageAmpl, 2*kCmpWindow_samples, keyTemplateBank) == false) {
+                fprintf(stderr, "Failed to initialize the key templates\n");
+            }
+
             audioLogger.resume();
 
             printf("[+] Ready to predict. Keep pressing keys and the program will guess which key was pressed\n");
@@ -100,6 +100,7 @@ int main(int argc, char ** argv) {
     TKey keyPressed = -1;
     std::map<TKey, TKeyHistoryF> keySoundHistoryAmpl;
     std::map<TKey, TKeyWaveformF> keySoundAverageAmpl;
+    TKeyTemplateBank keyTemplateBank;
 
     int ntest = 0;
 
@@ -174,20 +175,13 @@ int main(int argc, char ** argv) {
 
                     char res = -1;
                     TValueCC maxcc = -1.0f;
-                    //TOffset offs = 0;
                     TKeyConfidenceMap keyConfidenceTmp;
-                    for (const auto & ka : keySoundAverageAmpl) {
-                        //auto [bestcc, bestoffset] = findBestCC(keySoundAverageAmpl[ka.first], ampl, scmp0, scmp1, alignWindow);
-                        auto ret = findBestCC(keySoundAverageAmpl[ka.first], ampl, scmp0, scmp1, alignWindow);
-                        auto bestcc     = std::get<0>(ret);
-                        //auto bestoffset = std::get<1>(ret);
-
-                        if (bestcc > maxcc) {
-                            res = ka.first;
-                            maxcc = bestcc;
-                            //offs = bestoffset;
+                    calcKeyConfidence(keyTemplateBank, ampl, scmp0, scmp1, alignWindow, keyConfidenceTmp);
+                    for (const auto & kc : keyConfidenceTmp) {
+                        if (kc.second > maxcc) {
+                            res = kc.first;
+                            maxcc = kc.second;
                         }
-                        keyConfidenceTmp[ka.first] = bestcc;
                     }
 
                     if (maxcc > thresholdCC) {
@@ -616,6 +610,10 @@ int main(int argc, char ** argv) {
                 for (auto & v : kh.second) v = (v/curAmplMax)*amplMax;
             }
 
+            if (initKeyTemplateBank(keySoundAverageAmpl, 2*kSamplesPerFrame, keyTemplateBank) == false) {
+                fprintf(stderr, "Failed to initialize the key templates\n");
+            }
+
             audioLogger.resume();
 
             printf("[+] Ready to predict. Keep pressing keys and the program will guess which key was pressed\n");
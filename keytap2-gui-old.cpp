@@ -103,7 +103,7 @@ bool clusterDBSCAN(const TSimilarityMap & sim, TValueCC epsCC, int minPts, TKeyP
         if (cid != -1) continue;
         std::vector<int> nbi;
         for (int j = 0; j < n; ++j) {
-            auto & cc = sim[i][j].cc;
+            const auto cc = sim.getCC(i, j);
 
             if (cc > epsCC) nbi.push_back(j);
         }
@@ -123,7 +123,7 @@ bool clusterDBSCAN(const TSimilarityMap & sim, TValueCC epsCC, int minPts, TKeyP
 
             std::vector<int> nbq;
             for (int j = 0; j < n; ++j) {
-                auto & cc = sim[nbi[q]][j].cc;
+                const auto cc = sim.getCC(nbi[q], j);
 
                 if (cc > epsCC) nbq.push_back(j);
             }
@@ -201,7 +201,7 @@ bool clusterG(const TSimilarityMap & sim, TKeyPressCollection & keyPresses, TVal
     std::vector<Pair> ccpairs;
     for (int i = 0; i < n - 1; ++i) {
         for (int j = i + 1; j < n; ++j) {
-            ccpairs.emplace_back(Pair{i, j, sim[i][j].cc});
+            ccpairs.emplace_back(Pair{i, j, sim.getCC(i, j)});
         }
     }
 
@@ -244,15 +244,15 @@ bool clusterG(const TSimilarityMap & sim, TKeyPressCollection & keyPresses, TVal
                 if (q == k) continue;
                 auto & cq = keyPresses[q].cid;
                 if ((ck == ci || ck == cj) && (cq == ci || cq == cj)) {
-                    sumcc += sim[k][q].cc;
+                    sumcc += sim.getCC(k, q);
                     ++nsum;
                 }
                 if (ck == ci && cq == ci) {
-                    sumcci += sim[k][q].cc;
+                    sumcci += sim.getCC(k, q);
                     ++nsumi;
                 }
                 if (ck == cj && cq == cj) {
-                    sumccj += sim[k][q].cc;
+                    sumccj += sim.getCC(k, q);
                     ++nsumj;
                 }
             }
@@ -317,7 +317,7 @@ bool adjustKeyPresses(const TParameters & , TKeyPressCollection & keyPresses, TS
     std::vector<Pair> ccpairs;
     for (int i = 0; i < n - 1; ++i) {
         for (int j = i + 1; j < n; ++j) {
-            ccpairs.emplace_back(Pair{i, j, sim[i][j].cc});
+            ccpairs.emplace_back(Pair{i, j, sim.getCC(i, j)});
         }
     }
 
@@ -334,9 +334,9 @@ bool adjustKeyPresses(const TParameters & , TKeyPressCollection & keyPresses, TS
         if (used[k0] && used[k1]) continue;
 
         if (used[k1] == false) {
-            keyPresses[k1].pos += sim[k0][k1].offset;
+            keyPresses[k1].pos += sim.getOffset(k0, k1);
         } else {
-            keyPresses[k0].pos -= sim[k0][k1].offset;
+            keyPresses[k0].pos -= sim.getOffset(k0, k1);
         }
 
         if (used[k0] == false) { used[k0] = true; ++nused; }
@@ -681,10 +681,10 @@ bool renderSimilarity(TParameters & params, TKeyPressCollection & keyPresses, TS
             ImGui::InvisibleButton("SimilarityMapIB", { n*bsize, n*bsize });
             for (int i = 0; i < n; ++i) {
                 for (int j = 0; j < n; ++j) {
-                    float col = similarityMap[i][j].cc;
+                    float col = similarityMap.getCC(i, j);
                     ImVec2 p0 = {savePos.x + j*bsize, savePos.y + i*bsize};
                     ImVec2 p1 = {savePos.x + (j + 1)*bsize - 1.0f, savePos.y + (i + 1)*bsize - 1.0f};
-                    if (similarityMap[i][j].cc > threshold) {
+                    if (similarityMap.getCC(i, j) > threshold) {
                         drawList->AddRectFilled(p0, p1, ImGui::ColorConvertFloat4ToU32({1.0f, 1.0f, 1.0f, col}));
                     }
                     if (ImGui::IsMouseHoveringRect(p0, {p1.x + 1.0f, p1.y + 1.0f})) {
@@ -692,13 +692,13 @@ bool renderSimilarity(TParameters & params, TKeyPressCollection & keyPresses, TS
                         if (ImGui::IsMouseDown(0) == false) {
                             ImGui::BeginTooltip();
                             ImGui::Text("[%3d, %3d]\n", keyPresses[i].cid, keyPresses[j].cid);
-                            ImGui::Text("[%3d, %3d] = %5.4g\n", i, j, similarityMap[i][j].cc);
+                            ImGui::Text("[%3d, %3d] = %5.4g\n", i, j, similarityMap.getCC(i, j));
                             for (int k = 0; k < n; ++k) {
-                                if (similarityMap[i][k].cc > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", i, k, (int) similarityMap[i][k].offset);
+                                if (similarityMap.getCC(i, k) > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", i, k, (int) similarityMap.getOffset(i, k));
                             }
                             ImGui::Separator();
                             for (int k = 0; k < n; ++k) {
-                                if (similarityMap[k][i].cc > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", k, i, (int) similarityMap[k][i].offset);
+                                if (similarityMap.getCC(k, i) > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", k, i, (int) similarityMap.getOffset(k, i));
                             }
                             ImGui::EndTooltip();
                         }
@@ -805,7 +805,7 @@ bool renderClusters(TParameters & params, const Cipher::TFreqMap & freqMap, TKey
                 for (int i = 0; i < (int)(keyPresses.size()); ++i) {
                     for (int j = i+1; j < (int)(keyPresses.size()); ++j) {
                         if (keyPresses[i].cid == keyPresses[j].cid) {
-                            cost += 1.0f - similarityMap[i][j].cc;
+                            cost += 1.0f - similarityMap.getCC(i, j);
                         }
                     }
                 }
@@ -887,13 +887,8 @@ bool renderSolution(TParameters & params, const Cipher::TFreqMap & freqMap, TKey
 
                 int n = keyPresses.size();
 
-                // todo : consider removing
+                // the similarity map is symmetric by construction
                 TSimilarityMap ccMap = similarityMap;
-                for (int k0 = 0; k0 < n; ++k0){
-                    for (int k1 = 0; k1 < n; ++k1){
-                        ccMap[k0][k1].cc = 0.5f*(similarityMap[k0][k1].cc + similarityMap[k1][k0].cc);
-                    }
-                }
 
                 std::vector<int> hint(n, -1);
                 for (int i = 0; i < n; ++i) {
@@ -961,7 +956,7 @@ bool renderSolution(TParameters & params, const Cipher::TFreqMap & freqMap, TKey
                 for (int i = 0; i < (int)(keyPresses.size()); ++i) {
                     for (int j = i+1; j < (int)(keyPresses.size()); ++j) {
                         if (keyPresses[i].cid == keyPresses[j].cid) {
-                            cost += 1.0f - similarityMap[i][j].cc;
+                            cost += 1.0f - similarityMap.getCC(i, j);
                         }
                     }
                 }
@@ -83,6 +83,7 @@ using TSampleInput          = TSampleF;
 using TSample               = TSampleI16;
 using TWaveform             = TWaveformI16;
 using TWaveformView         = TWaveformViewI16;
+using TWaveformPyramid      = TWaveformPyramidI16;
 using TKeyPressData         = TKeyPressDataI16;
 using TKeyPressCollection   = TKeyPressCollectionI16;
 using TPlaybackData         = TPlaybackDataI16;
@@ -148,7 +149,6 @@ struct stStateUI {
     int offset = -1;
     int viewMin = 512;
     int viewMax = 512;
-    int nviewPrev = -1;
     int lastSize = -1;
     int lastKeyPresses = 0;
 
@@ -158,7 +158,9 @@ struct stStateUI {
     float dragOffset = 0.0f;
     float scrollSize = 18.0f;
 
-    TWaveform waveformLowRes;
+    TWaveformPyramid waveformPyramid;
+    TWaveform waveformPixelsMin;
+    TWaveform waveformPixelsMax;
     TWaveform waveformThreshold;
     TWaveform waveformMax;
 
@@ -381,9 +383,9 @@ bool renderKeyPresses(stStateUI & stateUI, const TWaveform & waveform, TKeyPress
     float & dragOffset = stateUI.dragOffset;
     float & scrollSize = stateUI.scrollSize;
 
-    auto & nviewPrev = stateUI.nviewPrev;
-
-    TWaveform & waveformLowRes = stateUI.waveformLowRes;
+    TWaveformPyramid & waveformPyramid = stateUI.waveformPyramid;
+    TWaveform & waveformPixelsMin = stateUI.waveformPixelsMin;
+    TWaveform & waveformPixelsMax = stateUI.waveformPixelsMax;
     TWaveform & waveformThreshold = stateUI.waveformThreshold;
     TWaveform & waveformMax = stateUI.waveformMax;
 
@@ -399,7 +401,6 @@ bool renderKeyPresses(stStateUI & stateUI, const TWaveform & waveform, TKeyPress
     if (lastSize != (int) waveform.size()) {
         viewMax = waveform.size();
         lastSize = waveform.size();
-        nviewPrev = nview + 1;
 
         if (scrolling == false) {
             offset = waveform.size() - nview;
@@ -427,24 +428,27 @@ bool renderKeyPresses(stStateUI & stateUI, const TWaveform & waveform, TKeyPress
 
         auto wsize = ImVec2(ImGui::GetContentRegionAvailWidth(), ImGui::GetContentRegionAvail().y - 3*ImGui::GetTextLineHeightWithSpacing());
 
-        if (nview != nviewPrev) {
-            generateLowResWaveform(waveform, waveformLowRes, std::max(1.0f, nview/wsize.x));
-            nviewPrev = nview;
+        if (waveformPyramid.n != (int64_t) waveform.size()) {
+            updateWaveformPyramid(getView(waveform, 0), waveformPyramid);
         }
 
-        auto wview = getView(waveformLowRes, offset, nview);
+        const int nPixels = std::max(1, std::min(nview, (int) wsize.x));
+        getWaveformMinMax(getView(waveform, 0), waveformPyramid, offset, nview, nPixels, waveformPixelsMin, waveformPixelsMax);
+
+        auto wviewMin = getView(waveformPixelsMin, 0);
+        auto wviewMax = getView(waveformPixelsMax, 0);
 
         auto mpos = ImGui::GetIO().MousePos;
         auto savePos = ImGui::GetCursorScreenPos();
         auto drawList = ImGui::GetWindowDrawList();
         ImGui::PushStyleColor(ImGuiCol_FrameBg, { 0.3f, 0.3f, 0.3f, 0.3f });
         ImGui::PushStyleColor(ImGuiCol_PlotHistogram, { 1.0f, 1.0f, 1.0f, 1.0f });
-        ImGui::PlotHistogram("##Waveform", plotWaveform, &wview, nview, 0, "Waveform", amin, amax, wsize);
+        ImGui::PlotHistogram("##Waveform", plotWaveform, &wviewMax, wviewMax.n, 0, "Waveform", amin, amax, wsize);
         ImGui::PopStyleColor(2);
         ImGui::SetCursorScreenPos(savePos);
         ImGui::PushStyleColor(ImGuiCol_FrameBg, { 0.1f, 0.1f, 0.1f, 0.0f });
         ImGui::PushStyleColor(ImGuiCol_PlotHistogram, { 1.0f, 1.0f, 1.0f, 1.0f });
-        ImGui::PlotHistogram("##Waveform", plotWaveformInverse, &wview, nview, 0, "Waveform", amin, amax, wsize);
+        ImGui::PlotHistogram("##Waveform", plotWaveform, &wviewMin, wviewMin.n, 0, "Waveform", amin, amax, wsize);
         ImGui::PopStyleColor(2);
 
         if (waveform.size() == waveformThreshold.size() && waveform.size() == waveformMax.size()) {
@@ -1145,10 +1149,10 @@ bool renderSimilarity(const TKeyPressCollection & keyPresses, const TSimilarityM
             ImGui::InvisibleButton("SimilarityMapIB", { n*bsize, n*bsize });
             for (int i = 0; i < n; ++i) {
                 for (int j = 0; j < n; ++j) {
-                    float col = similarityMap[i][j].cc;
+                    float col = similarityMap.getCC(i, j);
                     ImVec2 p0 = {savePos.x + j*bsize, savePos.y + i*bsize};
                     ImVec2 p1 = {savePos.x + (j + 1)*bsize - 1.0f, savePos.y + (i + 1)*bsize - 1.0f};
-                    if (similarityMap[i][j].cc > threshold) {
+                    if (similarityMap.getCC(i, j) > threshold) {
                         drawList->AddRectFilled(p0, p1, ImGui::ColorConvertFloat4ToU32(ImVec4{1.0f - col, col, 0.0f, col}));
                     }
                     if (ImGui::IsMouseHoveringRect(p0, {p1.x + 1.0f, p1.y + 1.0f})) {
@@ -1156,13 +1160,13 @@ bool renderSimilarity(const TKeyPressCollection & keyPresses, const TSimilarityM
                         if (ImGui::IsMouseDown(0) == false) {
                             ImGui::BeginTooltip();
                             //ImGui::Text("[%3d, %3d]\n", keyPresses[i].cid, keyPresses[j].cid);
-                            ImGui::Text("[%3d, %3d] = %5.4g\n", i, j, similarityMap[i][j].cc);
+                            ImGui::Text("[%3d, %3d] = %5.4g\n", i, j, similarityMap.getCC(i, j));
                             //for (int k = 0; k < n; ++k) {
-                            //    if (similarityMap[i][k].cc > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", i, k, (int) similarityMap[i][k].offset);
+                            //    if (similarityMap.getCC(i, k) > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", i, k, (int) similarityMap.getOffset(i, k));
                             //}
                             //ImGui::Separator();
                             //for (int k = 0; k < n; ++k) {
-                            //    if (similarityMap[k][i].cc > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", k, i, (int) similarityMap[k][i].offset);
+                            //    if (similarityMap.getCC(k, i) > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", k, i, (int) similarityMap.getOffset(k, i));
                             //}
                             ImGui::EndTooltip();
                         }
@@ -1611,6 +1615,7 @@ int main(int argc, char ** argv) {
                 if (convert(stateUI.waveformOriginal, stateUI.waveformInput) == false) {
                     printf("Conversion failed\n");
                 } else {
+                    stateUI.waveformPyramid = {};
                     stateUI.nview = -1;
                     stateUI.recalculateKeyPresses = true;
                     stateUI.maxSample = calcAbsMax(stateUI.waveformOriginal);
@@ -1631,6 +1636,7 @@ int main(int argc, char ** argv) {
             if (convert(stateUI.waveformOriginal, stateUI.waveformInput) == false) {
                 fprintf(stderr, "error : recording failed\n");
             }
+            stateUI.waveformPyramid = {};
             stateUI.maxSample = calcAbsMax(stateUI.waveformOriginal);
 
             stateUI.rescaleWaveform = false;
@@ -37,7 +37,7 @@ bool clusterDBSCAN(const TSimilarityMap & sim, TValueCC epsCC, int minPts, TKeyP
         if (cid != -1) continue;
         std::vector<int> nbi;
         for (int j = 0; j < n; ++j) {
-            auto & cc = sim[i][j].cc;
+            const auto cc = sim.getCC(i, j);
 
             if (cc > epsCC) nbi.push_back(j);
         }
@@ -57,7 +57,7 @@ bool clusterDBSCAN(const TSimilarityMap & sim, TValueCC epsCC, int minPts, TKeyP
 
             std::vector<int> nbq;
             for (int j = 0; j < n; ++j) {
-                auto & cc = sim[nbi[q]][j].cc;
+                const auto cc = sim.getCC(nbi[q], j);
 
                 if (cc > epsCC) nbq.push_back(j);
             }
@@ -95,7 +95,7 @@ bool clusterSimple(const TSimilarityMap & sim, TValueCC tholdCC, TKeyPressCollec
 
         //if (icid != 0 && jcid != 0) continue;
 
-        auto & cc = sim[i][j].cc;
+        const auto cc = sim.getCC(i, j);
 
         if (cc < tholdCC) continue;
         auto r = frand();
@@ -168,7 +168,7 @@ bool clusterG(const TSimilarityMap & sim, TKeyPressCollection & keyPresses) {
     std::vector<Pair> ccpairs;
     for (int i = 0; i < n - 1; ++i) {
         for (int j = i + 1; j < n; ++j) {
-            auto & cc = sim[i][j].cc;
+            const auto cc = sim.getCC(i, j);
 
             ccpairs.emplace_back(Pair{i, j, cc});
         }
@@ -206,22 +206,22 @@ bool clusterG(const TSimilarityMap & sim, TKeyPressCollection & keyPresses) {
                 auto cq = keyPresses[q].cid;
 
                 if ((ck == ci || ck == cj) && (cq == ci || cq == cj)) {
-                    auto & cc     = sim[k][q].cc;
-                    //auto & offset = sim[k][q].offset;
+                    const auto cc     = sim.getCC(k, q);
+                    //auto & offset = sim.getOffset(k, q);
 
                     sumcc += cc;
                     ++nsum;
                 }
                 if (ck == ci && cq == ci) {
-                    auto & cc     = sim[k][q].cc;
-                    //auto & offset = sim[k][q].offset;
+                    const auto cc     = sim.getCC(k, q);
+                    //auto & offset = sim.getOffset(k, q);
 
                     sumcci += cc;
                     ++nsumi;
                 }
                 if (ck == cj && cq == cj) {
-                    auto & cc     = sim[k][q].cc;
-                    //auto & offset = sim[k][q].offset;
+                    const auto cc     = sim.getCC(k, q);
+                    //auto & offset = sim.getOffset(k, q);
 
                     sumccj += cc;
                     ++nsumj;
@@ -282,7 +282,7 @@ bool clusterG2(TSimilarityMap & sim, TKeyPressCollection & keyPresses) {
     std::vector<Pair> ccpairs;
     for (int i = 0; i < n - 1; ++i) {
         for (int j = i + 1; j < n; ++j) {
-            auto & cc = sim[i][j].cc;
+            const auto cc = sim.getCC(i, j);
 
             ccpairs.emplace_back(Pair{i, j, cc});
         }
@@ -359,12 +359,10 @@ int main(int argc, char ** argv) {
     printf("    Recording length:        %g seconds\n", (float)(waveformInput.size())/sampleRate);
 
     TKeyPressCollection keyPresses;
-    TWaveform waveformThreshold;
-    TWaveform waveformMax;
     {
         auto tStart = std::chrono::high_resolution_clock::now();
         printf("[+] Searching for key presses\n");
-        if (findKeyPresses(getView(waveformInput, 0), keyPresses, waveformThreshold, waveformMax, 8.0, 512, 2*1024, true) == false) {
+        if (findKeyPresses(getView(waveformInput, 0), keyPresses, 8.0, 512, 2*1024, true) == false) {
             printf("Failed to detect keypresses\n");
             return -2;
         }
@@ -411,8 +409,8 @@ int main(int argc, char ** argv) {
     for (int i = 0; i < n; ++i) {
         printf("%2d  | ", i);
         for (int j = 0; j < n; ++j) {
-            auto cc     = similarityMap[i][j].cc;
-            //auto offset = similarityMap[i][j].offset;
+            auto cc     = similarityMap.getCC(i, j);
+            //auto offset = similarityMap.getOffset(i, j);
 
             if (cc > -0.45) {
                 printf("%4.0f ", cc*100);
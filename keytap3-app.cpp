@@ -10,7 +10,9 @@
 #include "common.h"
 #include "constants.h"
 #include "subbreak3.h"
+#include "thread-pool.h"
 #include "audio-logger.h"
+#include "recording.h"
 
 #define DR_WAV_IMPLEMENTATION
 #include "dr_wav.h"
@@ -48,6 +50,7 @@ struct StateRecording {
     int nChannels = 1;
     int filterId = EAudioFilter::FirstOrderHighPass;
     int freqCutoff_Hz = kFreqCutoff_Hz;
+    int freqCutoffUsed_Hz = 0;
 
     int nKeysToCapture = 100;
 
@@ -66,7 +69,11 @@ struct StateRecording {
     TWaveformF waveformF;
     TWaveformF waveformFWork;
     TWaveformI16 waveformI16;
-    TKeyPressCollectionT<TSampleI16> keyPresses;
+    TKeyPressCollectionF keyPresses;
+
+    // while recording, only the new samples are filtered and passed to the detector
+    TFilterCoefficients filterCoefficients;
+    KeyPressDetector<TSampleF> keyPressDetector { { kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset, kFindKeysRemoveLowPower } };
 
     AudioLogger audioLogger;
     AudioLogger::Callback cbAudio;
@@ -88,6 +95,9 @@ struct StateRecording {
         waveformI16.clear();
         keyPresses.clear();
 
+        filterCoefficients = calculateCoefficientsFirstOrderHighPass(freqCutoff_Hz > 0 ? freqCutoff_Hz : kFreqCutoff_Hz, kSampleRate);
+        keyPressDetector.reset();
+
         AudioLogger::Callback cbAudio = [&](const auto & frames) {
             const auto tStart = std::chrono::high_resolution_clock::now();
 
@@ -144,14 +154,16 @@ struct StateRecording {
     }
 
     void updateWorker(std::string & dataOutput, float tElapsed_s) {
-        {
-            std::lock_guard lock(mutex);
-            waveformFWork = waveformF;
-        }
-        {
+        if (tElapsed_s < 0.0f) {
+            // the recording is complete - prepare the i16 waveform for decoding
+            {
+                std::lock_guard lock(mutex);
+                waveformFWork = waveformF;
+            }
+
             auto freqCutoffCur_Hz = freqCutoff_Hz;
 
-            if (tElapsed_s < 0.0f && freqCutoffCur_Hz == 0) {
+            if (freqCutoffCur_Hz == 0) {
                 const auto tStart = std::chrono::high_resolution_clock::now();
 
                 freqCutoffCur_Hz = Cipher::findBestCutoffFreq(waveformFWork, EAudioFilter::FirstOrderHighPass, kSampleRate, 100.0f, 1000.0f, 100.0f);
@@ -162,19 +174,27 @@ struct StateRecording {
                 freqCutoffCur_Hz = kFreqCutoff_Hz;
             }
 
-            // apply default filtering, because keypress detection without it is impossible
-            auto waveformFFiltered = waveformFWork;
-            ::filter(waveformFFiltered, EAudioFilter::FirstOrderHighPass, freqCutoffCur_Hz, kSampleRate);
+            freqCutoffUsed_Hz = freqCutoffCur_Hz;
 
-            if (convert(waveformFFiltered, waveformI16) == false) {
+            // apply default filtering, because keypress detection without it is impossible
+            if (filterAndConvert(waveformFWork, EAudioFilter::FirstOrderHighPass, freqCutoffCur_Hz, kSampleRate, waveformI16) == false) {
                 printf("Conversion failed\n");
             }
+
+            return;
         }
 
-        TWaveformI16 waveformMax;
-        TWaveformI16 waveformThreshold;
-        if (findKeyPresses(getView(waveformI16, 0), keyPresses, waveformThreshold, waveformMax,
-                           kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset, kFindKeysRemoveLowPower) == false) {
+        {
+            std::lock_guard lock(mutex);
+            waveformFWork.assign(waveformF.begin() + keyPressDetector.getNProcessed(), waveformF.end());
+        }
+
+        for (auto & s : waveformFWork) {
+            s = ::filterFirstOrderHighPass(filterCoefficients, s);
+        }
+
+        if (keyPressDetector.process(waveformFWork.data(), waveformFWork.size()) == false ||
+            keyPressDetector.getKeyPresses(keyPresses) == false) {
             printf("Failed to detect keypresses\n");
         }
 
@@ -209,6 +229,12 @@ struct StateDecoding {
     std::string pathData = "./data";
     std::atomic_bool interrupt = false;
     TWaveform waveformInput;
+
+    // the analysis is cached under the same key keytap3 uses for the written recording
+    TAnalysisKey cacheKey;
+    std::string fnameCache;
+    int freqCutoff_Hz = 0;
+
     Cipher::TFreqMap freqMap6;
 };
 
@@ -391,15 +417,21 @@ bool AppInterface::init(State & state) {
 
                         // write record.kbd
                         {
-                            std::ofstream fout(state.recording.pathOutput, std::ios::binary);
-                            if (fout.good() == false) {
+                            RecordingWriter writer;
+                            RecordingWriter::Parameters parameters;
+                            parameters.sampleType = RecordingInfo::F32;
+                            parameters.sampleRate = kSampleRate;
+                            if (writer.open(state.recording.pathOutput, std::move(parameters)) == false) {
                                 fprintf(stderr, "Failed to open file '%s'\n", state.recording.pathOutput.c_str());
                                 return false;
                             }
 
-                            state.recording.totalSize_bytes = sizeof(state.recording.waveformF[0])*state.recording.waveformF.size();
-                            fout.write((char *)(state.recording.waveformF.data()), sizeof(state.recording.waveformF[0])*state.recording.waveformF.size());
-                            fout.close();
+                            const auto & waveformF = state.recording.waveformF;
+                            if (writer.write(waveformF.data(), waveformF.size()) == false || writer.close() == false) {
+                                fprintf(stderr, "Failed to write file '%s'\n", state.recording.pathOutput.c_str());
+                                return false;
+                            }
+                            state.recording.totalSize_bytes = writer.getTotalSize_bytes();
 
                             printf("[+] Total data saved: %g MB\n", ((float)(state.recording.totalSize_bytes)/1024.0f/1024.0f));
                         }
@@ -426,6 +458,26 @@ bool AppInterface::init(State & state) {
 
                         state.dataOutput = "decoding";
 
+                        // only the cutoff search matches what keytap3 does with the default parameters
+                        state.decoding.fnameCache.clear();
+                        if (state.recording.freqCutoff_Hz == 0) {
+                            const auto & waveformF = state.recording.waveformF;
+
+                            auto & key = state.decoding.cacheKey;
+                            key.recordingHash = calcRecordingHash(state.recording.pathOutput, getView(waveformF, 0));
+                            key.filterId = EAudioFilter::FirstOrderHighPass;
+                            key.freqCutoff_Hz = 0;
+                            key.keyPressWidth_samples = kKeyWidth_samples;
+                            key.alignWindow_samples = kKeyAlign_samples;
+                            key.offsetFromPeak_samples = kKeyWidth_samples - kKeyOffset_samples;
+                            key.ccMethod = ECCMethod::Direct;
+                            key.extraHash = calcDetectionHash(kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset,
+                                                              kFindKeysRemoveLowPower, kRemoveLowSimilarityThreshold);
+
+                            state.decoding.fnameCache = getAnalysisCachePath(state.recording.pathOutput, key);
+                        }
+                        state.decoding.freqCutoff_Hz = state.recording.freqCutoffUsed_Hz;
+
                         state.decoding.waveformInput = state.recording.waveformI16;
                         state.state = State::Decoding;
                         printf("[+] Starting decoding\n");
@@ -438,41 +490,47 @@ bool AppInterface::init(State & state) {
                         state.decoding.interrupt = false;
                         state.worker = std::thread([&]() {
                             TKeyPressCollection keyPresses;
-                            {
-                                const auto tStart = std::chrono::high_resolution_clock::now();
+                            TSimilarityMap similarityMap;
 
-                                printf("[+] Searching for key presses\n");
+                            TAnalysisCache cache;
+                            const auto & fnameCache = state.decoding.fnameCache;
+                            if (fnameCache.empty() == false && loadAnalysisCache(fnameCache, state.decoding.cacheKey, cache)) {
+                                setKeyPositions(cache.positions, getView(state.decoding.waveformInput, 0), keyPresses);
+                                similarityMap = std::move(cache.similarityMap);
 
-                                TWaveform waveformMax;
-                                TWaveform waveformThreshold;
-                                if (findKeyPresses(getView(state.decoding.waveformInput, 0), keyPresses, waveformThreshold, waveformMax,
-                                                   kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset, kFindKeysRemoveLowPower) == false) {
-                                    printf("Failed to detect keypresses\n");
-                                    return;
-                                }
+                                printf("[+] Using the cached analysis from '%s'\n", fnameCache.c_str());
+                            } else {
+                                {
+                                    const auto tStart = std::chrono::high_resolution_clock::now();
 
-                                const auto tEnd = std::chrono::high_resolution_clock::now();
+                                    printf("[+] Searching for key presses\n");
 
-                                printf("[+] Detected a total of %d potential key presses\n", (int) keyPresses.size());
-                                printf("[+] Search took %4.3f seconds\n", toSeconds(tStart, tEnd));
-                            }
+                                    if (findKeyPresses(getView(state.decoding.waveformInput, 0), keyPresses,
+                                                       kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset, kFindKeysRemoveLowPower) == false) {
+                                        printf("Failed to detect keypresses\n");
+                                        return;
+                                    }
 
-                            int n = keyPresses.size();
+                                    const auto tEnd = std::chrono::high_resolution_clock::now();
 
-                            TSimilarityMap similarityMap;
-                            {
-                                const auto tStart = std::chrono::high_resolution_clock::now();
+                                    printf("[+] Detected a total of %d potential key presses\n", (int) keyPresses.size());
+                                    printf("[+] Search took %4.3f seconds\n", toSeconds(tStart, tEnd));
+                                }
+
+                                {
+                                    const auto tStart = std::chrono::high_resolution_clock::now();
 
-                                printf("[+] Calculating CC similarity map\n");
+                                    printf("[+] Calculating CC similarity map\n");
 
-                                if (calculateSimilartyMap(kKeyWidth_samples, kKeyAlign_samples, kKeyWidth_samples - kKeyOffset_samples, keyPresses, similarityMap) == false) {
-                                    printf("Failed to calculate similariy map\n");
-                                    return;
-                                }
+                                    if (calculateSimilartyMap(kKeyWidth_samples, kKeyAlign_samples, kKeyWidth_samples - kKeyOffset_samples, keyPresses, similarityMap) == false) {
+                                        printf("Failed to calculate similariy map\n");
+                                        return;
+                                    }
 
-                                const auto tEnd = std::chrono::high_resolution_clock::now();
+                                    const auto tEnd = std::chrono::high_resolution_clock::now();
 
-                                printf("[+] Calculation took %4.3f seconds\n", toSeconds(tStart, tEnd));
+                                    printf("[+] Calculation took %4.3f seconds\n", toSeconds(tStart, tEnd));
+                                }
 
                                 {
                                     const auto tStart = std::chrono::high_resolution_clock::now();
@@ -481,7 +539,7 @@ bool AppInterface::init(State & state) {
 
                                     const int n0 = keyPresses.size();
 
-                                    if (removeLowSimilarityKeys(keyPresses, similarityMap, 0.3f) == false) {
+                                    if (removeLowSimilarityKeys(keyPresses, similarityMap, kRemoveLowSimilarityThreshold) == false) {
                                         printf("Failed to remove low-similarity keys\n");
                                         return;
                                     }
@@ -493,34 +551,42 @@ bool AppInterface::init(State & state) {
                                     printf("[+] Removed %d low-similarity keys, took %4.3f seconds\n", n0 - n1, toSeconds(tStart, tEnd));
                                 }
 
-                                n = keyPresses.size();
+                                if (fnameCache.empty() == false) {
+                                    cache.freqCutoff_Hz = state.decoding.freqCutoff_Hz;
+                                    getKeyPositions(keyPresses, cache.positions);
+                                    cache.similarityMap = similarityMap;
 
-                                if (n > 0) {
-                                    const int ncc = std::min(32, n);
-                                    for (int j = 0; j < ncc; ++j) {
-                                        printf("%2d: ", j);
-                                        for (int i = 0; i < ncc; ++i) {
-                                            printf("%6.3f ", similarityMap[j][i].cc);
-                                        }
-                                        printf("\n");
+                                    saveAnalysisCache(fnameCache, state.decoding.cacheKey, cache);
+                                }
+                            }
+
+                            int n = keyPresses.size();
+
+                            if (n > 0) {
+                                const int ncc = std::min(32, n);
+                                for (int j = 0; j < ncc; ++j) {
+                                    printf("%2d: ", j);
+                                    for (int i = 0; i < ncc; ++i) {
+                                        printf("%6.3f ", similarityMap.getCC(j, i));
                                     }
                                     printf("\n");
-
-                                    auto minCC = similarityMap[0][1].cc;
-                                    auto maxCC = similarityMap[0][1].cc;
-                                    for (int j = 0; j < n - 1; ++j) {
-                                        for (int i = j + 1; i < n; ++i) {
-                                            minCC = std::min(minCC, similarityMap[j][i].cc);
-                                            maxCC = std::max(maxCC, similarityMap[j][i].cc);
-                                        }
+                                }
+                                printf("\n");
+
+                                auto minCC = similarityMap.getCC(0, 1);
+                                auto maxCC = similarityMap.getCC(0, 1);
+                                for (int j = 0; j < n - 1; ++j) {
+                                    for (int i = j + 1; i < n; ++i) {
+                                        minCC = std::min(minCC, similarityMap.getCC(j, i));
+                                        maxCC = std::max(maxCC, similarityMap.getCC(j, i));
                                     }
-
-                                    printf("[+] Similarity map: min = %g, max = %g\n", minCC, maxCC);
                                 }
+
+                                printf("[+] Similarity map: min = %g, max = %g\n", minCC, maxCC);
                             }
 
                             if (n > 0) {
-                                const int nThread = std::min(8, std::max(1, int(std::thread::hardware_concurrency()) - 2));
+                                const int nThread = std::min(8, ThreadPool::getShared().getNThreads());
 
                                 printf("[+] Attempting to recover the text from the recording, nThreads = %d\n", nThread);
 
@@ -561,29 +627,21 @@ bool AppInterface::init(State & state) {
 
                                     // beam search
                                     {
-                                        std::vector<std::thread> workers(std::min(nThread, (int) clusterings.size()));
-
                                         std::mutex mutexPrint;
-                                        for (int i = 0; i < nThread; ++i) {
-                                            workers[i] = std::thread([&, i]() {
-                                                for (int j = i; j < (int) clusterings.size(); j += nThread) {
-                                                    Cipher::beamSearch(params, state.decoding.freqMap6, clusterings[j]);
-                                                    mutexPrint.lock();
-                                                    printf(" ");
-                                                    Cipher::printDecoded(clusterings[j].clusters, clusterings[j].clMap, params.hint);
-                                                    printf(" [%8.3f %8.3f]\n", clusterings[j].p, clusterings[j].pClusters);
-                                                    mutexPrint.unlock();
-
-                                                    if (state.decoding.interrupt) {
-                                                        break;
-                                                    }
+                                        ThreadPool::getShared().parallelFor(nThread, [&](int64_t i) {
+                                            for (int j = i; j < (int) clusterings.size(); j += nThread) {
+                                                Cipher::beamSearch(params, state.decoding.freqMap6, clusterings[j]);
+                                                mutexPrint.lock();
+                                                printf(" ");
+                                                Cipher::printDecoded(clusterings[j].clusters, clusterings[j].clMap, params.hint);
+                                                printf(" [%8.3f %8.3f]\n", clusterings[j].p, clusterings[j].pClusters);
+                                                mutexPrint.unlock();
+
+                                                if (state.decoding.interrupt) {
+                                                    break;
                                                 }
-                                            });
-                                        }
-
-                                        for (auto& worker : workers) {
-                                            worker.join();
-                                        }
+                                            }
+                                        });
 
                                         if (state.decoding.interrupt) {
                                             printf("\n[!] Analysis interrupted\n");
@@ -9,6 +9,7 @@
 #include "common.h"
 #include "common-gui.h"
 #include "subbreak3.h"
+#include "thread-pool.h"
 #include "audio-logger.h"
 
 #include "imgui.h"
@@ -78,6 +79,7 @@ using TSampleInput          = TSampleF;
 using TSample               = TSampleI16;
 using TWaveform             = TWaveformI16;
 using TWaveformView         = TWaveformViewI16;
+using TWaveformPyramid      = TWaveformPyramidI16;
 using TKeyPressData         = TKeyPressDataI16;
 using TKeyPressCollection   = TKeyPressCollectionI16;
 using TPlaybackData         = TPlaybackDataI16;
@@ -140,7 +142,6 @@ struct stStateUI {
     int offset = -1;
     int viewMin = 512;
     int viewMax = 512;
-    int nviewPrev = -1;
     int lastSize = -1;
     int lastKeyPresses = 0;
 
@@ -150,7 +151,9 @@ struct stStateUI {
     float dragOffset = 0.0f;
     float scrollSize = 18.0f;
 
-    TWaveform waveformLowRes;
+    TWaveformPyramid waveformPyramid;
+    TWaveform waveformPixelsMin;
+    TWaveform waveformPixelsMax;
     TWaveform waveformThreshold;
     TWaveform waveformMax;
 
@@ -370,9 +373,9 @@ bool renderKeyPresses(stStateUI & stateUI, const TWaveform & waveform, TKeyPress
     float & dragOffset = stateUI.dragOffset;
     float & scrollSize = stateUI.scrollSize;
 
-    auto & nviewPrev = stateUI.nviewPrev;
-
-    TWaveform & waveformLowRes = stateUI.waveformLowRes;
+    TWaveformPyramid & waveformPyramid = stateUI.waveformPyramid;
+    TWaveform & waveformPixelsMin = stateUI.waveformPixelsMin;
+    TWaveform & waveformPixelsMax = stateUI.waveformPixelsMax;
     TWaveform & waveformThreshold = stateUI.waveformThreshold;
     TWaveform & waveformMax = stateUI.waveformMax;
 
@@ -388,7 +391,6 @@ bool renderKeyPresses(stStateUI & stateUI, const TWaveform & waveform, TKeyPress
     if (lastSize != (int) waveform.size()) {
         viewMax = waveform.size();
         lastSize = waveform.size();
-        nviewPrev = nview + 1;
 
         if (scrolling == false) {
             offset = waveform.size() - nview;
@@ -416,24 +418,27 @@ bool renderKeyPresses(stStateUI & stateUI, const TWaveform & waveform, TKeyPress
 
         auto wsize = ImVec2(ImGui::GetContentRegionAvailWidth(), ImGui::GetContentRegionAvail().y - 3*ImGui::GetTextLineHeightWithSpacing());
 
-        if (nview != nviewPrev) {
-            generateLowResWaveform(waveform, waveformLowRes, std::max(1.0f, nview/wsize.x));
-            nviewPrev = nview;
+        if (waveformPyramid.n != (int64_t) waveform.size()) {
+            updateWaveformPyramid(getView(waveform, 0), waveformPyramid);
         }
 
-        auto wview = getView(waveformLowRes, offset, nview);
+        const int nPixels = std::max(1, std::min(nview, (int) wsize.x));
+        getWaveformMinMax(getView(waveform, 0), waveformPyramid, offset, nview, nPixels, waveformPixelsMin, waveformPixelsMax);
+
+        auto wviewMin = getView(waveformPixelsMin, 0);
+        auto wviewMax = getView(waveformPixelsMax, 0);
 
         auto mpos = ImGui::GetIO().MousePos;
         auto savePos = ImGui::GetCursorScreenPos();
         auto drawList = ImGui::GetWindowDrawList();
         ImGui::PushStyleColor(ImGuiCol_FrameBg, { 0.3f, 0.3f, 0.3f, 0.3f });
         ImGui::PushStyleColor(ImGuiCol_PlotHistogram, { 1.0f, 1.0f, 1.0f, 1.0f });
-        ImGui::PlotHistogram("##Waveform", plotWaveform, &wview, nview, 0, "Waveform", amin, amax, wsize);
+        ImGui::PlotHistogram("##Waveform", plotWaveform, &wviewMax, wviewMax.n, 0, "Waveform", amin, amax, wsize);
         ImGui::PopStyleColor(2);
         ImGui::SetCursorScreenPos(savePos);
         ImGui::PushStyleColor(ImGuiCol_FrameBg, { 0.1f, 0.1f, 0.1f, 0.0f });
         ImGui::PushStyleColor(ImGuiCol_PlotHistogram, { 1.0f, 1.0f, 1.0f, 1.0f });
-        ImGui::PlotHistogram("##Waveform", plotWaveformInverse, &wview, nview, 0, "Waveform", amin, amax, wsize);
+        ImGui::PlotHistogram("##Waveform", plotWaveform, &wviewMin, wviewMin.n, 0, "Waveform", amin, amax, wsize);
         ImGui::PopStyleColor(2);
 
         if (waveform.size() == waveformThreshold.size() && waveform.size() == waveformMax.size()) {
@@ -1143,10 +1148,10 @@ bool renderSimilarity(const TKeyPressCollection & keyPresses, const TSimilarityM
             ImGui::InvisibleButton("SimilarityMapIB", { n*bsize, n*bsize });
             for (int i = 0; i < n; ++i) {
                 for (int j = 0; j < n; ++j) {
-                    float col = similarityMap[i][j].cc;
+                    float col = similarityMap.getCC(i, j);
                     ImVec2 p0 = {savePos.x + j*bsize, savePos.y + i*bsize};
                     ImVec2 p1 = {savePos.x + (j + 1)*bsize - 1.0f, savePos.y + (i + 1)*bsize - 1.0f};
-                    if (similarityMap[i][j].cc > threshold) {
+                    if (similarityMap.getCC(i, j) > threshold) {
                         drawList->AddRectFilled(p0, p1, ImGui::ColorConvertFloat4ToU32(ImVec4{1.0f - col, col, 0.0f, col}));
                     }
                     if (ImGui::IsMouseHoveringRect(p0, {p1.x + 1.0f, p1.y + 1.0f})) {
@@ -1154,13 +1159,13 @@ bool renderSimilarity(const TKeyPressCollection & keyPresses, const TSimilarityM
                         if (ImGui::IsMouseDown(0) == false) {
                             ImGui::BeginTooltip();
                             //ImGui::Text("[%3d, %3d]\n", keyPresses[i].cid, keyPresses[j].cid);
-                            ImGui::Text("[%3d, %3d] = %5.4g\n", i, j, similarityMap[i][j].cc);
+                            ImGui::Text("[%3d, %3d] = %5.4g\n", i, j, similarityMap.getCC(i, j));
                             //for (int k = 0; k < n; ++k) {
-                            //    if (similarityMap[i][k].cc > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", i, k, (int) similarityMap[i][k].offset);
+                            //    if (similarityMap.getCC(i, k) > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", i, k, (int) similarityMap.getOffset(i, k));
                             //}
                             //ImGui::Separator();
                             //for (int k = 0; k < n; ++k) {
-                            //    if (similarityMap[k][i].cc > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", k, i, (int) similarityMap[k][i].offset);
+                            //    if (similarityMap.getCC(k, i) > 0.5) ImGui::Text("Offset [%3d, %3d] = %d\n", k, i, (int) similarityMap.getOffset(k, i));
                             //}
                             ImGui::EndTooltip();
                         }
@@ -1243,12 +1248,13 @@ int main(int argc, char ** argv) {
     srand(time(0));
 
     printf("Build: %s, (%s)\n", kGIT_DATE, kGIT_SHA1);
-    printf("Usage: %s record.kbd n-gram-dir [-pN] [-cN] [-CN] [-FN] [-fN]\n", argv[0]);
+    printf("Usage: %s record.kbd n-gram-dir [-pN] [-cN] [-CN] [-FN] [-fN] [-n]\n", argv[0]);
     printf("    -pN - select playback device N\n");
     printf("    -cN - select capture device N\n");
     printf("    -CN - select number N of capture channels to use\n");
     printf("    -FN - select filter type, (0 - none, 1 - first order high-pass, 2 - second order high-pass)\n");
     printf("    -fN - cutoff frequency in Hz\n");
+    printf("    -n  - do not use the analysis cache next to the recording\n");
 
     if (argc < 3) {
         return -1;
@@ -1260,6 +1266,8 @@ int main(int argc, char ** argv) {
     const int nChannels     = argm.count("C") == 0 ? 0 : std::stoi(argm.at("C"));
     const int filterId      = argm.count("F") == 0 ? EAudioFilter::FirstOrderHighPass : std::stoi(argm.at("F"));
     const int freqCutoff_Hz = argm.count("f") == 0 ? 0 : std::stoi(argm.at("f"));
+    const bool useCache     = argm.count("n") == 0;
+    const std::string fnameRecording = argv[1];
 
     stateUI.params.playbackId = playbackId;
     stateUI.fnameRecord = argv[1];
@@ -1627,6 +1635,7 @@ int main(int argc, char ** argv) {
                 if (convert(stateUI.waveformOriginal, stateUI.waveformInput) == false) {
                     printf("Conversion failed\n");
                 } else {
+                    stateUI.waveformPyramid = {};
                     stateUI.nview = -1;
                     stateUI.recalculateKeyPresses = true;
                     stateUI.maxSample = calcAbsMax(stateUI.waveformOriginal);
@@ -1664,6 +1673,7 @@ int main(int argc, char ** argv) {
             if (convert(stateUI.waveformOriginal, stateUI.waveformInput) == false) {
                 fprintf(stderr, "error : recording failed\n");
             }
+            stateUI.waveformPyramid = {};
             stateUI.maxSample = calcAbsMax(stateUI.waveformOriginal);
 
             stateUI.rescaleWaveform = false;
@@ -1699,6 +1709,9 @@ int main(int argc, char ** argv) {
     };
 
     std::thread workerCore([&]() {
+        // after edits, only the key presses whose window changed are recomputed
+        SimilarityMapCache similarityMapCache;
+
         while (finishApp == false) {
             if (stateUI.changed()) {
                 auto stateUINew = stateUI.get();
@@ -1715,24 +1728,71 @@ int main(int argc, char ** argv) {
                         stateCore.flags.calculatingSimilarityMap = true;
                         stateCore.update(true);
 
-                        calculateSimilartyMap(
-                                stateUINew.params.keyPressWidth_samples,
-                                stateUINew.params.alignWindow_samples,
-                                stateUINew.params.offsetFromPeak_samples,
-                                stateCore.keyPresses,
-                                stateCore.similarityMap);
+                        // the i16 samples already reflect the filter, and the detected or edited key presses
+                        // are an input here, so they go in place of the detection parameters
+                        TAnalysisKey cacheKey;
+                        TAnalysisCache cache;
+                        std::string fnameCache;
+                        if (useCache) {
+                            const auto & waveform = stateCore.keyPresses[0].waveform;
+
+                            std::vector<TKeyPressPosition> positions;
+                            getKeyPositions(stateCore.keyPresses, positions);
+
+                            cacheKey.recordingHash = calcHash(waveform.samples, waveform.n*sizeof(TSample));
+                            cacheKey.keyPressWidth_samples = stateUINew.params.keyPressWidth_samples;
+                            cacheKey.alignWindow_samples = stateUINew.params.alignWindow_samples;
+                            cacheKey.offsetFromPeak_samples = stateUINew.params.offsetFromPeak_samples;
+                            cacheKey.ccMethod = ECCMethod::Direct;
+                            cacheKey.extraHash = calcHash(positions.data(), positions.size()*sizeof(TKeyPressPosition));
+
+                            fnameCache = getAnalysisCachePath(fnameRecording, cacheKey);
+                        }
+
+                        if (useCache && loadAnalysisCache(fnameCache, cacheKey, cache) &&
+                            cache.positions.size() == stateCore.keyPresses.size()) {
+                            // only the adjusted positions - the binds entered by the user stay as they are
+                            for (int i = 0; i < (int) cache.positions.size(); ++i) {
+                                stateCore.keyPresses[i].pos = cache.positions[i];
+                            }
+                            stateCore.similarityMap = std::move(cache.similarityMap);
+
+                            // the next edit has nothing to update incrementally against
+                            similarityMapCache.clear();
 
-                        int nTries = 3;
-                        while (adjustKeyPresses(stateCore.keyPresses, stateCore.similarityMap) && --nTries) {
-                            calculateSimilartyMap(
+                            printf("[+] Similarity map loaded from '%s'\n", fnameCache.c_str());
+                        } else {
+                            updateSimilarityMap(
                                     stateUINew.params.keyPressWidth_samples,
                                     stateUINew.params.alignWindow_samples,
                                     stateUINew.params.offsetFromPeak_samples,
                                     stateCore.keyPresses,
+                                    similarityMapCache,
                                     stateCore.similarityMap);
-                        }
 
-                        printf("[+] Similarity map recalculated\n");
+                            int nUpdated = similarityMapCache.getNUpdated();
+
+                            int nTries = 3;
+                            while (adjustKeyPresses(stateCore.keyPresses, stateCore.similarityMap) && --nTries) {
+                                updateSimilarityMap(
+                                        stateUINew.params.keyPressWidth_samples,
+                                        stateUINew.params.alignWindow_samples,
+                                        stateUINew.params.offsetFromPeak_samples,
+                                        stateCore.keyPresses,
+                                        similarityMapCache,
+                                        stateCore.similarityMap);
+
+                                nUpdated += similarityMapCache.getNUpdated();
+                            }
+
+                            printf("[+] Similarity map recalculated, %d key press rows updated\n", nUpdated);
+
+                            if (useCache) {
+                                getKeyPositions(stateCore.keyPresses, cache.positions);
+                                cache.similarityMap = stateCore.similarityMap;
+                                saveAnalysisCache(fnameCache, cacheKey, cache);
+                            }
+                        }
 
                         stateCore.flags.calculatingSimilarityMap = false;
                         stateCore.flags.updateSimilarityMap = true;
@@ -1817,34 +1877,20 @@ int main(int argc, char ** argv) {
                     ++iter;
                 }
 #else
-                int nFinished = 0;
-                int nWorkers = std::min(stateCore.params.nProcessors(), (int) std::thread::hardware_concurrency()/2);
-
-                std::mutex mutex;
-                std::condition_variable cv;
-                std::vector<std::thread> workers(nWorkers);
-                for (int iw = 0; iw < (int) workers.size(); ++iw) {
-                    auto & worker = workers[iw];
-                    worker = std::thread([&](int ith) {
-                        int n = stateCore.params.nProcessors();
-                        for (int i = ith; i < n; i += nWorkers) {
-                            stateCore.processors[i].setHint(stateCore.params.cipher.hint);
-                            stateCore.processors[i].compute();
-
-                            stateCore.flags.updateResult[i] = true;
-                            stateCore.update();
-                        }
-                        {
-                            std::lock_guard<std::mutex> lock(mutex);
-                            ++nFinished;
-                            cv.notify_one();
-                        }
-                    }, iw);
-                    worker.detach();
-                }
+                auto & pool = ThreadPool::getShared();
+
+                int nWorkers = std::min(stateCore.params.nProcessors(), std::max(1, pool.getNThreads()/2));
 
-                std::unique_lock<std::mutex> lock(mutex);
-                cv.wait(lock, [&]() { return nFinished == nWorkers; });
+                pool.parallelFor(nWorkers, [&](int64_t ith) {
+                    int n = stateCore.params.nProcessors();
+                    for (int i = ith; i < n; i += nWorkers) {
+                        stateCore.processors[i].setHint(stateCore.params.cipher.hint);
+                        stateCore.processors[i].compute();
+
+                        stateCore.flags.updateResult[i] = true;
+                        stateCore.update();
+                    }
+                });
 #endif
             } else {
                 std::this_thread::sleep_for(std::chrono::milliseconds(1));
@@ -37,42 +37,30 @@ int main(int argc, char ** argv) {
 
     TWaveformMI16 waveformInputMI16;
     {
-        TWaveformF waveformInputF;
+        MappedWaveform waveformInputF;
+        TWaveformPlanarMI16 waveformInputBands;
         printf("[+] Loading recording from '%s'\n", argv[1]);
-        if (readFromFile<TSampleF>(argv[1], waveformInputF) == false) {
+        if (waveformInputF.open(argv[1]) == false) {
             printf("Specified file '%s' does not exist\n", argv[1]);
             return -1;
         } else {
             for (int j = 0; j < TSampleMI16::N; ++j) {
                 TWaveformI16 waveformInputI16;
 
-                printf("[+] Filtering waveform with filter type = %d and cutoff frequency = %d Hz\n", filterId, freqCutoff_Hz + j*200);
-                auto filtered = waveformInputF;
-                ::filter(filtered, (EAudioFilter) (j%2 + filterId), freqCutoff_Hz + j*200, kSampleRate);
-
-                //{
-                //    auto tmp = filtered;
-                //    for (int i = j; i < (int) filtered.size() - j; ++i) {
-                //        float sum = 0.0f;
-                //        for (int w = -j; w <= j; ++w) {
-                //            sum += (tmp[i + w]);
-                //        }
-                //        filtered[i] = sum / (2 * j + 1);
-                //    }
-                //}
-
-                printf("[+] Converting waveform to i16 format ...\n");
-                if (convert(filtered, waveformInputI16) == false) {
+                printf("[+] Filtering waveform with filter type = %d and cutoff frequency = %d Hz and converting to i16 format ...\n", filterId, freqCutoff_Hz + j*200);
+                if (filterAndConvert(waveformInputF.getView(), (EAudioFilter) (j%2 + filterId), freqCutoff_Hz + j*200, kSampleRate, waveformInputI16) == false) {
                     printf("Conversion failed\n");
                     return -4;
                 }
 
-                waveformInputMI16.resize(waveformInputI16.size());
-                for (size_t i = 0; i < waveformInputI16.size(); ++i) {
-                    waveformInputMI16[i][j] = waveformInputI16[i];
+                if (j == 0) {
+                    waveformInputBands.resize(waveformInputI16.size());
                 }
+                std::copy(waveformInputI16.begin(), waveformInputI16.end(), waveformInputBands.getPlane(j));
             }
         }
+
+        convert(waveformInputBands, waveformInputMI16);
     }
 
     printf("[+] Loaded recording: of %d samples (sample size = %d bytes)\n", (int) waveformInputMI16.size(), (int) sizeof(TSample));
@@ -120,7 +108,7 @@ int main(int argc, char ** argv) {
             for (int j = 0; j < nPrint; ++j) {
                 printf("%2d: ", j);
                 for (int i = 0; i < nPrint; ++i) {
-                    printf("%6.3f ", similarityMap[j][i].cc);
+                    printf("%6.3f ", similarityMap.getCC(j, i));
                 }
                 printf("\n");
             }
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "constants.h"
 #include "subbreak3.h"
+#include "thread-pool.h"
 
 #include <chrono>
 #include <cstdio>
@@ -27,9 +28,13 @@ using TKeyPressData         = TKeyPressDataI16;
 using TKeyPressCollection   = TKeyPressCollectionI16;
 
 int main(int argc, char ** argv) {
-    printf("Usage: %s record.kbd n-gram-dir [-FN] [-fN]\n", argv[0]);
+    printf("Usage: %s record.kbd n-gram-dir [-FN] [-fN] [-mN] [-jN] [-aN] [-n]\n", argv[0]);
     printf("    -FN - select filter type, (0 - none, 1 - first order high-pass, 2 - second order high-pass)\n");
     printf("    -fN - cutoff frequency in Hz\n");
+    printf("    -mN - similarity method, (0 - direct, 1 - FFT, 2 - coarse-to-fine, 3 - GEMM)\n");
+    printf("    -jN - number of threads, (0 - all hardware threads)\n");
+    printf("    -aN - pin the threads to consecutive CPUs, starting at CPU N, (-1 - no pinning)\n");
+    printf("    -n  - do not use the analysis cache next to the recording\n");
     if (argc < 3) {
         return -1;
     }
@@ -38,8 +43,41 @@ int main(int argc, char ** argv) {
 
     const auto argm = parseCmdArguments(argc, argv);
     const int filterId      = argm.count("F") == 0 ? EAudioFilter::FirstOrderHighPass : std::stoi(argm.at("F"));
+    const int ccMethod      = argm.count("m") == 0 ? ECCMethod::Direct : std::stoi(argm.at("m"));
+    const int nThreads      = argm.count("j") == 0 ? 0 : std::stoi(argm.at("j"));
+    const int firstCPU      = argm.count("a") == 0 ? -1 : std::stoi(argm.at("a"));
+    const bool useCache     = argm.count("n") == 0;
+
+    if (filterId < EAudioFilter::None || filterId > EAudioFilter::SecondOrderButterworthHighPass) {
+        printf("Invalid filter type selected - %d\n", filterId);
+        return -1;
+    }
+
+    if (ccMethod < ECCMethod::Direct || ccMethod > ECCMethod::GEMM) {
+        printf("Invalid similarity method selected - %d\n", ccMethod);
+        return -1;
+    }
+
+    if (nThreads < 0) {
+        printf("Invalid number of threads selected - %d\n", nThreads);
+        return -1;
+    }
+
+    {
+        ThreadPool::Parameters parameters;
+        parameters.nThreads = nThreads;
+        parameters.pinThreads = firstCPU >= 0;
+        parameters.firstCPU = std::max(0, firstCPU);
+
+        ThreadPool::initShared(std::move(parameters));
+        printf("[+] Using %d threads\n", ThreadPool::getShared().getNThreads());
+    }
 
     int freqCutoff_Hz = argm.count("f") == 0 ? 0 : std::stoi(argm.at("f"));
+    if (freqCutoff_Hz < 0 || freqCutoff_Hz >= sampleRate/2) {
+        printf("Invalid cutoff frequency selected - %d Hz\n", freqCutoff_Hz);
+        return -1;
+    }
 
     Cipher::TFreqMap freqMap6;
     {
@@ -58,28 +96,51 @@ int main(int argc, char ** argv) {
 
     // Main algorithm
 
+    TAnalysisKey cacheKey;
+    TAnalysisCache cache;
+    std::string fnameCache;
+    bool isCached = false;
+
     TWaveform waveformInput;
     {
-        TWaveformF waveformInputF;
+        MappedWaveform waveformInputF;
         printf("[+] Loading recording from '%s'\n", argv[1]);
-        if (readFromFile<TSampleF>(argv[1], waveformInputF) == false) {
+        if (waveformInputF.open(argv[1]) == false) {
             printf("Specified file '%s' does not exist\n", argv[1]);
             return -1;
         } else {
+            {
+                const auto view = waveformInputF.getView();
+
+                cacheKey.recordingHash = calcRecordingHash(argv[1], view);
+                cacheKey.filterId = filterId;
+                cacheKey.freqCutoff_Hz = freqCutoff_Hz;
+                cacheKey.keyPressWidth_samples = kKeyWidth_samples;
+                cacheKey.alignWindow_samples = kKeyAlign_samples;
+                cacheKey.offsetFromPeak_samples = kKeyWidth_samples - kKeyOffset_samples;
+                cacheKey.ccMethod = ccMethod;
+                cacheKey.extraHash = calcDetectionHash(kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset,
+                                                       kFindKeysRemoveLowPower, kRemoveLowSimilarityThreshold);
+
+                fnameCache = getAnalysisCachePath(argv[1], cacheKey);
+                if (useCache && loadAnalysisCache(fnameCache, cacheKey, cache)) {
+                    printf("[+] Using the cached analysis from '%s'\n", fnameCache.c_str());
+                    freqCutoff_Hz = cache.freqCutoff_Hz;
+                    isCached = true;
+                }
+            }
+
             if (freqCutoff_Hz == 0) {
                 const auto tStart = std::chrono::high_resolution_clock::now();
 
-                freqCutoff_Hz = Cipher::findBestCutoffFreq(waveformInputF, (EAudioFilter) filterId, kSampleRate, 100.0f, 1000.0f, 100.0f);
+                freqCutoff_Hz = Cipher::findBestCutoffFreq(waveformInputF.getView(), (EAudioFilter) filterId, kSampleRate, 100.0f, 1000.0f, 100.0f);
 
                 const auto tEnd = std::chrono::high_resolution_clock::now();
                 printf("[+] Found best freqCutoff = %d Hz, took %4.3f seconds\n", freqCutoff_Hz, toSeconds(tStart, tEnd));
             }
 
-            printf("[+] Filtering waveform with filter type = %d and cutoff frequency = %d Hz\n", filterId, freqCutoff_Hz);
-            ::filter(waveformInputF, (EAudioFilter) filterId, freqCutoff_Hz, kSampleRate);
-
-            printf("[+] Converting waveform to i16 format ...\n");
-            if (convert(waveformInputF, waveformInput) == false) {
+            printf("[+] Filtering waveform with filter type = %d and cutoff frequency = %d Hz and converting to i16 format ...\n", filterId, freqCutoff_Hz);
+            if (filterAndConvert(waveformInputF.getView(), (EAudioFilter) filterId, freqCutoff_Hz, kSampleRate, waveformInput) == false) {
                 printf("Conversion failed\n");
                 return -4;
             }
@@ -93,41 +154,51 @@ int main(int argc, char ** argv) {
     printf("    Recording length:        %g seconds\n", (float)(waveformInput.size())/sampleRate);
 
     TKeyPressCollection keyPresses;
-    {
-        const auto tStart = std::chrono::high_resolution_clock::now();
+    TSimilarityMap similarityMap;
 
-        printf("[+] Searching for key presses\n");
+    if (isCached) {
+        setKeyPositions(cache.positions, getView(waveformInput, 0), keyPresses);
+        similarityMap = std::move(cache.similarityMap);
 
-        TWaveform waveformMax;
-        TWaveform waveformThreshold;
-        if (findKeyPresses(getView(waveformInput, 0), keyPresses, waveformThreshold, waveformMax,
-                           kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset, kFindKeysRemoveLowPower) == false) {
-            printf("Failed to detect keypresses\n");
-            return -2;
-        }
+        printf("[+] Loaded %d key presses and their similarity map\n", (int) keyPresses.size());
+    } else {
+        {
+            const auto tStart = std::chrono::high_resolution_clock::now();
 
-        const auto tEnd = std::chrono::high_resolution_clock::now();
+            printf("[+] Searching for key presses\n");
 
-        printf("[+] Detected a total of %d potential key presses\n", (int) keyPresses.size());
-        printf("[+] Search took %4.3f seconds\n", toSeconds(tStart, tEnd));
-    }
+            if (findKeyPresses(getView(waveformInput, 0), keyPresses,
+                               kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset, kFindKeysRemoveLowPower) == false) {
+                printf("Failed to detect keypresses\n");
+                return -2;
+            }
 
-    int n = keyPresses.size();
+            const auto tEnd = std::chrono::high_resolution_clock::now();
 
-    TSimilarityMap similarityMap;
-    {
-        const auto tStart = std::chrono::high_resolution_clock::now();
+            printf("[+] Detected a total of %d potential key presses\n", (int) keyPresses.size());
+            printf("[+] Search took %4.3f seconds\n", toSeconds(tStart, tEnd));
+        }
 
-        printf("[+] Calculating CC similarity map\n");
+        {
+            const auto tStart = std::chrono::high_resolution_clock::now();
 
-        if (calculateSimilartyMap(kKeyWidth_samples, kKeyAlign_samples, kKeyWidth_samples - kKeyOffset_samples, keyPresses, similarityMap) == false) {
-            printf("Failed to calculate similariy map\n");
-            return -3;
-        }
+            printf("[+] Calculating CC similarity map\n");
 
-        const auto tEnd = std::chrono::high_resolution_clock::now();
+            if (calculateSimilartyMap(kKeyWidth_samples, kKeyAlign_samples, kKeyWidth_samples - kKeyOffset_samples, keyPresses, similarityMap, (ECCMethod) ccMethod) == false) {
+                printf("Failed to calculate similariy map\n");
+                return -3;
+            }
+
+            const auto tEnd = std::chrono::high_resolution_clock::now();
+
+            printf("[+] Calculation took %4.3f seconds\n", toSeconds(tStart, tEnd));
 
-        printf("[+] Calculation took %4.3f seconds\n", toSeconds(tStart, tEnd));
+            if (ccMethod == ECCMethod::CoarseToFine) {
+                const int64_t nPairs = 10000;
+                const auto rate = calcCoarseToFineMismatchRate(kKeyWidth_samples, kKeyAlign_samples, kKeyWidth_samples - kKeyOffset_samples, keyPresses, nPairs);
+                printf("[+] Coarse-to-fine offset differs from the exhaustive search for %5.2f%% of %d sampled pairs\n", 100.0*rate, (int) nPairs);
+            }
+        }
 
         {
             const auto tStart = std::chrono::high_resolution_clock::now();
@@ -136,7 +207,7 @@ int main(int argc, char ** argv) {
 
             const int n0 = keyPresses.size();
 
-            if (removeLowSimilarityKeys(keyPresses, similarityMap, 0.3f) == false) {
+            if (removeLowSimilarityKeys(keyPresses, similarityMap, kRemoveLowSimilarityThreshold) == false) {
                 printf("Failed to remove low-similarity keys\n");
                 return -4;
             }
@@ -148,8 +219,19 @@ int main(int argc, char ** argv) {
             printf("[+] Removed %d low-similarity keys, took %4.3f seconds\n", n0 - n1, toSeconds(tStart, tEnd));
         }
 
-        n = keyPresses.size();
+        if (useCache) {
+            cache.freqCutoff_Hz = freqCutoff_Hz;
+            getKeyPositions(keyPresses, cache.positions);
+            cache.similarityMap = similarityMap;
 
+            if (saveAnalysisCache(fnameCache, cacheKey, cache)) {
+                printf("[+] Saved the analysis to '%s'\n", fnameCache.c_str());
+            }
+        }
+    }
+
+    const int n = keyPresses.size();
+    {
         const int ncc = std::min(32, n);
         for (int j = 0; j < ncc; ++j) {
             printf("%2d: ", j);
@@ -209,27 +291,16 @@ int main(int argc, char ** argv) {
         params.hint.resize(n, -1);
 
         // beam search
-        int nThread = std::min((int) std::thread::hardware_concurrency(), (int) clusterings.size());
         {
-            std::vector<std::thread> workers(nThread);
-
             std::mutex mutexPrint;
-            for (int i = 0; i < nThread; ++i) {
-                workers[i] = std::thread([&, i]() {
-                    for (int j = i; j < (int) clusterings.size(); j += nThread) {
-                        Cipher::beamSearch(params, freqMap6, clusterings[j]);
-                        mutexPrint.lock();
-                        printf(" ");
-                        Cipher::printDecoded(clusterings[j].clusters, clusterings[j].clMap, params.hint);
-                        printf(" [%8.3f %8.3f]\n", clusterings[j].p, clusterings[j].pClusters);
-                        mutexPrint.unlock();
-                    }
-                });
-            }
-
-            for (auto& worker : workers) {
-                worker.join();
-            }
+            ThreadPool::getShared().parallelFor(clusterings.size(), [&](int64_t j) {
+                Cipher::beamSearch(params, freqMap6, clusterings[j]);
+                mutexPrint.lock();
+                printf(" ");
+                Cipher::printDecoded(clusterings[j].clusters, clusterings[j].clMap, params.hint);
+                printf(" [%8.3f %8.3f]\n", clusterings[j].p, clusterings[j].pClusters);
+                mutexPrint.unlock();
+            });
         }
     }
 
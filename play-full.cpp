@@ -5,28 +5,39 @@
 
 #include "constants.h"
 #include "common.h"
+#include "recording.h"
 
 #include <SDL.h>
 #include <SDL_audio.h>
 
-#include <fstream>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
 
-bool g_terminate = false;
+std::atomic_bool g_terminate = false;
+
+struct Playback {
+    RecordingReader reader;
+    int64_t pos = 0;
+};
 
 void cbPlayback(void * userdata, uint8_t * stream, int len) {
-    std::ifstream * fin = (std::ifstream *)(userdata);
-    if (fin->eof()) {
+    auto & playback = *(Playback *)(userdata);
+
+    const int64_t n = len/sizeof(TSampleF);
+    const int64_t nRead = std::max(int64_t(0), std::min(n, playback.reader.getInfo().nSamples - playback.pos));
+
+    std::memset(stream, 0, len);
+    if (playback.reader.read(playback.pos, nRead, (TSampleF *)(stream)) == false || nRead < n) {
         g_terminate = true;
-        return;
     }
-    fflush(stdout);
-    fin->read((char *)(stream), len); // todo
-    if (fin->eof()) g_terminate = true;
+    playback.pos += nRead;
 }
 
 int main(int argc, char ** argv) {
-    printf("Usage: %s input.kbd [-pN]\n", argv[0]);
+    printf("Usage: %s input.kbd [-pN] [-sN]\n", argv[0]);
     printf("    -pN - select playback device N\n");
+    printf("    -sN - start playback N seconds into the recording\n");
     printf("\n");
 
     if (argc < 2) {
@@ -35,13 +46,20 @@ int main(int argc, char ** argv) {
 
     auto argm = parseCmdArguments(argc, argv);
     int playbackId = argm["p"].empty() ? 0 : std::stoi(argm["p"]);
+    float start_s = argm["s"].empty() ? 0.0f : std::stof(argm["s"]);
 
-    std::ifstream fin(argv[1], std::ios::binary);
-    if (fin.good() == false) {
+    Playback playback;
+    if (playback.reader.open(argv[1]) == false) {
         fprintf(stderr, "Failed to open file '%s'\n", argv[1]);
         return -1;
     }
 
+    const auto & info = playback.reader.getInfo();
+    printf("Recording: %g seconds at %d Hz, %s\n", float(info.nSamples)/info.sampleRate, (int) info.sampleRate,
+           info.isLegacy ? "raw float32" : info.sampleType == RecordingInfo::I16 ? "int16" : "float32");
+
+    playback.pos = std::max(int64_t(0), std::min(info.nSamples, int64_t(start_s*info.sampleRate)));
+
     if (SDL_Init(SDL_INIT_AUDIO) < 0) {
         SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Couldn't initialize SDL: %s\n", SDL_GetError());
         return -1;
@@ -56,12 +74,12 @@ int main(int argc, char ** argv) {
     SDL_AudioSpec playbackSpec;
     SDL_zero(playbackSpec);
 
-    playbackSpec.freq = kSampleRate;
+    playbackSpec.freq = info.sampleRate;
     playbackSpec.format = AUDIO_F32SYS;
     playbackSpec.channels = 1;
     playbackSpec.samples = kSamplesPerFrame;
     playbackSpec.callback = cbPlayback;
-    playbackSpec.userdata = (void *)(&fin);
+    playbackSpec.userdata = (void *)(&playback);
 
     SDL_AudioSpec obtainedSpec;
     SDL_zero(obtainedSpec);
@@ -74,7 +92,7 @@ int main(int argc, char ** argv) {
         return -2;
     }
 
-    int sampleSize_bytes = 4; // todo
+    int sampleSize_bytes = sizeof(TSampleF);
 
     printf("Opened playback device succesfully!\n");
     printf("    Frequency:  %d\n", obtainedSpec.freq);
@@ -88,9 +106,7 @@ int main(int argc, char ** argv) {
         SDL_Delay(100);
     }
 
-    fin.close();
-
-    SDL_CloseAudio();
+    SDL_CloseAudioDevice(deviceIdOut);
 
     return 0;
 }
@@ -6,17 +6,27 @@
 #include "constants.h"
 #include "common.h"
 #include "audio-logger.h"
+#include "recording.h"
 
-#include <fstream>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <csignal>
 
-bool g_terminate = false;
+std::atomic_bool g_terminate = false;
+
+void signalHandler(int) {
+    g_terminate = true;
+}
 
 int main(int argc, char ** argv) {
-    printf("Usage: %s output.kbd [-cN]\n", argv[0]);
+    printf("Usage: %s output.kbd [-cN] [-CN] [-i] [-z] [-tN] [-mN]\n", argv[0]);
     printf("    -cN - select capture device N\n");
     printf("    -CN - number N of capture channels N\n");
+    printf("    -i  - store 16-bit samples instead of 32-bit float\n");
+    printf("    -z  - store 16-bit samples, losslessly compressed\n");
+    printf("    -tN - start a new output-NNNN.kbd file every N seconds\n");
+    printf("    -mN - start a new output-NNNN.kbd file every N MB\n");
     printf("\n");
 
     if (argc < 2) {
@@ -26,14 +36,27 @@ int main(int argc, char ** argv) {
     auto argm = parseCmdArguments(argc, argv);
     int captureId = argm["c"].empty() ? 0 : std::stoi(argm["c"]);
     int nChannels = argm["C"].empty() ? 0 : std::stoi(argm["C"]);
+    bool compress = argm.count("z") > 0;
+    bool storeI16 = argm.count("i") > 0 || compress;
+    float segmentLength_s = argm["t"].empty() ? 0.0f : std::stof(argm["t"]);
+    float segmentSize_MB = argm["m"].empty() ? 0.0f : std::stof(argm["m"]);
 
-    bool doRecord = true;
-    size_t totalSize_bytes = 0;
+    std::atomic_bool doRecord = true;
 
-    std::ofstream fout(argv[1], std::ios::binary);
-    if (fout.good() == false) {
-        fprintf(stderr, "Failed to open file '%s'\n", argv[1]);
-        return -1;
+    // the capture callback only copies the frames - the disk is written from a separate thread
+    RecordingWriterAsync writer;
+    {
+        RecordingWriterAsync::Parameters parameters;
+        parameters.writer.sampleType = storeI16 ? RecordingInfo::I16 : RecordingInfo::F32;
+        parameters.writer.sampleRate = kSampleRate;
+        parameters.writer.compress = compress;
+        parameters.segmentLength_s = segmentLength_s;
+        parameters.segmentSize_bytes = segmentSize_MB*1024*1024;
+
+        if (writer.open(argv[1], std::move(parameters)) == false) {
+            fprintf(stderr, "Failed to open file '%s'\n", argv[1]);
+            return -1;
+        }
     }
 
     AudioLogger audioLogger;
@@ -41,12 +64,8 @@ int main(int argc, char ** argv) {
         doRecord = true;
 
         for (const auto & frame : frames) {
-            totalSize_bytes += sizeof(frame[0])*frame.size();
-            fout.write((char *)(frame.data()), sizeof(frame[0])*frame.size());
-            fout.flush();
+            writer.write(frame.data(), frame.size());
         }
-
-        printf("Total data saved: %g MB\n", ((float)(totalSize_bytes)/1024.0f/1024.0f));
     };
 
     AudioLogger::Parameters parameters;
@@ -62,14 +81,44 @@ int main(int argc, char ** argv) {
         return -1;
     }
 
-    while (true) {
+    std::signal(SIGINT, signalHandler);
+    std::signal(SIGTERM, signalHandler);
+
+    auto printStats = [&]() {
+        const auto stats = writer.getStats();
+        printf("Total data saved: %g MB in %d file(s), dropped frames: %d\n",
+               ((float)(stats.totalSize_bytes)/1024.0f/1024.0f), (int) stats.nSegments, (int) stats.nDroppedWrites);
+    };
+
+    auto tLastStats = std::chrono::high_resolution_clock::now();
+
+    while (g_terminate == false) {
         if (doRecord) {
             doRecord = false;
             audioLogger.record(0.5f, 0);
         } else {
             std::this_thread::sleep_for(std::chrono::milliseconds(1));
         }
+
+        const auto tNow = std::chrono::high_resolution_clock::now();
+        if (toSeconds(tLastStats, tNow) >= 5.0f) {
+            printStats();
+            tLastStats = tNow;
+        }
+    }
+
+    audioLogger.terminate();
+
+    // writes the rest of the buffered audio and the index - without it the reader has to walk the chunks
+    const bool isOk = writer.close();
+    printStats();
+
+    if (isOk == false) {
+        fprintf(stderr, "Failed to finalize '%s'\n", argv[1]);
+        return -2;
     }
 
+    printf("Saved %g seconds of audio\n", float(writer.getStats().nWritten_samples)/kSampleRate);
+
     return 0;
 }
@@ -0,0 +1,1398 @@
+/*! \file recording.cpp
+ *  \brief Chunked recording container
+ *  \author Georgi Gerganov
+ */
+
+#include "recording.h"
+#include "thread-pool.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define KBD_AUDIO_FSYNC
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    // 8 bytes that a legacy float32 recording will not start with - as floats they are ~1e9
+    constexpr char kMagic[8] = { 'K', 'B', 'D', 'A', 'U', 'D', 'I', 'O' };
+    constexpr char kMagicChunk[4] = { 'K', 'B', 'D', 'c' };
+
+    constexpr uint32_t kVersion = 1;
+
+    constexpr uint32_t kFlagStats = 1 << 0;
+
+    // chunk size used to read legacy recordings
+    constexpr int64_t kLegacyChunkSize_samples = 1 << 16;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t sampleType;
+        uint32_t sampleRate;
+        uint32_t nChannels;
+        uint32_t chunkSize_samples;
+        uint32_t flags;
+        int64_t nSamples;    // written on close
+        int64_t nChunks;     // written on close
+        int64_t indexOffset; // written on close, 0 while the file is being recorded
+        uint8_t reserved[8];
+    };
+
+    struct ChunkHeader {
+        char magic[4];
+        uint32_t nSamples;
+        uint32_t nBytes;   // payload size
+        uint32_t encoding; // kEncodingRaw or kEncodingLPCRice
+        float absMax;
+        float rms;
+    };
+
+    struct IndexEntry {
+        int64_t offset; // of the chunk header
+        ChunkHeader header;
+    };
+
+    static_assert(sizeof(FileHeader) == 64, "Unexpected FileHeader layout");
+    static_assert(sizeof(ChunkHeader) == 24, "Unexpected ChunkHeader layout");
+    static_assert(sizeof(IndexEntry) == 32, "Unexpected IndexEntry layout");
+
+    int64_t getSampleSize_bytes(RecordingInfo::ESampleType sampleType) {
+        switch (sampleType) {
+            case RecordingInfo::F32: return sizeof(TSampleF);
+            case RecordingInfo::I16: return sizeof(TSampleI16);
+        }
+        return 0;
+    }
+
+    // i16 payloads store round(kI16Scale*x)
+    constexpr float kI16Scale = 32768.0f;
+
+    constexpr uint32_t kEncodingRaw = 0;      // the samples as they are
+    constexpr uint32_t kEncodingLPCRice = 1;  // i16 only - see encodeLPCRice()
+
+    // chunks decoded at once by a multi-chunk read
+    constexpr int64_t kDecodeBatch_chunks = 64;
+
+    //
+    // Lossless chunk coding - linear prediction of the i16 samples, Rice coding of the residuals
+    //
+    // payload:
+    //   u8              predictor - order of a fixed polynomial predictor, or kPredictorLPC | order
+    //   u8, i16[order]  LPC only - coefficient shift and quantized coefficients
+    //   i16[order]      warm-up samples
+    //   bits            per partition of the residuals: 5-bit Rice parameter k, then each zigzag-mapped residual
+    //                   u as (u >> k) in unary followed by the low k bits of u. Unary prefixes of kRiceEscape
+    //                   zeros are followed by the raw 32-bit u instead.
+    //
+
+    constexpr int kMaxFixedOrder = 4;
+    constexpr int kMaxLPCOrder = 16;
+    constexpr int kPredictorLPC = 0x80;
+    constexpr int kLPCPrecision = 14; // bits of the quantized coefficients, sign included
+    constexpr int kRiceEscape = 24;
+    constexpr int kMaxRiceParameter = 30;
+    constexpr int64_t kRicePartition_samples = 256;
+
+    struct BitWriter {
+        std::vector<uint8_t> & out;
+
+        uint64_t acc = 0;
+        int nAcc = 0;
+
+        void put(uint32_t v, int nBits) {
+            acc = (acc << nBits) | (v & ((uint64_t(1) << nBits) - 1));
+            nAcc += nBits;
+            while (nAcc >= 8) {
+                nAcc -= 8;
+                out.push_back(acc >> nAcc);
+            }
+        }
+
+        void flush() {
+            if (nAcc > 0) {
+                put(0, 8 - nAcc);
+            }
+        }
+    };
+
+    struct BitReader {
+        const uint8_t * data;
+        int64_t n;
+
+        int64_t pos = 0;
+        uint64_t acc = 0;
+        int nAcc = 0;
+
+        bool get(int nBits, uint32_t & v) {
+            while (nAcc < nBits) {
+                if (pos >= n) return false;
+                acc = (acc << 8) | data[pos++];
+                nAcc += 8;
+            }
+            nAcc -= nBits;
+            v = (acc >> nAcc) & ((uint64_t(1) << nBits) - 1);
+            return true;
+        }
+
+        bool getRice(int k, uint32_t & u) {
+            int q = 0;
+            while (true) {
+                if (nAcc == 0) {
+                    if (pos >= n) return false;
+                    acc = (acc << 8) | data[pos++];
+                    nAcc = 8;
+                }
+                --nAcc;
+                if ((acc >> nAcc) & 1) break;
+                if (++q == kRiceEscape) return get(32, u);
+            }
+
+            uint32_t low = 0;
+            if (k > 0 && get(k, low) == false) return false;
+            u = (uint32_t(q) << k) | low;
+
+            return true;
+        }
+    };
+
+    inline uint32_t zigzag(int32_t r) { return (uint32_t(r) << 1) ^ uint32_t(r >> 31); }
+    inline int32_t unzigzag(uint32_t u) { return int32_t(u >> 1) ^ -int32_t(u & 1); }
+
+    // bits used by Rice coding u[0..n) with parameter k
+    int64_t getRiceCost(const uint32_t * u, int64_t n, int k) {
+        int64_t res = 0;
+        for (int64_t i = 0; i < n; ++i) {
+            const uint32_t q = u[i] >> k;
+            res += q < kRiceEscape ? q + 1 + k : kRiceEscape + 32;
+        }
+        return res;
+    }
+
+    // best Rice parameter for one partition - the exact cost of the parameters around the estimate from the mean
+    int getRiceParameter(const uint32_t * u, int64_t n, int64_t & cost) {
+        uint64_t sum = 0;
+        for (int64_t i = 0; i < n; ++i) sum += u[i];
+
+        int k0 = 0;
+        while (k0 < kMaxRiceParameter && (uint64_t(n) << (k0 + 1)) < sum) ++k0;
+
+        int res = k0;
+        cost = getRiceCost(u, n, k0);
+        for (int k = std::max(0, k0 - 1); k <= std::min(kMaxRiceParameter, k0 + 1); ++k) {
+            if (k == k0) continue;
+            const int64_t c = getRiceCost(u, n, k);
+            if (c < cost) {
+                cost = c;
+                res = k;
+            }
+        }
+
+        return res;
+    }
+
+    // zigzag-mapped residuals of x[order..n) - false if some residual does not fit in 31 bits
+    bool calcResiduals(const TSampleI16 * x, int64_t n, int predictor, int shift, const int32_t * coeffs, uint32_t * u) {
+        const int order = predictor & ~kPredictorLPC;
+        for (int64_t i = order; i < n; ++i) {
+            int64_t r = 0;
+            if (predictor & kPredictorLPC) {
+                int64_t sum = 0;
+                for (int j = 0; j < order; ++j) sum += int64_t(coeffs[j])*x[i - 1 - j];
+                r = x[i] - (sum >> shift);
+            } else {
+                switch (order) {
+                    case 0: r = x[i]; break;
+                    case 1: r = x[i] - x[i - 1]; break;
+                    case 2: r = x[i] - 2*x[i - 1] + x[i - 2]; break;
+                    case 3: r = x[i] - 3*x[i - 1] + 3*x[i - 2] - x[i - 3]; break;
+                    case 4: r = x[i] - 4*x[i - 1] + 6*x[i - 2] - 4*x[i - 3] + x[i - 4]; break;
+                }
+            }
+            if (r < -(int64_t(1) << 30) || r >= (int64_t(1) << 30)) {
+                return false;
+            }
+            u[i] = zigzag(r);
+        }
+        return true;
+    }
+
+    // Levinson-Durbin on the autocorrelation of the Welch-windowed chunk - lpc[order - 1][j] are the coefficients
+    // of the predictor of each order
+    void calcLPC(const TSampleI16 * x, int64_t n, int maxOrder, double lpc[kMaxLPCOrder][kMaxLPCOrder]) {
+        std::vector<double> w(n);
+        for (int64_t i = 0; i < n; ++i) {
+            const double t = (2.0*i - (n - 1))/(n + 1);
+            w[i] = x[i]*(1.0 - t*t);
+        }
+
+        double r[kMaxLPCOrder + 1];
+        for (int l = 0; l <= maxOrder; ++l) {
+            double sum = 0.0;
+            for (int64_t i = l; i < n; ++i) sum += w[i]*w[i - l];
+            r[l] = sum;
+        }
+        r[0] *= 1.0 + 1e-9; // keeps the recursion stable for constant or silent chunks
+
+        double a[kMaxLPCOrder] = { 0.0 };
+        double err = r[0];
+        for (int m = 0; m < maxOrder; ++m) {
+            if (err <= 0.0) {
+                for (int j = m; j < maxOrder; ++j) std::copy(a, a + kMaxLPCOrder, lpc[j]);
+                return;
+            }
+
+            double acc = r[m + 1];
+            for (int j = 0; j < m; ++j) acc -= a[j]*r[m - j];
+            const double k = acc/err;
+
+            double prev[kMaxLPCOrder];
+            std::copy(a, a + m, prev);
+            a[m] = k;
+            for (int j = 0; j < m; ++j) a[j] = prev[j] - k*prev[m - 1 - j];
+
+            err *= 1.0 - k*k;
+            std::copy(a, a + kMaxLPCOrder, lpc[m]);
+        }
+    }
+
+    // the coefficients as integers with kLPCPrecision bits, scaled by 2^shift
+    int quantizeLPC(const double * lpc, int order, int32_t * coeffs) {
+        constexpr int32_t kMax = (1 << (kLPCPrecision - 1)) - 1;
+
+        double cmax = 0.0;
+        for (int j = 0; j < order; ++j) cmax = std::max(cmax, std::abs(lpc[j]));
+
+        int shift = 0;
+        if (cmax > 0.0) {
+            int e = 0;
+            std::frexp(cmax, &e);
+            shift = std::max(0, std::min(15, kLPCPrecision - 1 - e));
+        }
+
+        // error feedback, so that the rounding errors do not accumulate
+        double err = 0.0;
+        for (int j = 0; j < order; ++j) {
+            err += lpc[j]*(1 << shift);
+            const int32_t q = std::max(-kMax, std::min(kMax, (int32_t) std::lround(err)));
+            coeffs[j] = q;
+            err -= q;
+        }
+
+        return shift;
+    }
+
+    bool encodeLPCRice(const TSampleI16 * x, int64_t n, std::vector<uint8_t> & res) {
+        std::vector<uint32_t> u(n);
+        std::vector<uint32_t> uBest(n);
+
+        int64_t costBest = std::numeric_limits<int64_t>::max();
+        int predictorBest = -1;
+        int shiftBest = 0;
+        int32_t coeffsBest[kMaxLPCOrder] = { 0 };
+
+        const auto evaluate = [&](int predictor, int shift, const int32_t * coeffs) {
+            const int order = predictor & ~kPredictorLPC;
+            if (order > n || calcResiduals(x, n, predictor, shift, coeffs, u.data()) == false) {
+                return;
+            }
+
+            int64_t cost = 8 + 16*order + ((predictor & kPredictorLPC) ? 8 + 16*order : 0);
+            for (int64_t i0 = order; i0 < n && cost < costBest; i0 += kRicePartition_samples) {
+                int64_t c = 0;
+                getRiceParameter(u.data() + i0, std::min(kRicePartition_samples, n - i0), c);
+                cost += 5 + c;
+            }
+
+            if (cost < costBest) {
+                costBest = cost;
+                predictorBest = predictor;
+                shiftBest = shift;
+                if (predictor & kPredictorLPC) std::copy(coeffs, coeffs + order, coeffsBest);
+                std::swap(u, uBest);
+            }
+        };
+
+        for (int order = 0; order <= kMaxFixedOrder; ++order) {
+            evaluate(order, 0, nullptr);
+        }
+
+        const int maxOrder = std::min<int64_t>(kMaxLPCOrder, n - 1);
+        if (maxOrder > 0) {
+            double lpc[kMaxLPCOrder][kMaxLPCOrder];
+            calcLPC(x, n, maxOrder, lpc);
+
+            for (int order = 4; order <= maxOrder; order *= 2) {
+                int32_t coeffs[kMaxLPCOrder];
+                const int shift = quantizeLPC(lpc[order - 1], order, coeffs);
+                evaluate(kPredictorLPC | order, shift, coeffs);
+            }
+        }
+
+        if (predictorBest < 0) {
+            return false;
+        }
+
+        const int order = predictorBest & ~kPredictorLPC;
+
+        res.clear();
+        res.reserve(costBest/8 + 8);
+
+        BitWriter writer { res };
+        writer.put(predictorBest, 8);
+        if (predictorBest & kPredictorLPC) {
+            writer.put(shiftBest, 8);
+            for (int j = 0; j < order; ++j) writer.put(coeffsBest[j], 16);
+        }
+        for (int j = 0; j < order; ++j) writer.put(x[j], 16);
+
+        for (int64_t i0 = order; i0 < n; i0 += kRicePartition_samples) {
+            const int64_t nPart = std::min(kRicePartition_samples, n - i0);
+
+            int64_t cost = 0;
+            const int k = getRiceParameter(uBest.data() + i0, nPart, cost);
+            writer.put(k, 5);
+
+            for (int64_t i = i0; i < i0 + nPart; ++i) {
+                const uint32_t q = uBest[i] >> k;
+                if (q < kRiceEscape) {
+                    // q zeros and a one
+                    for (uint32_t z = q; z > 0; ) { const int m = std::min<uint32_t>(z, 32); writer.put(0, m); z -= m; }
+                    writer.put(1, 1);
+                    if (k > 0) writer.put(uBest[i], k);
+                } else {
+                    writer.put(0, kRiceEscape);
+                    writer.put(uBest[i], 32);
+                }
+            }
+        }
+        writer.flush();
+
+        return true;
+    }
+
+    bool decodeLPCRice(const uint8_t * payload, int64_t nBytes, int64_t n, TSampleI16 * x) {
+        BitReader reader { payload, nBytes };
+
+        uint32_t v = 0;
+        if (reader.get(8, v) == false) return false;
+
+        const int predictor = v;
+        const int order = predictor & ~kPredictorLPC;
+        if (order > n || ((predictor & kPredictorLPC) ? order > kMaxLPCOrder : order > kMaxFixedOrder)) {
+            return false;
+        }
+
+        int shift = 0;
+        int32_t coeffs[kMaxLPCOrder] = { 0 };
+        if (predictor & kPredictorLPC) {
+            if (reader.get(8, v) == false || v > 15) return false;
+            shift = v;
+            for (int j = 0; j < order; ++j) {
+                if (reader.get(16, v) == false) return false;
+                coeffs[j] = (int16_t) v;
+            }
+        }
+
+        for (int j = 0; j < order; ++j) {
+            if (reader.get(16, v) == false) return false;
+            x[j] = (int16_t) v;
+        }
+
+        for (int64_t i0 = order; i0 < n; i0 += kRicePartition_samples) {
+            const int64_t nPart = std::min(kRicePartition_samples, n - i0);
+
+            uint32_t k = 0;
+            if (reader.get(5, k) == false || k > kMaxRiceParameter) return false;
+
+            for (int64_t i = i0; i < i0 + nPart; ++i) {
+                uint32_t u = 0;
+                if (reader.getRice(k, u) == false) return false;
+                const int64_t r = unzigzag(u);
+
+                int64_t pred = 0;
+                if (predictor & kPredictorLPC) {
+                    int64_t sum = 0;
+                    for (int j = 0; j < order; ++j) sum += int64_t(coeffs[j])*x[i - 1 - j];
+                    pred = sum >> shift;
+                } else {
+                    switch (order) {
+                        case 0: pred = 0; break;
+                        case 1: pred = x[i - 1]; break;
+                        case 2: pred = 2*x[i - 1] - x[i - 2]; break;
+                        case 3: pred = 3*x[i - 1] - 3*x[i - 2] + x[i - 3]; break;
+                        case 4: pred = 4*x[i - 1] - 6*x[i - 2] + 4*x[i - 3] - x[i - 4]; break;
+                    }
+                }
+
+                const int64_t s = pred + r;
+                if (s < std::numeric_limits<TSampleI16>::min() || s > std::numeric_limits<TSampleI16>::max()) {
+                    return false;
+                }
+                x[i] = s;
+            }
+        }
+
+        return true;
+    }
+}
+
+//
+// RecordingWriter
+//
+
+struct RecordingWriter::Data {
+    Parameters parameters;
+
+    std::string fname;
+    std::ofstream fout;
+
+    std::vector<TSampleF> pending;
+    std::vector<char> payload;
+    std::vector<uint8_t> encoded;
+    std::vector<IndexEntry> index;
+
+    int64_t nSamples = 0;
+    int64_t totalSize_bytes = 0;
+};
+
+RecordingWriter::RecordingWriter() : data_(new Data()) {}
+
+RecordingWriter::~RecordingWriter() {
+    close();
+}
+
+namespace {
+    FileHeader makeHeader(const RecordingWriter::Parameters & parameters) {
+        FileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.sampleType = parameters.sampleType;
+        header.sampleRate = parameters.sampleRate;
+        header.nChannels = 1;
+        header.chunkSize_samples = parameters.chunkSize_samples;
+        header.flags = parameters.computeStats ? kFlagStats : 0;
+
+        return header;
+    }
+
+    // fsync() applies to the file and not to the descriptor, so the stream does not have to expose its own
+    bool syncFile(const std::string & fname) {
+#ifdef KBD_AUDIO_FSYNC
+        const int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        const bool res = ::fsync(fd) == 0;
+        ::close(fd);
+
+        return res;
+#else
+        // only flushed on these platforms
+        (void) fname;
+        return true;
+#endif
+    }
+}
+
+bool RecordingWriter::writeChunk(const TSampleF * samples, int64_t n) {
+    auto & data = getData();
+    auto & parameters = data.parameters;
+    auto & fout = data.fout;
+    auto & payload = data.payload;
+
+    IndexEntry entry;
+    entry.offset = fout.tellp();
+
+    auto & header = entry.header;
+    std::memcpy(header.magic, kMagicChunk, sizeof(kMagicChunk));
+    header.nSamples = n;
+    header.nBytes = n*getSampleSize_bytes(parameters.sampleType);
+    header.encoding = kEncodingRaw;
+    header.absMax = 0.0f;
+    header.rms = 0.0f;
+
+    payload.resize(header.nBytes);
+
+    // the statistics are computed on the values the reader will decode
+    float amax = 0.0f;
+    double sum2 = 0.0;
+    switch (parameters.sampleType) {
+        case RecordingInfo::F32:
+            {
+                std::memcpy(payload.data(), samples, header.nBytes);
+                if (parameters.computeStats) {
+                    for (int64_t i = 0; i < n; ++i) {
+                        amax = std::max(amax, std::abs(samples[i]));
+                        sum2 += double(samples[i])*samples[i];
+                    }
+                }
+            }
+            break;
+        case RecordingInfo::I16:
+            {
+                auto dst = (TSampleI16 *) payload.data();
+                for (int64_t i = 0; i < n; ++i) {
+                    const float v = std::round(kI16Scale*samples[i]);
+                    dst[i] = std::max(-32768.0f, std::min(32767.0f, v));
+                    if (parameters.computeStats) {
+                        const float x = dst[i]/kI16Scale;
+                        amax = std::max(amax, std::abs(x));
+                        sum2 += double(x)*x;
+                    }
+                }
+            }
+            break;
+    }
+
+    if (parameters.computeStats && n > 0) {
+        header.absMax = amax;
+        header.rms = std::sqrt(sum2/n);
+    }
+
+    const char * src = payload.data();
+
+    // chunks that do not compress are stored raw
+    if (parameters.compress && encodeLPCRice((const TSampleI16 *) payload.data(), n, data.encoded) &&
+        (int64_t) data.encoded.size() < (int64_t) header.nBytes) {
+        header.encoding = kEncodingLPCRice;
+        header.nBytes = data.encoded.size();
+        src = (const char *) data.encoded.data();
+    }
+
+    fout.write((const char *)(&header), sizeof(header));
+    fout.write(src, header.nBytes);
+
+    data.index.push_back(entry);
+    data.totalSize_bytes += sizeof(header) + header.nBytes;
+
+    return fout.good();
+}
+
+bool RecordingWriter::open(const std::string & fname, Parameters && parameters) {
+    close();
+
+    auto & data = getData();
+
+    const int64_t sampleSize_bytes = getSampleSize_bytes(parameters.sampleType);
+    if (sampleSize_bytes == 0) {
+        fprintf(stderr, "%s:%d: invalid sample type %d\n", __FILE__, __LINE__, (int) parameters.sampleType);
+        return false;
+    }
+
+    // the payload size of a chunk is stored in ChunkHeader::nBytes
+    if (parameters.chunkSize_samples <= 0 ||
+        parameters.chunkSize_samples > std::numeric_limits<uint32_t>::max()/sampleSize_bytes) {
+        fprintf(stderr, "%s:%d: invalid chunk size %lld\n", __FILE__, __LINE__, (long long) parameters.chunkSize_samples);
+        return false;
+    }
+
+    if (parameters.compress && parameters.sampleType != RecordingInfo::I16) {
+        fprintf(stderr, "%s:%d: compression requires i16 samples\n", __FILE__, __LINE__);
+        return false;
+    }
+
+    data.fout.open(fname, std::ios::binary);
+    if (data.fout.good() == false) {
+        return false;
+    }
+
+    data.parameters = std::move(parameters);
+    data.fname = fname;
+
+    const auto header = makeHeader(data.parameters);
+    data.fout.write((const char *)(&header), sizeof(header));
+
+    data.pending.reserve(data.parameters.chunkSize_samples);
+    data.nSamples = 0;
+    data.totalSize_bytes = sizeof(header);
+
+    return data.fout.good();
+}
+
+bool RecordingWriter::write(const TSampleF * samples, int64_t n) {
+    auto & data = getData();
+
+    if (data.fout.is_open() == false) {
+        return false;
+    }
+
+    const int64_t chunkSize = data.parameters.chunkSize_samples;
+
+    while (n > 0) {
+        if (data.pending.empty() && n >= chunkSize) {
+            // full chunks go straight from the input
+            if (writeChunk(samples, chunkSize) == false) {
+                return false;
+            }
+            samples += chunkSize;
+            n -= chunkSize;
+            data.nSamples += chunkSize;
+            continue;
+        }
+
+        const int64_t k = std::min(n, chunkSize - (int64_t) data.pending.size());
+        data.pending.insert(data.pending.end(), samples, samples + k);
+        samples += k;
+        n -= k;
+        data.nSamples += k;
+
+        if ((int64_t) data.pending.size() == chunkSize) {
+            if (writeChunk(data.pending.data(), chunkSize) == false) {
+                return false;
+            }
+            data.pending.clear();
+        }
+    }
+
+    return true;
+}
+
+bool RecordingWriter::flush() {
+    auto & data = getData();
+
+    if (data.fout.is_open() == false) {
+        return false;
+    }
+
+    data.fout.flush();
+
+    return data.fout.good();
+}
+
+bool RecordingWriter::close() {
+    auto & data = getData();
+
+    if (data.fout.is_open() == false) {
+        return false;
+    }
+
+    bool res = true;
+
+    if (data.pending.empty() == false) {
+        res = writeChunk(data.pending.data(), data.pending.size());
+        data.pending.clear();
+    }
+
+    const int64_t indexOffset = data.fout.tellp();
+    data.fout.write((const char *)(data.index.data()), data.index.size()*sizeof(IndexEntry));
+    data.totalSize_bytes += data.index.size()*sizeof(IndexEntry);
+
+    // patch the header last - until then, readers treat the file as not closed
+    auto header = makeHeader(data.parameters);
+    header.nSamples = data.nSamples;
+    header.nChunks = data.index.size();
+    header.indexOffset = indexOffset;
+
+    data.fout.seekp(0);
+    data.fout.write((const char *)(&header), sizeof(header));
+
+    res = res && data.fout.good();
+
+    data.fout.close();
+    data.index.clear();
+
+    return res;
+}
+
+int64_t RecordingWriter::getNSamples() const {
+    return getData().nSamples;
+}
+
+int64_t RecordingWriter::getTotalSize_bytes() const {
+    return getData().totalSize_bytes;
+}
+
+bool RecordingWriter::sync() {
+    if (flush() == false) {
+        return false;
+    }
+
+    return syncFile(getData().fname);
+}
+
+//
+// RecordingWriterAsync
+//
+
+struct RecordingWriterAsync::Data {
+    Parameters parameters;
+
+    std::string fname;
+    std::string fnameSegment;
+
+    RecordingWriter writer;
+
+    // size is a power of 2, the positions below grow monotonically and are masked on access
+    std::vector<TSampleF> ring;
+
+    std::atomic<int64_t> head { 0 }; // advanced by write()
+    std::atomic<int64_t> tail { 0 }; // advanced by the writer thread
+
+    std::atomic_bool stop { false };
+    std::atomic_bool failed { false };
+
+    std::atomic<int64_t> nWritten_samples { 0 };
+    std::atomic<int64_t> nDropped_samples { 0 };
+    std::atomic<int64_t> nDroppedWrites { 0 };
+    std::atomic<int64_t> nSegments { 0 };
+    std::atomic<int64_t> totalSize_bytes { 0 };
+
+    int64_t sizeClosed_bytes = 0; // of the finished segments
+
+    std::thread worker;
+};
+
+RecordingWriterAsync::RecordingWriterAsync() : data_(new Data()) {}
+
+RecordingWriterAsync::~RecordingWriterAsync() {
+    close();
+}
+
+std::string RecordingWriterAsync::getSegmentName(const std::string & fname, int64_t segmentId) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "-%04d", (int) segmentId);
+
+    // the extension is kept - a dot in a directory name does not start one
+    const auto posDot = fname.rfind('.');
+    const auto posSep = fname.find_last_of("/\\");
+    if (posDot == std::string::npos || (posSep != std::string::npos && posDot < posSep)) {
+        return fname + suffix;
+    }
+
+    return fname.substr(0, posDot) + suffix + fname.substr(posDot);
+}
+
+bool RecordingWriterAsync::nextSegment() {
+    auto & data = getData();
+
+    const int64_t segmentId = data.nSegments;
+    if (segmentId > 0) {
+        if (data.writer.close() == false) {
+            fprintf(stderr, "%s:%d: failed to finalize '%s'\n", __FILE__, __LINE__, data.fnameSegment.c_str());
+            return false;
+        }
+        syncFile(data.fnameSegment);
+
+        data.sizeClosed_bytes += data.writer.getTotalSize_bytes();
+    }
+
+    const auto & parameters = data.parameters;
+    const bool isSegmented = parameters.segmentSize_bytes > 0 || parameters.segmentLength_s > 0.0f;
+
+    data.fnameSegment = isSegmented ? getSegmentName(data.fname, segmentId) : data.fname;
+
+    auto parametersWriter = parameters.writer;
+    if (data.writer.open(data.fnameSegment, std::move(parametersWriter)) == false) {
+        fprintf(stderr, "%s:%d: failed to open '%s'\n", __FILE__, __LINE__, data.fnameSegment.c_str());
+        return false;
+    }
+
+    data.nSegments = segmentId + 1;
+    data.totalSize_bytes = data.sizeClosed_bytes + data.writer.getTotalSize_bytes();
+
+    return true;
+}
+
+bool RecordingWriterAsync::open(const std::string & fname, Parameters && parameters) {
+    close();
+
+    auto & data = getData();
+
+    if (parameters.ringSize_samples <= 0 || parameters.ringSize_samples > (int64_t(1) << 32)) {
+        fprintf(stderr, "%s:%d: invalid ring size %lld\n", __FILE__, __LINE__, (long long) parameters.ringSize_samples);
+        return false;
+    }
+
+    if (parameters.segmentLength_s > 0.0f && int64_t(parameters.segmentLength_s*parameters.writer.sampleRate) == 0) {
+        fprintf(stderr, "%s:%d: invalid segment length %g s\n", __FILE__, __LINE__, parameters.segmentLength_s);
+        return false;
+    }
+
+    int64_t ringSize = 1;
+    while (ringSize < parameters.ringSize_samples) ringSize *= 2;
+
+    data.parameters = std::move(parameters);
+    data.fname = fname;
+
+    data.head = 0;
+    data.tail = 0;
+    data.stop = false;
+    data.failed = false;
+    data.nWritten_samples = 0;
+    data.nDropped_samples = 0;
+    data.nDroppedWrites = 0;
+    data.nSegments = 0;
+    data.totalSize_bytes = 0;
+    data.sizeClosed_bytes = 0;
+
+    if (nextSegment() == false) {
+        return false;
+    }
+
+    // touch all pages now - the capture callback should not fault them in
+    data.ring.assign(ringSize, 0.0f);
+
+    data.worker = std::thread([this]() { worker(); });
+
+    return true;
+}
+
+bool RecordingWriterAsync::write(const TSampleF * samples, int64_t n) {
+    auto & data = getData();
+
+    if (data.ring.empty()) {
+        return false;
+    }
+
+    const int64_t ringSize = data.ring.size();
+    const int64_t head = data.head.load(std::memory_order_relaxed);
+    const int64_t tail = data.tail.load(std::memory_order_acquire);
+
+    if (data.failed || n > ringSize - (head - tail)) {
+        data.nDropped_samples.fetch_add(n, std::memory_order_relaxed);
+        data.nDroppedWrites.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    const int64_t i0 = head & (ringSize - 1);
+    const int64_t k = std::min(n, ringSize - i0);
+    std::memcpy(data.ring.data() + i0, samples, k*sizeof(TSampleF));
+    std::memcpy(data.ring.data(), samples + k, (n - k)*sizeof(TSampleF));
+
+    data.head.store(head + n, std::memory_order_release);
+
+    return true;
+}
+
+void RecordingWriterAsync::worker() {
+    auto & data = getData();
+    auto & writer = data.writer;
+
+    const auto & parameters = data.parameters;
+
+    const int64_t ringSize = data.ring.size();
+    const int64_t chunkSize = parameters.writer.chunkSize_samples;
+    const int64_t segmentSize_bytes = parameters.segmentSize_bytes;
+    const int64_t segmentLength_samples = parameters.segmentLength_s*parameters.writer.sampleRate;
+
+    auto tLastSync = std::chrono::high_resolution_clock::now();
+
+    int64_t tail = data.tail.load(std::memory_order_relaxed);
+    while (true) {
+        // the flag is read first - once it is set, the head does not move anymore
+        const bool stop = data.stop;
+        const int64_t head = data.head.load(std::memory_order_acquire);
+
+        // whole chunks only, so that every write goes straight to the file - the rest waits for more samples
+        int64_t n = head - tail;
+        if (stop == false) {
+            n -= n % chunkSize;
+        }
+
+        if (n == 0) {
+            if (stop) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        while (n > 0) {
+            int64_t k = std::min(n, ringSize - (tail & (ringSize - 1)));
+            if (segmentLength_samples > 0) {
+                k = std::min(k, segmentLength_samples - writer.getNSamples());
+            }
+
+            if (writer.write(data.ring.data() + (tail & (ringSize - 1)), k) == false) {
+                fprintf(stderr, "%s:%d: failed to write to '%s'\n", __FILE__, __LINE__, data.fnameSegment.c_str());
+                data.failed = true;
+                return;
+            }
+
+            tail += k;
+            n -= k;
+            data.tail.store(tail, std::memory_order_release);
+            data.nWritten_samples += k;
+
+            if ((segmentLength_samples > 0 && writer.getNSamples() >= segmentLength_samples) ||
+                (segmentSize_bytes > 0 && writer.getTotalSize_bytes() >= segmentSize_bytes)) {
+                if (nextSegment() == false) {
+                    data.failed = true;
+                    return;
+                }
+            }
+        }
+
+        data.totalSize_bytes = data.sizeClosed_bytes + writer.getTotalSize_bytes();
+
+        const auto tNow = std::chrono::high_resolution_clock::now();
+        if (parameters.syncInterval_s > 0.0f && toSeconds(tLastSync, tNow) >= parameters.syncInterval_s) {
+            writer.sync();
+            tLastSync = tNow;
+        }
+    }
+}
+
+bool RecordingWriterAsync::close() {
+    auto & data = getData();
+
+    if (data.worker.joinable() == false) {
+        return false;
+    }
+
+    data.stop = true;
+    data.worker.join();
+
+    bool res = data.failed == false;
+
+    // false if the last segment could not be opened
+    if (data.writer.close()) {
+        syncFile(data.fnameSegment);
+        data.sizeClosed_bytes += data.writer.getTotalSize_bytes();
+    } else {
+        res = false;
+    }
+
+    data.totalSize_bytes = data.sizeClosed_bytes;
+
+    data.ring.clear();
+    data.ring.shrink_to_fit();
+
+    return res;
+}
+
+RecordingWriterAsync::Stats RecordingWriterAsync::getStats() const {
+    const auto & data = getData();
+
+    Stats res;
+    res.nWritten_samples = data.nWritten_samples;
+    res.nDropped_samples = data.nDropped_samples;
+    res.nDroppedWrites = data.nDroppedWrites;
+    res.nSegments = data.nSegments;
+    res.totalSize_bytes = data.totalSize_bytes;
+    res.failed = data.failed;
+
+    return res;
+}
+
+//
+// RecordingReader
+//
+
+namespace {
+    struct ChunkInfo {
+        int64_t offset; // of the payload
+        int64_t nSamples;
+        int64_t nBytes;
+        uint32_t encoding;
+        float absMax;
+        float rms;
+    };
+
+    bool decodeChunk(const ChunkInfo & chunk, RecordingInfo::ESampleType sampleType, const char * payload,
+                     std::vector<TSampleI16> & work, TSampleF * res) {
+        switch (sampleType) {
+            case RecordingInfo::F32:
+                {
+                    std::memcpy(res, payload, chunk.nSamples*sizeof(TSampleF));
+                }
+                break;
+            case RecordingInfo::I16:
+                {
+                    const TSampleI16 * src = (const TSampleI16 *) payload;
+                    if (chunk.encoding == kEncodingLPCRice) {
+                        work.resize(chunk.nSamples);
+                        if (decodeLPCRice((const uint8_t *) payload, chunk.nBytes, chunk.nSamples, work.data()) == false) {
+                            return false;
+                        }
+                        src = work.data();
+                    }
+                    for (int64_t i = 0; i < chunk.nSamples; ++i) {
+                        res[i] = src[i]/kI16Scale;
+                    }
+                }
+                break;
+        }
+
+        return true;
+    }
+}
+
+struct RecordingReader::Data {
+    std::ifstream fin;
+
+    RecordingInfo info;
+    std::vector<ChunkInfo> chunks;
+
+    double amax = -1.0;
+
+    // the last decoded chunk - sequential reads of less than a chunk do not hit the file
+    int64_t cachedChunkId = -1;
+    std::vector<TSampleF> cached;
+    std::vector<char> payload;
+    std::vector<TSampleI16> work;
+
+    // payloads of a multi-chunk read
+    std::vector<std::vector<char>> batch;
+};
+
+RecordingReader::RecordingReader() : data_(new Data()) {}
+
+RecordingReader::~RecordingReader() {}
+
+bool RecordingReader::isContainer(const std::string & fname) {
+    std::ifstream fin(fname, std::ios::binary);
+    if (fin.good() == false) {
+        return false;
+    }
+
+    char magic[sizeof(kMagic)];
+    fin.read(magic, sizeof(magic));
+
+    return fin.gcount() == sizeof(magic) && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+namespace {
+    bool isValidChunk(const ChunkHeader & header, const RecordingInfo & info) {
+        if (std::memcmp(header.magic, kMagicChunk, sizeof(kMagicChunk)) != 0 ||
+            header.nSamples == 0 || header.nSamples > info.chunkSize_samples) {
+            return false;
+        }
+
+        const int64_t nBytesRaw = header.nSamples*getSampleSize_bytes(info.sampleType);
+        switch (header.encoding) {
+            case kEncodingRaw:      return header.nBytes == nBytesRaw;
+            case kEncodingLPCRice:  return info.sampleType == RecordingInfo::I16 && header.nBytes < nBytesRaw;
+        }
+
+        return false;
+    }
+}
+
+bool RecordingReader::open(const std::string & fname) {
+    close();
+
+    auto & data = getData();
+    auto & info = data.info;
+
+    data.fin.open(fname, std::ios::binary | std::ios::ate);
+    if (data.fin.good() == false) {
+        return false;
+    }
+
+    const int64_t size = data.fin.tellg();
+    data.fin.seekg(0, std::ios::beg);
+
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    if (size >= (int64_t) sizeof(header)) {
+        data.fin.read((char *)(&header), sizeof(header));
+    }
+
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+        info.sampleType = RecordingInfo::F32;
+        info.sampleRate = kSampleRate;
+        info.nChannels = 1;
+        info.chunkSize_samples = kLegacyChunkSize_samples;
+        info.nSamples = size/sizeof(TSampleF);
+        info.nChunks = (info.nSamples + info.chunkSize_samples - 1)/info.chunkSize_samples;
+        info.isLegacy = true;
+        info.hasStats = false;
+        info.isComplete = true;
+
+        for (int64_t i = 0; i < info.nChunks; ++i) {
+            const int64_t n = std::min(info.chunkSize_samples, info.nSamples - i*info.chunkSize_samples);
+            data.chunks.push_back({ int64_t(i*info.chunkSize_samples*sizeof(TSampleF)), n, int64_t(n*sizeof(TSampleF)), kEncodingRaw, 0.0f, 0.0f });
+        }
+
+        data.fin.clear();
+
+        return true;
+    }
+
+    if (header.version != kVersion) {
+        fprintf(stderr, "%s:%d: unsupported recording version %d in '%s'\n", __FILE__, __LINE__, (int) header.version, fname.c_str());
+        close();
+        return false;
+    }
+
+    if (header.sampleType != RecordingInfo::F32 && header.sampleType != RecordingInfo::I16) {
+        fprintf(stderr, "%s:%d: unsupported sample type %d in '%s'\n", __FILE__, __LINE__, (int) header.sampleType, fname.c_str());
+        close();
+        return false;
+    }
+
+    if (header.nChannels != 1) {
+        fprintf(stderr, "%s:%d: %d-channel recordings are not supported\n", __FILE__, __LINE__, (int) header.nChannels);
+        close();
+        return false;
+    }
+
+    if (header.chunkSize_samples == 0) {
+        fprintf(stderr, "%s:%d: invalid chunk size in '%s'\n", __FILE__, __LINE__, fname.c_str());
+        close();
+        return false;
+    }
+
+    info.sampleType = (RecordingInfo::ESampleType) header.sampleType;
+    info.sampleRate = header.sampleRate;
+    info.nChannels = header.nChannels;
+    info.chunkSize_samples = header.chunkSize_samples;
+    info.isLegacy = false;
+    info.hasStats = header.flags & kFlagStats;
+
+    std::vector<IndexEntry> index;
+
+    info.isComplete =
+        header.indexOffset >= (int64_t) sizeof(header) &&
+        header.nChunks >= 0 &&
+        header.indexOffset + header.nChunks*(int64_t) sizeof(IndexEntry) <= size;
+
+    if (info.isComplete) {
+        index.resize(header.nChunks);
+        data.fin.seekg(header.indexOffset);
+        data.fin.read((char *)(index.data()), index.size()*sizeof(IndexEntry));
+        info.isComplete = data.fin.good();
+    }
+
+    if (info.isComplete == false) {
+        // the writer did not close the file - walk the chunks up to the first incomplete one
+        index.clear();
+        data.fin.clear();
+
+        int64_t offset = sizeof(header);
+        while (offset + (int64_t) sizeof(ChunkHeader) <= size) {
+            IndexEntry entry;
+            entry.offset = offset;
+
+            data.fin.seekg(offset);
+            data.fin.read((char *)(&entry.header), sizeof(entry.header));
+            if (data.fin.good() == false || isValidChunk(entry.header, info) == false) break;
+
+            offset += sizeof(ChunkHeader) + entry.header.nBytes;
+            if (offset > size) break;
+
+            index.push_back(entry);
+            if (entry.header.nSamples < info.chunkSize_samples) break;
+        }
+
+        fprintf(stderr, "%s:%d: '%s' was not closed properly - recovered %d chunks\n", __FILE__, __LINE__, fname.c_str(), (int) index.size());
+    }
+
+    info.nSamples = 0;
+    for (int64_t i = 0; i < (int64_t) index.size(); ++i) {
+        const auto & entry = index[i];
+
+        // all chunks but the last are full, so that a sample index maps to its chunk directly
+        const bool isLast = i + 1 == (int64_t) index.size();
+        if (isValidChunk(entry.header, info) == false || (isLast == false && entry.header.nSamples != info.chunkSize_samples)) {
+            fprintf(stderr, "%s:%d: corrupted chunk %d in '%s'\n", __FILE__, __LINE__, (int) i, fname.c_str());
+            close();
+            return false;
+        }
+
+        data.chunks.push_back({
+            int64_t(entry.offset + sizeof(ChunkHeader)),
+            entry.header.nSamples, entry.header.nBytes, entry.header.encoding,
+            entry.header.absMax, entry.header.rms });
+
+        info.nSamples += entry.header.nSamples;
+    }
+
+    info.nChunks = data.chunks.size();
+
+    data.fin.clear();
+
+    return true;
+}
+
+void RecordingReader::close() {
+    auto & data = getData();
+
+    data.fin.close();
+    data.fin.clear();
+
+    data.info = {};
+    data.chunks.clear();
+    data.amax = -1.0;
+    data.cachedChunkId = -1;
+}
+
+const RecordingInfo & RecordingReader::getInfo() const {
+    return getData().info;
+}
+
+double RecordingReader::getAbsMax() {
+    auto & data = getData();
+
+    if (data.amax < 0.0) {
+        float amax = 0.0f;
+        if (data.info.hasStats) {
+            for (const auto & chunk : data.chunks) {
+                amax = std::max(amax, chunk.absMax);
+            }
+        } else {
+            for (int64_t i = 0; i < (int64_t) data.chunks.size(); ++i) {
+                if (loadChunk(i) == false) {
+                    return 0.0;
+                }
+                for (const auto & s : data.cached) {
+                    amax = std::max(amax, std::abs(s));
+                }
+            }
+        }
+        data.amax = amax;
+    }
+
+    return data.amax;
+}
+
+bool RecordingReader::getChunkStats(int64_t chunkId, float & absMax, float & rms) const {
+    const auto & data = getData();
+
+    if (data.info.hasStats == false || chunkId < 0 || chunkId >= (int64_t) data.chunks.size()) {
+        return false;
+    }
+
+    absMax = data.chunks[chunkId].absMax;
+    rms = data.chunks[chunkId].rms;
+
+    return true;
+}
+
+bool RecordingReader::loadChunk(int64_t chunkId) {
+    auto & data = getData();
+
+    if (data.cachedChunkId == chunkId) {
+        return true;
+    }
+
+    const auto & chunk = data.chunks[chunkId];
+
+    data.cachedChunkId = -1;
+    data.payload.resize(chunk.nBytes);
+    data.cached.resize(chunk.nSamples);
+
+    data.fin.clear();
+    data.fin.seekg(chunk.offset);
+    data.fin.read(data.payload.data(), chunk.nBytes);
+    if (data.fin.gcount() != chunk.nBytes) {
+        fprintf(stderr, "%s:%d: failed to read chunk %d\n", __FILE__, __LINE__, (int) chunkId);
+        return false;
+    }
+
+    if (decodeChunk(chunk, data.info.sampleType, data.payload.data(), data.work, data.cached.data()) == false) {
+        fprintf(stderr, "%s:%d: failed to decode chunk %d\n", __FILE__, __LINE__, (int) chunkId);
+        return false;
+    }
+
+    data.cachedChunkId = chunkId;
+
+    return true;
+}
+
+bool RecordingReader::read(int64_t idx, int64_t len, TSampleF * res) {
+    auto & data = getData();
+
+    if (idx < 0 || len < 0 || idx + len > data.info.nSamples) {
+        return false;
+    }
+
+    const int64_t chunkSize = data.info.chunkSize_samples;
+
+    if (len > 0 && idx/chunkSize != (idx + len - 1)/chunkSize) {
+        return readChunks(idx, len, res);
+    }
+
+    while (len > 0) {
+        const int64_t chunkId = idx/chunkSize;
+        if (loadChunk(chunkId) == false) {
+            return false;
+        }
+
+        const int64_t offset = idx - chunkId*chunkSize;
+        const int64_t k = std::min(len, (int64_t) data.cached.size() - offset);
+        std::copy(data.cached.begin() + offset, data.cached.begin() + offset + k, res);
+
+        idx += k;
+        len -= k;
+        res += k;
+    }
+
+    return true;
+}
+
+bool RecordingReader::readChunks(int64_t idx, int64_t len, TSampleF * res) {
+    auto & data = getData();
+
+    const int64_t chunkSize = data.info.chunkSize_samples;
+    const int64_t chunkId0 = idx/chunkSize;
+    const int64_t chunkId1 = (idx + len - 1)/chunkSize + 1;
+
+    // the payloads of a batch are read sequentially, then the chunks are decoded in parallel
+    for (int64_t b0 = chunkId0; b0 < chunkId1; b0 += kDecodeBatch_chunks) {
+        const int64_t nBatch = std::min(kDecodeBatch_chunks, chunkId1 - b0);
+
+        data.batch.resize(nBatch);
+        for (int64_t j = 0; j < nBatch; ++j) {
+            const auto & chunk = data.chunks[b0 + j];
+
+            data.batch[j].resize(chunk.nBytes);
+
+            data.fin.clear();
+            data.fin.seekg(chunk.offset);
+            data.fin.read(data.batch[j].data(), chunk.nBytes);
+            if (data.fin.gcount() != chunk.nBytes) {
+                fprintf(stderr, "%s:%d: failed to read chunk %d\n", __FILE__, __LINE__, (int) (b0 + j));
+                return false;
+            }
+        }
+
+        std::atomic<bool> isOK { true };
+        ThreadPool::getShared().parallelFor(nBatch, [&](int64_t j) {
+            const int64_t chunkId = b0 + j;
+            const auto & chunk = data.chunks[chunkId];
+
+            // the part of the chunk inside [idx, idx + len)
+            const int64_t i0 = std::max(idx, chunkId*chunkSize);
+            const int64_t i1 = std::min(idx + len, chunkId*chunkSize + chunk.nSamples);
+
+            std::vector<TSampleI16> work;
+            if (i0 == chunkId*chunkSize && i1 - i0 == chunk.nSamples) {
+                if (decodeChunk(chunk, data.info.sampleType, data.batch[j].data(), work, res + (i0 - idx)) == false) {
+                    isOK = false;
+                }
+            } else {
+                std::vector<TSampleF> samples(chunk.nSamples);
+                if (decodeChunk(chunk, data.info.sampleType, data.batch[j].data(), work, samples.data()) == false) {
+                    isOK = false;
+                    return;
+                }
+                std::copy(samples.begin() + (i0 - chunkId*chunkSize), samples.begin() + (i1 - chunkId*chunkSize), res + (i0 - idx));
+            }
+        });
+
+        if (isOK == false) {
+            fprintf(stderr, "%s:%d: failed to decode chunks %d - %d\n", __FILE__, __LINE__, (int) b0, (int) (b0 + nBatch - 1));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool RecordingReader::read(TWaveformF & res) {
+    res.resize(getInfo().nSamples);
+
+    return read(0, res.size(), res.data());
+}
@@ -0,0 +1,186 @@
+/*! \file recording.h
+ *  \brief Chunked recording container
+ *
+ *  A self-describing alternative to the raw float32 .kbd recordings. The file starts with a
+ *  header (sample type, sample rate, channels, chunk size), followed by the audio split into
+ *  chunks of a fixed number of samples, each with its own small header carrying the abs max and
+ *  the RMS of the chunk. An index of all chunks is appended when the writer is closed, so any
+ *  sample can be reached with a single seek. If the writer never got to close the file, the
+ *  reader rebuilds the index by walking the chunk headers.
+ *
+ *  The chunks of i16 recordings can optionally be compressed losslessly - each chunk is coded
+ *  with its best linear predictor (fixed polynomial or LPC) and the residuals are Rice coded.
+ *
+ *  The reader also accepts legacy raw float32 recordings - they are reported as a headerless
+ *  float32 stream at kSampleRate without chunk statistics.
+ *
+ *  All fields are stored in host byte order, same as the legacy recordings.
+ *
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include "constants.h"
+#include "common.h"
+
+#include <memory>
+#include <string>
+#include <cstdint>
+
+struct RecordingInfo {
+    enum ESampleType {
+        F32 = 0,
+        I16,
+    };
+
+    ESampleType sampleType = F32;
+
+    int64_t sampleRate = kSampleRate;
+    int32_t nChannels = 1;
+
+    int64_t chunkSize_samples = 0;
+    int64_t nChunks = 0;
+    int64_t nSamples = 0;
+
+    bool isLegacy = false; // raw float32 without a header
+    bool hasStats = false; // per-chunk abs max and RMS are available
+    bool isComplete = true; // false if the index was rebuilt because the writer did not close the file
+};
+
+class RecordingWriter {
+    public:
+        struct Parameters {
+            RecordingInfo::ESampleType sampleType = RecordingInfo::F32;
+
+            int64_t sampleRate = kSampleRate;
+
+            // ~1 second at the default sample rate
+            int64_t chunkSize_samples = 16384;
+
+            bool computeStats = true;
+
+            // lossless LPC + Rice coding of the chunks - i16 samples only
+            bool compress = false;
+        };
+
+        RecordingWriter();
+        ~RecordingWriter();
+
+        bool open(const std::string & fname, Parameters && parameters);
+
+        // samples are expected in [-1, 1] - for i16 payloads they are stored as round(32768*x), clipped to the
+        // i16 range, which is exact for audio captured from 16-bit devices
+        bool write(const TSampleF * samples, int64_t n);
+
+        // push the completed chunks to the OS - the samples of the current partial chunk stay in memory
+        bool flush();
+
+        // flush and wait for the OS to put the data on the disk
+        bool sync();
+
+        // write the last partial chunk and the index - the destructor calls it if needed
+        bool close();
+
+        int64_t getNSamples() const;
+        int64_t getTotalSize_bytes() const;
+
+    private:
+        bool writeChunk(const TSampleF * samples, int64_t n);
+
+        struct Data;
+        std::unique_ptr<Data> data_;
+        Data & getData() { return *data_; }
+        const Data & getData() const { return *data_; }
+};
+
+// Decouples audio capture from the disk. write() only copies the samples into a preallocated single-producer,
+// single-consumer ring and never blocks. A background thread drains the ring through a RecordingWriter a whole
+// chunk at a time, syncs the file periodically and optionally splits the recording into segments. If the disk
+// falls behind long enough for the ring to fill up, the samples of the write() call are dropped and counted.
+class RecordingWriterAsync {
+    public:
+        struct Parameters {
+            RecordingWriter::Parameters writer;
+
+            // rounded up to a power of 2 - ~32 seconds at the default sample rate
+            int64_t ringSize_samples = 1 << 19;
+
+            // 0 - sync only when a segment is closed
+            float syncInterval_s = 5.0f;
+
+            // start a new segment when the current one reaches either limit, 0 - no limit
+            // with a limit, the segments are named <name>-NNNN<ext>, otherwise the file name is used as is
+            int64_t segmentSize_bytes = 0;
+            float segmentLength_s = 0.0f;
+        };
+
+        struct Stats {
+            int64_t nWritten_samples = 0; // passed to the file writer
+            int64_t nDropped_samples = 0;
+            int64_t nDroppedWrites = 0; // write() calls that did not fit in the ring
+            int64_t nSegments = 0;
+            int64_t totalSize_bytes = 0; // of all segments
+            bool failed = false; // the writer thread stopped after a file error
+        };
+
+        RecordingWriterAsync();
+        ~RecordingWriterAsync();
+
+        // opens the first segment and starts the writer thread
+        bool open(const std::string & fname, Parameters && parameters);
+
+        // single producer - false if the samples were dropped
+        bool write(const TSampleF * samples, int64_t n);
+
+        // write out everything in the ring, finalize the last segment and stop the writer thread
+        bool close();
+
+        Stats getStats() const;
+
+        // name of the segment with the given id for the fname passed to open()
+        static std::string getSegmentName(const std::string & fname, int64_t segmentId);
+
+    private:
+        bool nextSegment();
+        void worker();
+
+        struct Data;
+        std::unique_ptr<Data> data_;
+        Data & getData() { return *data_; }
+        const Data & getData() const { return *data_; }
+};
+
+// Not thread-safe - use one reader per thread.
+class RecordingReader {
+    public:
+        RecordingReader();
+        ~RecordingReader();
+
+        // true if the file starts with the container header
+        static bool isContainer(const std::string & fname);
+
+        bool open(const std::string & fname);
+        void close();
+
+        const RecordingInfo & getInfo() const;
+
+        // abs max of all samples - from the chunk statistics when available, otherwise computed on first use
+        double getAbsMax();
+
+        bool getChunkStats(int64_t chunkId, float & absMax, float & rms) const;
+
+        // decode the samples [idx, idx + len) - reads spanning several chunks decode them in parallel on the shared
+        // thread pool
+        bool read(int64_t idx, int64_t len, TSampleF * res);
+        bool read(TWaveformF & res);
+
+    private:
+        bool loadChunk(int64_t chunkId);
+        bool readChunks(int64_t idx, int64_t len, TSampleF * res);
+
+        struct Data;
+        std::unique_ptr<Data> data_;
+        Data & getData() { return *data_; }
+        const Data & getData() const { return *data_; }
+};
@@ -557,9 +557,7 @@ namespace Cipher {
 	bool generateSimilarityMap(const TParameters & params, const std::string & text, TSimilarityMap & ccMap) {
 		int n = text.size();
 
-		ccMap.clear();
-        ccMap.resize(n);
-        for (auto & x : ccMap) x.resize(n);
+		ccMap.reset(n);
 
 		std::vector<float> waveformAccuracy(n);
 
@@ -579,7 +577,7 @@ namespace Cipher {
 		for (int i = 0; i < n; ++i) {
 			for (int j = 0; j < n; ++j) {
 				if (i == j) {
-					ccMap[i][j].cc = 1.0;
+					ccMap.setCC(i, j, 1.0);
 
 					continue;
 				}
@@ -587,13 +585,11 @@ namespace Cipher {
 				if (text[i] != text[j]) {
 					float sim = params.similarityMismatchAvg + 2.0f*(0.5f - frand())*params.similarityMismatchSig;
 
-					ccMap[i][j].cc = sim;
-					ccMap[j][i].cc = sim;
+					ccMap.setCC(i, j, sim);
 				} else {
 					float sim = waveformAccuracy[i]*waveformAccuracy[j];
 
-					ccMap[i][j].cc = sim;
-					ccMap[j][i].cc = sim;
+					ccMap.setCC(i, j, sim);
 				}
 			}
 		}
@@ -652,7 +648,7 @@ namespace Cipher {
         for (int i = 0; i < len; ++i) {
             for (int j = i + 1; j < len; ++j) {
                 if (clusters[i] == clusters[j]) {
-                    res += 1.0f - ccMap[i][j].cc;
+                    res += 1.0f - ccMap.getCC(i, j);
                 }
             }
         }
@@ -665,10 +661,10 @@ namespace Cipher {
         float res = -c0;
         for (int j = 0; j < len; ++j) {
             if (cid == clusters[j]) {
-                res -= 1.0f - ccMap[i][j].cc;
+                res -= 1.0f - ccMap.getCC(i, j);
             }
             if (clusters[i] == clusters[j]) {
-                res += 1.0f - ccMap[i][j].cc;
+                res += 1.0f - ccMap.getCC(i, j);
             }
         }
 
@@ -813,7 +809,7 @@ namespace Cipher {
         float ccavg = 0.0;
         for (int j = 0; j < n; ++j) {
             for (int i = j + 1; i < n; ++i) {
-                ccavg += ccMap[j][i].cc;
+                ccavg += ccMap.getCC(j, i);
                 ++ncc;
             }
         }
@@ -894,7 +890,7 @@ namespace Cipher {
 
                 int i0 = rand()%n;
                 int i1 = rand()%n;
-                while (clusters[i0] == clusters[i1] || ccMap[i0][i1].cc < ccavg) {
+                while (clusters[i0] == clusters[i1] || ccMap.getCC(i0, i1) < ccavg) {
                     i0 = rand()%n;
                     i1 = rand()%n;
                 }
@@ -1123,7 +1119,7 @@ namespace Cipher {
         float ccavg = 0.0;
         for (int j = 0; j < n; ++j) {
             for (int i = j + 1; i < n; ++i) {
-                ccavg += ccMap[j][i].cc;
+                ccavg += ccMap.getCC(j, i);
                 ++ncc;
             }
         }
@@ -1482,7 +1478,7 @@ namespace Cipher {
         std::vector<Pair> ccPairs;
         for (int i = 0; i < n - 1; ++i) {
             for (int j = i + 1; j < n; ++j) {
-                ccPairs.emplace_back(Pair{i, j, ccMap[i][j].cc});
+                ccPairs.emplace_back(Pair{i, j, ccMap.getCC(i, j)});
             }
         }
 
@@ -1582,9 +1578,9 @@ namespace Cipher {
             for (int i = j + 1; i < n; ++i) {
                 if (clusters[i] == clusters[j]) {
                 //if (clMap.at(clusters[i]) == clMap.at(clusters[j])) {
-                    res += logMap[j][i].cc;
+                    res += logMap.getCC(j, i);
                 } else {
-                    res += logMapInv[j][i].cc;
+                    res += logMapInv.getCC(j, i);
                 }
             }
         }
@@ -1593,9 +1589,9 @@ namespace Cipher {
         //    for (int j = 0; j < n - 1; ++j) {
         //        for (int i = j + 1; i < n; ++i) {
         //            if (clusters[i] == clusters[j]) {
-        //                res += logMap[j][i].cc;
+        //                res += logMap.getCC(j, i);
         //            } else {
-        //                res += logMapInv[j][i].cc;
+        //                res += logMapInv.getCC(j, i);
         //            }
         //        }
         //    }
@@ -1604,9 +1600,9 @@ namespace Cipher {
         //    for (int j = 0; j < n - 1; ++j) {
         //        for (int i = j + 1; i < n; ++i) {
         //            if (clMap.at(clusters[i]) == clMap.at(clusters[j])) {
-        //                res += logMap[j][i].cc;
+        //                res += logMap.getCC(j, i);
         //            } else {
-        //                res += logMapInv[j][i].cc;
+        //                res += logMapInv.getCC(j, i);
         //            }
         //        }
         //    }
@@ -1627,8 +1623,8 @@ namespace Cipher {
 
         for (int j = 0; j < n - 1; ++j) {
             for (int i = j + 1; i < n; ++i) {
-                ccMin = std::min(ccMin, ccMap[j][i].cc);
-                ccMax = std::max(ccMax, ccMap[j][i].cc);
+                ccMin = std::min(ccMin, ccMap.getCC(j, i));
+                ccMax = std::max(ccMax, ccMap.getCC(j, i));
             }
         }
 
@@ -1637,44 +1633,32 @@ namespace Cipher {
 
         printf("ccMax = %g, ccMin = %g\n", ccMax, ccMin);
 
+        // the maps are symmetric, so only the upper triangle is transformed
         for (int j = 0; j < n; ++j) {
-            for (int i = 0; i < n; ++i) {
-                if (i == j) {
-                    ccMap[j][i].cc = 1.0;
-                    continue;
-                }
-
-                auto & v = ccMap[j][i].cc;
+            ccMap.setCC(j, j, 1.0);
+            for (int i = j + 1; i < n; ++i) {
+                auto v = ccMap.getCC(j, i);
                 v = (v - ccMin)/(ccMax - ccMin);
                 //v = 1.0 - std::exp(-1.1f*v);
+                ccMap.setCC(j, i, v);
             }
         }
 
         logMap = ccMap;
 
         for (int j = 0; j < n; ++j) {
-            for (int i = 0; i < n; ++i) {
-                if (i == j) {
-                    logMap[j][i].cc = 0.0;
-                    continue;
-                }
-
-                auto & v = logMap[j][i].cc;
-                v = std::log(v);
+            logMap.setCC(j, j, 0.0);
+            for (int i = j + 1; i < n; ++i) {
+                logMap.setCC(j, i, std::log(logMap.getCC(j, i)));
             }
         }
 
         logMapInv = ccMap;
 
         for (int j = 0; j < n; ++j) {
-            for (int i = 0; i < n; ++i) {
-                if (i == j) {
-                    logMap[j][i].cc = -1e6;
-                    continue;
-                }
-
-                auto & v = logMapInv[j][i].cc;
-                v = std::log(1.0 - v);
+            logMap.setCC(j, j, -1e6);
+            for (int i = j + 1; i < n; ++i) {
+                logMapInv.setCC(j, i, std::log(1.0 - logMapInv.getCC(j, i)));
             }
         }
 
@@ -5,8 +5,10 @@
 
 #include "subbreak3.h"
 #include "constants.h"
+#include "thread-pool.h"
 
 #include <array>
+#include <atomic>
 #include <cstdlib>
 #include <fstream>
 #include <chrono>
@@ -320,6 +322,39 @@ void shuffle(T & t, int start = -1, int end = -1, const Cipher::THint & hint = {
     }
 }
 
+// the first findBestCutoffFreq round evaluates every kCutoffCoarseStride-th cutoff of the grid
+constexpr int kCutoffCoarseStride = 3;
+
+// how well the key presses in a filtered recording cluster - the score that findBestCutoffFreq maximizes
+// the clustering is seeded explicitly, so the score does not depend on which thread evaluates the cutoff
+bool evaluateCutoffFreq(const TWaveformI16 & waveform, int64_t seed, double & pClusters) {
+    TKeyPressCollectionI16 keyPresses;
+    if (findKeyPresses(getView(waveform, 0), keyPresses,
+                       kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset, kFindKeysRemoveLowPower) == false) {
+        fprintf(stderr, "%s:%d: findKeyPresses() failed\n", __FILE__, __LINE__);
+        return false;
+    }
+
+    TSimilarityMap similarityMap;
+    if (calculateSimilartyMap(kKeyWidth_samples, kKeyAlign_samples, kKeyWidth_samples - kKeyOffset_samples, keyPresses, similarityMap) == false) {
+        fprintf(stderr, "%s:%d: calculateSimilartyMap() failed\n", __FILE__, __LINE__);
+        return false;
+    }
+
+    Cipher::TFreqMap freqMap; // not used for anything
+    Cipher::Processor processor;
+
+    Cipher::TParameters params;
+    params.maxClusters = 50;
+    params.wEnglishFreq = 20.0;
+    params.seed = seed;
+    processor.init(params, freqMap, similarityMap);
+
+    pClusters = processor.getClusterings(1)[0].pClusters;
+
+    return true;
+}
+
 }
 
 namespace Cipher {
@@ -878,7 +913,7 @@ namespace Cipher {
         std::vector<Pair> ccPairs;
         for (int i = 0; i < n - 1; ++i) {
             for (int j = i + 1; j < n; ++j) {
-                ccPairs.emplace_back(Pair{i, j, ccMap[i][j].cc});
+                ccPairs.emplace_back(Pair{i, j, ccMap.getCC(i, j)});
             }
         }
 
@@ -964,9 +999,9 @@ namespace Cipher {
         for (int j = 0; j < n - 1; ++j) {
             for (int i = j + 1; i < n; ++i) {
                 if (clusters[i] == clusters[j]) {
-                    res += logMap[j][i].cc;
+                    res += logMap.getCC(j, i);
                 } else {
-                    res += logMapInv[j][i].cc;
+                    res += logMapInv.getCC(j, i);
                 }
             }
         }
@@ -986,8 +1021,8 @@ namespace Cipher {
 
         for (int j = 0; j < n - 1; ++j) {
             for (int i = j + 1; i < n; ++i) {
-                ccMin = std::min(ccMin, ccMap[j][i].cc);
-                ccMax = std::max(ccMax, ccMap[j][i].cc);
+                ccMin = std::min(ccMin, ccMap.getCC(j, i));
+                ccMax = std::max(ccMax, ccMap.getCC(j, i));
             }
         }
 
@@ -996,48 +1031,36 @@ namespace Cipher {
 
         //printf("ccMax = %g, ccMin = %g\n", ccMax, ccMin);
 
+        // the maps are symmetric, so only the upper triangle is transformed
         for (int j = 0; j < n; ++j) {
-            for (int i = 0; i < n; ++i) {
-                if (i == j) {
-                    ccMap[j][i].cc = 1.0;
-                    continue;
-                }
-
-                auto & v = ccMap[j][i].cc;
+            ccMap.setCC(j, j, 1.0);
+            for (int i = j + 1; i < n; ++i) {
+                auto v = ccMap.getCC(j, i);
                 v = (v - ccMin)/(ccMax - ccMin);
                 v = std::pow(v, params.fSpread);
                 //if (v < 0.50) {
                 //    v = 1e-6;
                 //}
                 //v = 1.0 - std::exp(-1.1f*v);
+                ccMap.setCC(j, i, v);
             }
         }
 
         logMap = ccMap;
 
         for (int j = 0; j < n; ++j) {
-            for (int i = 0; i < n; ++i) {
-                if (i == j) {
-                    logMap[j][i].cc = 0.0;
-                    continue;
-                }
-
-                auto & v = logMap[j][i].cc;
-                v = std::log(v);
+            logMap.setCC(j, j, 0.0);
+            for (int i = j + 1; i < n; ++i) {
+                logMap.setCC(j, i, std::log(logMap.getCC(j, i)));
             }
         }
 
         logMapInv = ccMap;
 
         for (int j = 0; j < n; ++j) {
-            for (int i = 0; i < n; ++i) {
-                if (i == j) {
-                    logMap[j][i].cc = -1e6;
-                    continue;
-                }
-
-                auto & v = logMapInv[j][i].cc;
-                v = std::log(1.0 - v);
+            logMap.setCC(j, j, -1e6);
+            for (int i = j + 1; i < n; ++i) {
+                logMapInv.setCC(j, i, std::log(1.0 - logMapInv.getCC(j, i)));
             }
         }
 
@@ -1113,6 +1136,7 @@ namespace Cipher {
         m_freqMap = &freqMap;
         m_similarityMap = similarityMap;
         m_curResult = {};
+        m_rng.seed(m_params.seed < 0 ? rand() : m_params.seed);
 
         normalizeSimilarityMap(m_params, m_similarityMap, m_logMap, m_logMapInv);
         generateClustersInitialGuess(m_params, m_similarityMap, m_curResult.clusters);
@@ -1156,11 +1180,11 @@ namespace Cipher {
             // mutate
             int idxChanged = -1;
             {
-                idxChanged = rand()%n;
+                idxChanged = m_rng()%n;
 
                 auto old = clustersNew[idxChanged];
                 do {
-                    clustersNew[idxChanged] = 1 + rand()%(m_params.maxClusters - 1);
+                    clustersNew[idxChanged] = 1 + m_rng()%(m_params.maxClusters - 1);
                 } while (clustersNew[idxChanged] == old);
             }
 
@@ -1174,15 +1198,15 @@ namespace Cipher {
                     }
 
                     if (m_curResult.clusters[i] == m_curResult.clusters[j]) {
-                        pNew -= m_logMap[j][i].cc;
+                        pNew -= m_logMap.getCC(j, i);
                     } else {
-                        pNew -= m_logMapInv[j][i].cc;
+                        pNew -= m_logMapInv.getCC(j, i);
                     }
 
                     if (clustersNew[i] == clustersNew[j]) {
-                        pNew += m_logMap[j][i].cc;
+                        pNew += m_logMap.getCC(j, i);
                     } else {
-                        pNew += m_logMapInv[j][i].cc;
+                        pNew += m_logMapInv.getCC(j, i);
                     }
                 }
 
@@ -1197,7 +1221,7 @@ namespace Cipher {
             } else {
                 // accept with probability
                 const auto pAccept = std::exp((pNew - m_pCur)/T);
-                if (pAccept > frand()) {
+                if (pAccept > std::uniform_real_distribution<double>(0.0, 1.0)(m_rng)) {
                     //printf("    [getClusterings] N = %5d, T = %8.8f, pNew = %g, pCur = %g, pAccept = %g\n", nNoImprovement, T, pNew, m_pCur, pAccept);
                     m_curResult.clusters = clustersNew;
                     m_curResult.pClusters = pNew;
@@ -1289,56 +1313,94 @@ namespace Cipher {
         return m_similarityMap;
     }
 
-    float findBestCutoffFreq(const TWaveformF & waveform, EAudioFilter filterId, int64_t sampleRate, float minCutoffFreq_Hz, float maxCutoffFreq_Hz, float step_Hz) {
-        double pClustersBest = -1e10;
-        float freqCutoffBest_Hz = minCutoffFreq_Hz;
-
+    float findBestCutoffFreq(const TWaveformViewF & waveform, EAudioFilter filterId, int64_t sampleRate, float minCutoffFreq_Hz, float maxCutoffFreq_Hz, float step_Hz) {
+        std::vector<float> freqCutoffs_Hz;
         for (float freqCutoff_Hz = minCutoffFreq_Hz; freqCutoff_Hz <= maxCutoffFreq_Hz; freqCutoff_Hz += step_Hz) {
-            TWaveformI16 waveformInput;
-            TWaveformF waveformFiltered = waveform;
-            filter(waveformFiltered, (EAudioFilter) filterId, freqCutoff_Hz, sampleRate);
+            freqCutoffs_Hz.push_back(freqCutoff_Hz);
+        }
 
-            if (convert(waveformFiltered, waveformInput) == false) {
-                fprintf(stderr, "%s:%d: convert() failed\n", __FILE__, __LINE__);
-                return minCutoffFreq_Hz;
+        const int nGrid = freqCutoffs_Hz.size();
+        if (nGrid == 0) {
+            return minCutoffFreq_Hz;
+        }
+
+        std::vector<bool> evaluated(nGrid, false);
+        std::vector<double> pClusters(nGrid, -1e10);
+
+        // filter the recording for the given grid cutoffs and score them concurrently on the shared pool
+        auto evaluate = [&](const std::vector<int> & ids) {
+            std::vector<float> freqs_Hz;
+            for (auto id : ids) {
+                freqs_Hz.push_back(freqCutoffs_Hz[id]);
             }
 
-            TKeyPressCollectionI16 keyPresses;
-            {
-                TWaveformI16 waveformMax;
-                TWaveformI16 waveformThreshold;
-                if (findKeyPresses(getView(waveformInput, 0), keyPresses, waveformThreshold, waveformMax,
-                                   kFindKeysThreshold, kFindKeysHistorySize, kFindKeysHistorySizeReset, kFindKeysRemoveLowPower) == false) {
-                    fprintf(stderr, "%s:%d: findKeyPresses() failed\n", __FILE__, __LINE__);
-                    return minCutoffFreq_Hz;
+            std::vector<TWaveformI16> waveformsFiltered;
+            if (filterBank(waveform, filterId, freqs_Hz, sampleRate, waveformsFiltered) == false) {
+                fprintf(stderr, "%s:%d: filterBank() failed\n", __FILE__, __LINE__);
+                return false;
+            }
+
+            std::atomic_bool ok(true);
+            std::vector<double> pCur(ids.size());
+            ThreadPool::getShared().parallelFor(ids.size(), [&](int64_t j) {
+                if (evaluateCutoffFreq(waveformsFiltered[j], ids[j], pCur[j]) == false) {
+                    ok = false;
+                }
+            });
+
+            if (ok == false) {
+                return false;
+            }
+
+            for (int j = 0; j < (int) ids.size(); ++j) {
+                evaluated[ids[j]] = true;
+                pClusters[ids[j]] = pCur[j];
+                printf("    [findBestCutoffFreq] freqCutoff_Hz = %g, pClusters = %g\n", freqCutoffs_Hz[ids[j]], pCur[j]);
+            }
+
+            return true;
+        };
+
+        // the lowest evaluated cutoff with the highest score
+        auto getBest = [&]() {
+            int res = -1;
+            for (int i = 0; i < nGrid; ++i) {
+                if (evaluated[i] && (res < 0 || pClusters[i] > pClusters[res])) {
+                    res = i;
                 }
             }
+            return res;
+        };
 
-            TSimilarityMap similarityMap;
-            if (calculateSimilartyMap(kKeyWidth_samples, kKeyAlign_samples, kKeyWidth_samples - kKeyOffset_samples, keyPresses, similarityMap) == false) {
-                fprintf(stderr, "%s:%d: calculateSimilartyMap() failed\n", __FILE__, __LINE__);
+        // coarse grid, including both ends of the range
+        std::vector<int> ids;
+        for (int i = 0; i < nGrid; i += kCutoffCoarseStride) {
+            ids.push_back(i);
+        }
+        if (ids.back() != nGrid - 1) {
+            ids.push_back(nGrid - 1);
+        }
+
+        // then refine around the best cutoff so far, until every grid point less than
+        // kCutoffCoarseStride steps away from it has been evaluated
+        while (ids.empty() == false) {
+            if (evaluate(ids) == false) {
                 return minCutoffFreq_Hz;
             }
 
-            {
-                Cipher::TFreqMap freqMap; // not used for anything
-                Cipher::Processor processor;
-
-                Cipher::TParameters params;
-                params.maxClusters = 50;
-                params.wEnglishFreq = 20.0;
-                processor.init(params, freqMap, similarityMap);
-
-                auto clusteringsCur = processor.getClusterings(1);
-                if (clusteringsCur[0].pClusters > pClustersBest) {
-                    pClustersBest = clusteringsCur[0].pClusters;
-                    freqCutoffBest_Hz = freqCutoff_Hz;
+            const int best = getBest();
+
+            ids.clear();
+            for (int d = 1; d < kCutoffCoarseStride; ++d) {
+                for (int i : { best - d, best + d }) {
+                    if (i >= 0 && i < nGrid && evaluated[i] == false) {
+                        ids.push_back(i);
+                    }
                 }
-                printf("    [findBestCutoffFreq] freqCutoff_Hz = %g, pClusters = %g\n", freqCutoff_Hz, clusteringsCur[0].pClusters);
             }
         }
 
-        return freqCutoffBest_Hz;
+        return freqCutoffs_Hz[getBest()];
     }
 
 }
@@ -8,6 +8,7 @@
 #include "common.h"
 
 #include <map>
+#include <random>
 #include <cmath>
 #include <vector>
 #include <string>
@@ -42,6 +43,9 @@ namespace Cipher {
         // beam search
         int nHypothesesToKeep = 500;
 
+        // seed of the Processor's clustering RNG, -1 - draw it from rand()
+        int64_t seed = -1;
+
         THint hint = {};
     };
 
@@ -134,6 +138,8 @@ namespace Cipher {
         TSimilarityMap m_logMap;
         TSimilarityMap m_logMapInv;
 
+        std::mt19937 m_rng;
+
         int m_nInitialIters = 0;
         double m_pCur = 0.0f;
         double m_pZero = 0.0f;
@@ -142,10 +148,20 @@ namespace Cipher {
     };
 
     float findBestCutoffFreq(
-            const TWaveformF & waveform,
+            const TWaveformViewF & waveform,
             EAudioFilter filterId,
             int64_t sampleRate,
             float minCutoffFreq_Hz,
             float maxCutoffFreq_Hz,
             float step_Hz);
+
+    inline float findBestCutoffFreq(
+            const TWaveformF & waveform,
+            EAudioFilter filterId,
+            int64_t sampleRate,
+            float minCutoffFreq_Hz,
+            float maxCutoffFreq_Hz,
+            float step_Hz) {
+        return findBestCutoffFreq(getView(waveform, 0), filterId, sampleRate, minCutoffFreq_Hz, maxCutoffFreq_Hz, step_Hz);
+    }
 }
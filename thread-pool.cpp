@@ -0,0 +1,295 @@
+/*! \file thread-pool.cpp
+ *  \brief Shared work-stealing thread pool
+ *  \author Georgi Gerganov
+ */
+
+#include "thread-pool.h"
+#include "constants.h"
+
+#include <cstdio>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <condition_variable>
+
+#if defined(__linux__) && !defined(__EMSCRIPTEN__)
+#include <pthread.h>
+#include <sched.h>
+#define KBD_AUDIO_THREAD_AFFINITY
+#endif
+
+namespace {
+    // the pool and the queue index of the current thread, if it is a pool worker
+    thread_local const void * t_pool = nullptr;
+    thread_local int32_t t_queueId = -1;
+
+    int32_t getDefaultNThreads() {
+#ifdef __EMSCRIPTEN__
+        return std::min(kMaxThreads, std::max(1, int(std::thread::hardware_concurrency()) - 2));
+#else
+        return std::max(1, int(std::thread::hardware_concurrency()));
+#endif
+    }
+
+    std::mutex g_mutexShared;
+    std::unique_ptr<ThreadPool> g_shared;
+}
+
+struct ThreadPool::Data {
+    using Task = std::function<void()>;
+
+    // the tasks of one parallelFor() call
+    struct Batch {
+        std::atomic<int64_t> nRemaining;
+
+        // the caller is a pool worker - while waiting, it also runs the tasks of other calls
+        bool isPoolThread = false;
+    };
+
+    struct Entry {
+        Task task;
+        Batch * batch = nullptr;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Entry> tasks;
+    };
+
+    Parameters parameters;
+
+    // one queue per worker + one for tasks submitted from outside the pool
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::atomic<int64_t> nPending;
+    std::atomic_bool stop;
+
+    // idle workers and waiting workers sleep on cvSleep, waiting threads from outside the pool on cvDone
+    std::mutex mutexSleep;
+    std::condition_variable cvSleep;
+    std::condition_variable cvDone;
+
+    Data() : nPending(0), stop(false) {}
+
+    int32_t getQueueId() const {
+        return t_pool == this ? t_queueId : -1;
+    }
+
+    void push(Task && task, Batch * batch) {
+        int32_t qid = getQueueId();
+        if (qid < 0) {
+            qid = workers.size();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queues[qid]->mutex);
+            queues[qid]->tasks.push_back({ std::move(task), batch });
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutexSleep);
+            ++nPending;
+        }
+        cvSleep.notify_one();
+    }
+
+    void finish(Batch & batch) {
+        // the caller returns as soon as nRemaining reaches 0, so the batch is not touched after that
+        const bool isPoolThread = batch.isPoolThread;
+        if (--batch.nRemaining > 0) {
+            return;
+        }
+
+        // pairs with the predicate check of the waiting caller
+        {
+            std::lock_guard<std::mutex> lock(mutexSleep);
+        }
+
+        if (isPoolThread) {
+            cvSleep.notify_all();
+        } else {
+            cvDone.notify_all();
+        }
+    }
+
+    // Workers run the newest task of the own queue, or steal the oldest task from another one.
+    // Threads outside the pool only run the tasks of their own batch, so that a long task of an
+    // unrelated call does not delay their return.
+    bool tryRun(int32_t qid, const Batch * own) {
+        Entry entry;
+
+        if (qid >= 0) {
+            {
+                auto & queue = *queues[qid];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.tasks.empty() == false) {
+                    entry = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                }
+            }
+
+            const int32_t nQueues = queues.size();
+            for (int32_t k = 1; k < nQueues && !entry.task; ++k) {
+                auto & queue = *queues[(qid + k)%nQueues];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.tasks.empty() == false) {
+                    entry = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+            }
+        } else {
+            // tasks pushed from outside the pool all go to the last queue
+            auto & queue = *queues.back();
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            for (auto it = queue.tasks.rbegin(); it != queue.tasks.rend(); ++it) {
+                if (it->batch == own) {
+                    entry = std::move(*it);
+                    queue.tasks.erase(std::next(it).base());
+                    break;
+                }
+            }
+        }
+
+        if (!entry.task) {
+            return false;
+        }
+
+        --nPending;
+        entry.task();
+        finish(*entry.batch);
+
+        return true;
+    }
+
+    void pinThread(int32_t id) {
+#ifdef KBD_AUDIO_THREAD_AFFINITY
+        const int nCPUs = std::max(1u, std::thread::hardware_concurrency());
+
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET((parameters.firstCPU + id)%nCPUs, &cpuset);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0) {
+            fprintf(stderr, "warning : failed to set affinity of worker %d\n", id);
+        }
+#else
+        (void) id;
+#endif
+    }
+
+    void workerLoop(int32_t id) {
+        t_pool = this;
+        t_queueId = id;
+
+        if (parameters.pinThreads) {
+            pinThread(id);
+        }
+
+        while (true) {
+            if (tryRun(id, nullptr)) continue;
+
+            std::unique_lock<std::mutex> lock(mutexSleep);
+            cvSleep.wait(lock, [&]() { return stop || nPending > 0; });
+            if (stop) break;
+        }
+    }
+};
+
+ThreadPool & ThreadPool::getShared() {
+    std::lock_guard<std::mutex> lock(g_mutexShared);
+    if (!g_shared) {
+        g_shared.reset(new ThreadPool({}));
+    }
+
+    return *g_shared;
+}
+
+bool ThreadPool::initShared(Parameters && parameters) {
+    std::lock_guard<std::mutex> lock(g_mutexShared);
+    g_shared.reset(new ThreadPool(std::move(parameters)));
+
+    return true;
+}
+
+ThreadPool::ThreadPool(Parameters && parameters) : data_(new ThreadPool::Data()) {
+    auto & data = getData();
+
+    if (parameters.nThreads <= 0) {
+        parameters.nThreads = getDefaultNThreads();
+    }
+
+    data.parameters = std::move(parameters);
+
+    const int32_t nWorkers = data.parameters.nThreads - 1;
+    for (int32_t i = 0; i <= nWorkers; ++i) {
+        data.queues.emplace_back(new Data::Queue());
+    }
+
+    data.workers.resize(nWorkers);
+    for (int32_t i = 0; i < nWorkers; ++i) {
+        data.workers[i] = std::thread(&Data::workerLoop, &data, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    auto & data = getData();
+
+    {
+        std::lock_guard<std::mutex> lock(data.mutexSleep);
+        data.stop = true;
+    }
+    data.cvSleep.notify_all();
+
+    for (auto & worker : data.workers) {
+        worker.join();
+    }
+}
+
+int32_t ThreadPool::getNThreads() const {
+    return getData().parameters.nThreads;
+}
+
+bool ThreadPool::parallelFor(int64_t n, const std::function<void(int64_t)> & func) {
+    auto & data = getData();
+
+    if (n <= 0) {
+        return true;
+    }
+
+    if (n == 1 || data.workers.empty()) {
+        for (int64_t i = 0; i < n; ++i) {
+            func(i);
+        }
+        return true;
+    }
+
+    const int32_t qid = data.getQueueId();
+
+    Data::Batch batch;
+    batch.nRemaining = n - 1;
+    batch.isPoolThread = qid >= 0;
+
+    for (int64_t i = 1; i < n; ++i) {
+        data.push([&func, i]() { func(i); }, &batch);
+    }
+
+    func(0);
+
+    // help with the queued tasks until all of ours are done, sleep when there is nothing to run
+    while (batch.nRemaining > 0) {
+        if (data.tryRun(qid, &batch)) continue;
+
+        std::unique_lock<std::mutex> lock(data.mutexSleep);
+        if (batch.isPoolThread) {
+            data.cvSleep.wait(lock, [&]() { return batch.nRemaining == 0 || data.nPending > 0; });
+        } else {
+            // all of our tasks that are not queued anymore are already running
+            data.cvDone.wait(lock, [&]() { return batch.nRemaining == 0; });
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,51 @@
+/*! \file thread-pool.h
+ *  \brief Shared work-stealing thread pool
+ *
+ *  All parallel stages of the Core library and the tools submit their work to a
+ *  single shared pool, so threads are created only once. A pool thread that waits
+ *  for its tasks executes queued tasks in the meantime, so nested parallel sections
+ *  do not oversubscribe the CPU and cannot deadlock. Threads from outside the pool
+ *  only execute the tasks of their own call. Waiting threads sleep when there is
+ *  nothing they can execute.
+ *
+ *  \author Georgi Gerganov
+ */
+
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include <functional>
+
+class ThreadPool {
+    public:
+        struct Parameters {
+            // total number of threads executing tasks, including the thread calling parallelFor()
+            // values <= 0 select the number of hardware threads
+            int32_t nThreads = -1;
+
+            // pin worker thread i to CPU (firstCPU + i) % nCPUs - Linux only
+            bool pinThreads = false;
+            int32_t firstCPU = 0;
+        };
+
+        // the pool used by all Core functions, created with default parameters on first use
+        static ThreadPool & getShared();
+
+        // re-create the shared pool - must not be called while it is executing tasks
+        static bool initShared(Parameters && parameters);
+
+        explicit ThreadPool(Parameters && parameters);
+        ~ThreadPool();
+
+        int32_t getNThreads() const;
+
+        // call func(i) for all i in [0, n) and wait for all calls to finish
+        bool parallelFor(int64_t n, const std::function<void(int64_t)> & func);
+
+    private:
+        struct Data;
+        std::unique_ptr<Data> data_;
+        Data & getData() { return *data_; }
+        const Data & getData() const { return *data_; }
+};
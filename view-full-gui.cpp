@@ -59,6 +59,7 @@ using TSampleInput          = TSampleF;
 using TSample               = TSampleI16;
 using TWaveform             = TWaveformI16;
 using TWaveformView         = TWaveformViewI16;
+using TWaveformPyramid      = TWaveformPyramidI16;
 using TPlaybackData         = TPlaybackDataI16;
 
 SDL_AudioDeviceID g_deviceIdOut = 0;
@@ -78,11 +79,6 @@ float plotWaveform(void * data, int i) {
     return waveform->samples[i];
 }
 
-float plotWaveformInverse(void * data, int i) {
-    TWaveformView * waveform = (TWaveformView *)data;
-    return -waveform->samples[i];
-}
-
 bool renderWaveform(TParameters & , const TWaveform & waveform) {
     ImGui::SetNextWindowPos(ImVec2(0, 0));
     ImGui::SetNextWindowSize(ImVec2(g_windowSizeX, g_windowSizeY));
@@ -97,26 +93,35 @@ bool renderWaveform(TParameters & , const TWaveform & waveform) {
         static float dragOffset = 0.0f;
         static float scrollSize = 18.0f;
 
-        static auto nviewPrev = nview + 1;
-
-        static TWaveform waveformLowRes = waveform;
+        static TWaveformPyramid waveformPyramid;
+        static TWaveform waveformPixelsMin;
+        static TWaveform waveformPixelsMax;
         static TWaveform waveformThreshold = waveform;
 
-        auto wview = getView(waveformLowRes, offset, nview);
         auto wsize = ImGui::GetContentRegionAvail();
         wsize.y -= 50.0f;
 
+        if (waveformPyramid.n != (int64_t) waveform.size()) {
+            updateWaveformPyramid(getView(waveform, 0), waveformPyramid);
+        }
+
+        const int nPixels = std::max(1, std::min(nview, (int) wsize.x));
+        getWaveformMinMax(getView(waveform, 0), waveformPyramid, offset, nview, nPixels, waveformPixelsMin, waveformPixelsMax);
+
+        auto wviewMin = getView(waveformPixelsMin, 0);
+        auto wviewMax = getView(waveformPixelsMax, 0);
+
         auto mpos = ImGui::GetIO().MousePos;
         auto savePos = ImGui::GetCursorScreenPos();
         auto drawList = ImGui::GetWindowDrawList();
         ImGui::PushStyleColor(ImGuiCol_FrameBg, { 0.3f, 0.3f, 0.3f, 0.3f });
         ImGui::PushStyleColor(ImGuiCol_PlotHistogram, { 1.0f, 1.0f, 1.0f, 1.0f });
-        ImGui::PlotHistogram("##Waveform", plotWaveformInverse, &wview, nview, 0, "Waveform", amin, amax, wsize);
+        ImGui::PlotHistogram("##Waveform", plotWaveform, &wviewMin, wviewMin.n, 0, "Waveform", amin, amax, wsize);
         ImGui::PopStyleColor(2);
         ImGui::SetCursorScreenPos(savePos);
         ImGui::PushStyleColor(ImGuiCol_FrameBg, { 0.1f, 0.1f, 0.1f, 0.0f });
         ImGui::PushStyleColor(ImGuiCol_PlotHistogram, { 1.0f, 1.0f, 1.0f, 1.0f });
-        ImGui::PlotHistogram("##Waveform", plotWaveform, &wview, nview, 0, "Waveform", amin, amax, wsize);
+        ImGui::PlotHistogram("##Waveform", plotWaveform, &wviewMax, wviewMax.n, 0, "Waveform", amin, amax, wsize);
         ImGui::PopStyleColor(2);
         ImGui::SetCursorScreenPos(savePos);
         ImGui::InvisibleButton("##WaveformIB",wsize);
@@ -211,11 +216,6 @@ bool renderWaveform(TParameters & , const TWaveform & waveform) {
         }
 
         ImGui::PopItemWidth();
-
-        if (nview != nviewPrev) {
-            generateLowResWaveform(waveform, waveformLowRes, std::max(1.0f, nview/wsize.x));
-            nviewPrev = nview;
-        }
     }
     ImGui::End();
 
@@ -302,17 +302,14 @@ int main(int argc, char ** argv) {
     };
 
     {
-        TWaveformF waveformInputF;
+        MappedWaveform waveformInputF;
         printf("[+] Loading recording from '%s'\n", argv[1]);
-        if (readFromFile<TSampleF>(argv[1], waveformInputF) == false) {
+        if (waveformInputF.open(argv[1]) == false) {
             printf("Specified file '%s' does not exist\n", argv[1]);
             return -1;
         } else {
-            printf("[+] Filtering waveform with filter type = %d and cutoff frequency = %d Hz\n", filterId, freqCutoff_Hz);
-            ::filter(waveformInputF, (EAudioFilter) filterId, freqCutoff_Hz, kSampleRate);
-
-            printf("[+] Converting waveform to i16 format ...\n");
-            if (convert(waveformInputF, waveformInput) == false) {
+            printf("[+] Filtering waveform with filter type = %d and cutoff frequency = %d Hz and converting to i16 format ...\n", filterId, freqCutoff_Hz);
+            if (filterAndConvert(waveformInputF.getView(), (EAudioFilter) filterId, freqCutoff_Hz, kSampleRate, waveformInput) == false) {
                 printf("Conversion failed\n");
                 return -4;
             }
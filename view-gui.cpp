@@ -34,6 +34,7 @@ using TSampleInput          = TSampleF;
 using TSample               = TSampleI16;
 using TWaveform             = TWaveformI16;
 using TWaveformView         = TWaveformViewI16;
+using TWaveformPyramid      = TWaveformPyramidI16;
 using TPlaybackData         = TPlaybackDataI16;
 
 struct stParameters {
@@ -50,11 +51,6 @@ float plotWaveform(void * data, int i) {
     return waveform->samples[i];
 }
 
-float plotWaveformInverse(void * data, int i) {
-    TWaveformView * waveform = (TWaveformView *)data;
-    return -waveform->samples[i];
-}
-
 SDL_AudioDeviceID g_deviceIdOut = 0;
 TPlaybackData g_playbackData;
 
@@ -72,26 +68,35 @@ bool renderWaveform(TParameters & params, const TWaveform & waveform, const TTra
         static float dragOffset = 0.0f;
         static float scrollSize = 18.0f;
 
-        static auto nviewPrev = nview + 1;
-
-        static TWaveform waveformLowRes = waveform;
+        static TWaveformPyramid waveformPyramid;
+        static TWaveform waveformPixelsMin;
+        static TWaveform waveformPixelsMax;
         static TWaveform waveformThreshold = waveform;
 
-        auto wview = getView(waveformLowRes, offset, nview);
         auto wsize = ImGui::GetContentRegionAvail();
         wsize.y -= 50.0f;
 
+        if (waveformPyramid.n != (int64_t) waveform.size()) {
+            updateWaveformPyramid(getView(waveform, 0), waveformPyramid);
+        }
+
+        const int nPixels = std::max(1, std::min(nview, (int) wsize.x));
+        getWaveformMinMax(getView(waveform, 0), waveformPyramid, offset, nview, nPixels, waveformPixelsMin, waveformPixelsMax);
+
+        auto wviewMin = getView(waveformPixelsMin, 0);
+        auto wviewMax = getView(waveformPixelsMax, 0);
+
         auto mpos = ImGui::GetIO().MousePos;
         auto savePos = ImGui::GetCursorScreenPos();
         auto drawList = ImGui::GetWindowDrawList();
         ImGui::PushStyleColor(ImGuiCol_FrameBg, { 0.3f, 0.3f, 0.3f, 0.3f });
         ImGui::PushStyleColor(ImGuiCol_PlotHistogram, { 1.0f, 1.0f, 1.0f, 1.0f });
-        ImGui::PlotHistogram("##Waveform", plotWaveformInverse, &wview, nview, 0, "Waveform", amin, amax, wsize);
+        ImGui::PlotHistogram("##Waveform", plotWaveform, &wviewMin, wviewMin.n, 0, "Waveform", amin, amax, wsize);
         ImGui::PopStyleColor(2);
         ImGui::SetCursorScreenPos(savePos);
         ImGui::PushStyleColor(ImGuiCol_FrameBg, { 0.1f, 0.1f, 0.1f, 0.0f });
         ImGui::PushStyleColor(ImGuiCol_PlotHistogram, { 1.0f, 1.0f, 1.0f, 1.0f });
-        ImGui::PlotHistogram("##Waveform", plotWaveform, &wview, nview, 0, "Waveform", amin, amax, wsize);
+        ImGui::PlotHistogram("##Waveform", plotWaveform, &wviewMax, wviewMax.n, 0, "Waveform", amin, amax, wsize);
         ImGui::PopStyleColor(2);
         ImGui::SetCursorScreenPos(savePos);
         ImGui::InvisibleButton("##WaveformIB",wsize);
@@ -214,11 +219,6 @@ bool renderWaveform(TParameters & params, const TWaveform & waveform, const TTra
         }
 
         ImGui::PopItemWidth();
-
-        if (nview != nviewPrev) {
-            generateLowResWaveform(waveform, waveformLowRes, std::max(1.0f, nview/wsize.x));
-            nviewPrev = nview;
-        }
     }
     ImGui::End();
 